@@ -0,0 +1,27 @@
+-- Throughput of string.format when a program uses many distinct formats.
+-- Usage: lua format.lua [nformats [ncalls]]
+-- Formats are used round-robin; use more formats than LUA_MAXFMTCACHE
+-- (1536 by default) to measure the cost of replacing cache entries.
+-- Formats stay within 40 bytes, as most real ones do: longer strings
+-- are hashed from every other character only, and formats differing in
+-- a single number would then mostly collide in the cache.
+
+local nformats = tonumber(arg and arg[1]) or 300
+local ncalls = tonumber(arg and arg[2]) or 1000000
+
+local formats = {}
+for i = 1, nformats do
+  formats[i] = "#" .. i .. " user=%s id=%d flags=%x r=%5.2f"
+end
+
+local format = string.format
+local clock = os.clock
+local t0 = clock()
+local n = 0
+for i = 1, ncalls do
+  local s = format(formats[i % nformats + 1], "alice", i, i, i / 7)
+  n = n + #s
+end
+local t = clock() - t0
+print(string.format("%d formats, %d calls: %.2fs (%.0f calls/s)",
+                    nformats, ncalls, t, ncalls / t))
@@ -0,0 +1,907 @@
+/*
+** $Id: laiolib.c $
+** Asynchronous file I/O for coroutines
+** See Copyright Notice in lua.h
+*/
+
+#define laiolib_c
+#define LUA_LIB
+
+/* 'O_CLOEXEC' needs POSIX.1-2008; 'syscall' and 'MAP_POPULATE' are GNU */
+#if !defined(LUA_USE_C89) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE		700
+#endif
+#if defined(LUA_USE_LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "lprefix.h"
+
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** Operations ('aio.open', 'aio.read', ...) called from a coroutine
+** started by 'aio.spawn' do not block: they queue a request and yield
+** the coroutine with 'lua_yieldk'. 'aio.run' is the event loop: at each
+** tick it submits all requests queued since the previous tick as one
+** batch, waits for completions, and resumes the coroutines whose
+** requests completed; the continuations of the operations turn the
+** results into Lua values. Called from anywhere else, operations are
+** done synchronously.
+**
+** Requests are executed by a backend chosen when the library is
+** opened: io_uring (Linux), a pool of threads, or plain blocking calls
+** made when a batch is submitted.
+*/
+
+
+/*
+** LUA_USE_IOURING enables the io_uring backend. It is not on by default
+** because it needs the headers of Linux 5.6 or later; when the running
+** kernel does not support it, the library uses the thread pool.
+*/
+
+#if !defined(LUA_USE_AIOTHREADS) && \
+    (defined(LUA_USE_LINUX) || defined(LUA_USE_MACOSX))
+#define LUA_USE_AIOTHREADS
+#endif
+
+
+#define LOOP		"aio.Loop"
+
+
+/* number of entries in the io_uring submission queue */
+#if !defined(LUAI_AIORING)
+#define LUAI_AIORING	256
+#endif
+
+/* number of threads in the pool */
+#if !defined(LUAI_AIOTHREADS)
+#define LUAI_AIOTHREADS	8
+#endif
+
+
+enum { BSYNC, BTHREADS, BURING };  /* backends */
+
+static const char *const backendnames[] = {"sync", "threads", "io_uring"};
+
+
+enum { OP_OPEN, OP_READ, OP_WRITE, OP_FSYNC, OP_CLOSE };
+
+
+typedef struct Request {
+  struct Request *next;  /* in a queue */
+  lua_State *co;  /* coroutine waiting for the request */
+  int op;
+  int fd;
+  int flags;  /* for 'open' */
+  const char *path;  /* for 'open' */
+  char *buff;  /* data to read or write */
+  size_t len;  /* size of 'buff' */
+  lua_Integer offset;  /* file offset (-1 for the current position) */
+  long res;  /* result (>= 0) or negated error code */
+  int waiting;  /* true from queued until the event loop takes it back */
+} Request;
+
+
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(LUA_USE_AIOTHREADS)
+#include <pthread.h>
+#endif
+
+#if defined(LUA_USE_IOURING)
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+/*
+** {======================================================
+** Backends
+** =======================================================
+*/
+
+typedef struct Loop {
+  int backend;
+  lua_State *yielded;  /* coroutine that has just queued a request */
+  Request *pending;  /* requests queued in the current tick */
+  Request **lastpending;  /* where to link the next pending request */
+  Request *ready;  /* completed requests waiting to be resumed */
+  int inflight;  /* number of submitted requests not completed yet */
+#if defined(LUA_USE_AIOTHREADS)
+  pthread_mutex_t mutex;
+  pthread_cond_t haswork;  /* signaled when 'work' becomes non empty */
+  pthread_cond_t hasdone;  /* signaled when 'done' becomes non empty */
+  Request *work;  /* requests for the threads */
+  Request *done;  /* requests completed by the threads */
+  int nthreads;  /* number of threads running */
+  int stop;  /* true when threads must finish */
+  pthread_t threads[LUAI_AIOTHREADS];
+#endif
+#if defined(LUA_USE_IOURING)
+  int ringfd;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sqentries, cqentries;
+  unsigned tosubmit;  /* entries added to the queue but not submitted */
+  void *sqring, *cqring;
+  size_t sqringsize, cqringsize;
+#endif
+} Loop;
+
+
+/* execute a request with a blocking call */
+static void execute (Request *r) {
+  long res = -1;
+  switch (r->op) {
+    case OP_OPEN:
+      res = open(r->path, r->flags, 0666);
+      break;
+    case OP_READ:
+      res = (r->offset < 0) ? read(r->fd, r->buff, r->len)
+                            : pread(r->fd, r->buff, r->len, (off_t)r->offset);
+      break;
+    case OP_WRITE:
+      res = (r->offset < 0) ? write(r->fd, r->buff, r->len)
+                            : pwrite(r->fd, r->buff, r->len, (off_t)r->offset);
+      break;
+    case OP_FSYNC:
+      res = fsync(r->fd);
+      break;
+    case OP_CLOSE:
+      res = close(r->fd);
+      break;
+  }
+  r->res = (res < 0) ? -(long)errno : res;
+}
+
+
+/* add a list of completed requests to the ready list */
+static void addready (Loop *lp, Request *r) {
+  while (r != NULL) {
+    Request *next = r->next;
+    r->next = lp->ready;
+    lp->ready = r;
+    lp->inflight--;
+    r = next;
+  }
+}
+
+
+#if defined(LUA_USE_AIOTHREADS)	/* { */
+
+static void *worker (void *ud) {
+  Loop *lp = (Loop *)ud;
+  pthread_mutex_lock(&lp->mutex);
+  for (;;) {
+    Request *r;
+    while (lp->work == NULL && !lp->stop)
+      pthread_cond_wait(&lp->haswork, &lp->mutex);
+    if ((r = lp->work) == NULL)  /* stopping and no more work? */
+      break;
+    lp->work = r->next;
+    pthread_mutex_unlock(&lp->mutex);
+    execute(r);
+    pthread_mutex_lock(&lp->mutex);
+    r->next = lp->done;
+    lp->done = r;
+    pthread_cond_signal(&lp->hasdone);
+  }
+  pthread_mutex_unlock(&lp->mutex);
+  return NULL;
+}
+
+
+static void initthreads (Loop *lp) {
+  pthread_mutex_init(&lp->mutex, NULL);
+  pthread_cond_init(&lp->haswork, NULL);
+  pthread_cond_init(&lp->hasdone, NULL);
+  lp->work = lp->done = NULL;
+  lp->nthreads = 0;  /* threads are created with the first request */
+  lp->stop = 0;
+}
+
+
+static void submitthreads (lua_State *L, Loop *lp) {
+  Request *r;
+  while (lp->nthreads < LUAI_AIOTHREADS) {
+    if (pthread_create(&lp->threads[lp->nthreads], NULL, worker, lp) != 0) {
+      if (lp->nthreads == 0)
+        luaL_error(L, "cannot create threads for asynchronous I/O");
+      break;  /* work with the threads it has */
+    }
+    lp->nthreads++;
+  }
+  pthread_mutex_lock(&lp->mutex);
+  while ((r = lp->pending) != NULL) {  /* move all requests to 'work' */
+    lp->pending = r->next;
+    r->next = lp->work;
+    lp->work = r;
+    lp->inflight++;
+  }
+  pthread_cond_broadcast(&lp->haswork);
+  pthread_mutex_unlock(&lp->mutex);
+}
+
+
+static void waitthreads (Loop *lp) {
+  Request *r;
+  pthread_mutex_lock(&lp->mutex);
+  while (lp->done == NULL)
+    pthread_cond_wait(&lp->hasdone, &lp->mutex);
+  r = lp->done;
+  lp->done = NULL;
+  pthread_mutex_unlock(&lp->mutex);
+  addready(lp, r);
+}
+
+
+/* finish all work and stop the threads */
+static void closethreads (Loop *lp) {
+  int i;
+  pthread_mutex_lock(&lp->mutex);
+  lp->stop = 1;
+  pthread_cond_broadcast(&lp->haswork);
+  pthread_mutex_unlock(&lp->mutex);
+  for (i = 0; i < lp->nthreads; i++)
+    pthread_join(lp->threads[i], NULL);
+  pthread_mutex_destroy(&lp->mutex);
+  pthread_cond_destroy(&lp->haswork);
+  pthread_cond_destroy(&lp->hasdone);
+}
+
+#endif				/* } */
+
+
+#if defined(LUA_USE_IOURING)	/* { */
+
+#define loadacquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define storerelease(p,v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+
+static int uringenter (Loop *lp, unsigned tosubmit, unsigned mincomplete) {
+  return (int)syscall(__NR_io_uring_enter, lp->ringfd, tosubmit, mincomplete,
+                      mincomplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+
+/* check that the kernel supports all operations used here */
+static int probering (int fd) {
+  static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ,
+                            IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE};
+  struct {
+    struct io_uring_probe p;
+    struct io_uring_probe_op ops[IORING_OP_LAST];
+  } probe;
+  unsigned i;
+  memset(&probe, 0, sizeof(probe));
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+              &probe, IORING_OP_LAST) < 0)
+    return 0;
+  for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (ops[i] > probe.p.last_op ||
+        !(probe.ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+      return 0;
+  }
+  return 1;
+}
+
+
+static void *mapring (int fd, size_t size, off_t what) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, what);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+
+/* try to set up an io_uring instance; returns 0 if not possible */
+static int initring (Loop *lp) {
+  struct io_uring_params p;
+  char *sq, *cq;
+  memset(&p, 0, sizeof(p));
+  lp->ringfd = (int)syscall(__NR_io_uring_setup, LUAI_AIORING, &p);
+  if (lp->ringfd < 0)
+    return 0;
+  if (!(p.features & IORING_FEAT_RW_CUR_POS) || !probering(lp->ringfd)) {
+    close(lp->ringfd);
+    return 0;
+  }
+  lp->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  lp->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {  /* both rings in one map? */
+    if (lp->cqringsize > lp->sqringsize)
+      lp->sqringsize = lp->cqringsize;
+    lp->cqringsize = 0;
+  }
+  lp->sqring = mapring(lp->ringfd, lp->sqringsize, IORING_OFF_SQ_RING);
+  lp->cqring = (lp->cqringsize == 0) ? lp->sqring
+             : mapring(lp->ringfd, lp->cqringsize, IORING_OFF_CQ_RING);
+  lp->sqes = (struct io_uring_sqe *)mapring(lp->ringfd,
+                 p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+  if (lp->sqring == NULL || lp->cqring == NULL || lp->sqes == NULL) {
+    if (lp->sqring) munmap(lp->sqring, lp->sqringsize);
+    if (lp->cqring && lp->cqringsize > 0) munmap(lp->cqring, lp->cqringsize);
+    if (lp->sqes)
+      munmap(lp->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    close(lp->ringfd);
+    return 0;
+  }
+  sq = (char *)lp->sqring;
+  cq = (char *)lp->cqring;
+  lp->sqhead = (unsigned *)(sq + p.sq_off.head);
+  lp->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  lp->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+  lp->sqarray = (unsigned *)(sq + p.sq_off.array);
+  lp->cqhead = (unsigned *)(cq + p.cq_off.head);
+  lp->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  lp->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+  lp->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  lp->sqentries = p.sq_entries;
+  lp->cqentries = p.cq_entries;
+  lp->tosubmit = 0;
+  return 1;
+}
+
+
+static void fillsqe (struct io_uring_sqe *sqe, Request *r) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = r->fd;
+  sqe->user_data = (uintptr_t)r;
+  switch (r->op) {
+    case OP_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)r->path;
+      sqe->len = 0666;  /* mode */
+      sqe->open_flags = (unsigned)r->flags;
+      break;
+    case OP_READ: case OP_WRITE:
+      sqe->opcode = (r->op == OP_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+      sqe->addr = (uintptr_t)r->buff;
+      sqe->len = (unsigned)r->len;
+      sqe->off = (r->offset < 0) ? (uint64_t)-1 : (uint64_t)r->offset;
+      break;
+    case OP_FSYNC:
+      sqe->opcode = IORING_OP_FSYNC;
+      break;
+    case OP_CLOSE:
+      sqe->opcode = IORING_OP_CLOSE;
+      break;
+  }
+}
+
+
+/*
+** Move pending requests to the submission queue, while there is space
+** for them there and for their completions in the completion queue.
+** (The kernel is told about them by 'waitring'.)
+*/
+static void submitring (Loop *lp) {
+  unsigned tail = *lp->sqtail;
+  unsigned head = loadacquire(lp->sqhead);
+  Request *r;
+  while ((r = lp->pending) != NULL && tail - head < lp->sqentries &&
+         (unsigned)lp->inflight < lp->cqentries) {
+    unsigned idx = tail & *lp->sqmask;
+    fillsqe(&lp->sqes[idx], r);
+    lp->sqarray[idx] = idx;
+    tail++;
+    lp->pending = r->next;
+    lp->inflight++;
+    lp->tosubmit++;
+  }
+  if (lp->pending == NULL)
+    lp->lastpending = &lp->pending;
+  storerelease(lp->sqtail, tail);
+}
+
+
+/* collect completed requests into the ready list */
+static int reapring (Loop *lp) {
+  unsigned head = *lp->cqhead;
+  unsigned tail = loadacquire(lp->cqtail);
+  int n = 0;
+  for (; head != tail; head++, n++) {
+    struct io_uring_cqe *cqe = &lp->cqes[head & *lp->cqmask];
+    Request *r = (Request *)(uintptr_t)cqe->user_data;
+    r->res = cqe->res;
+    r->next = NULL;
+    addready(lp, r);
+  }
+  storerelease(lp->cqhead, head);
+  return n;
+}
+
+
+/* submit queued entries and wait for at least one completion */
+static void waitring (Loop *lp) {
+  while (reapring(lp) == 0) {
+    int n = uringenter(lp, lp->tosubmit, 1);
+    if (n >= 0)
+      lp->tosubmit -= (unsigned)n;
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      break;  /* should not happen; avoid looping forever */
+  }
+}
+
+
+/* wait for all requests in flight and release the ring */
+static void closering (Loop *lp) {
+  while (lp->inflight > 0)
+    waitring(lp);
+  munmap(lp->sqes, lp->sqentries * sizeof(struct io_uring_sqe));
+  if (lp->cqringsize > 0)
+    munmap(lp->cqring, lp->cqringsize);
+  munmap(lp->sqring, lp->sqringsize);
+  close(lp->ringfd);
+}
+
+#endif				/* } */
+
+
+static void initloop (Loop *lp) {
+  lp->yielded = NULL;
+  lp->pending = lp->ready = NULL;
+  lp->lastpending = &lp->pending;
+  lp->inflight = 0;
+  lp->backend = BSYNC;
+#if defined(LUA_USE_AIOTHREADS)
+  initthreads(lp);
+  lp->backend = BTHREADS;
+#endif
+#if defined(LUA_USE_IOURING)
+  if (initring(lp))
+    lp->backend = BURING;
+#endif
+}
+
+
+/* submit all pending requests */
+static void submit (lua_State *L, Loop *lp) {
+  switch (lp->backend) {
+#if defined(LUA_USE_IOURING)
+    case BURING: submitring(lp); return;
+#endif
+#if defined(LUA_USE_AIOTHREADS)
+    case BTHREADS: submitthreads(L, lp); break;
+#endif
+    default: {  /* BSYNC */
+      Request *r;
+      while ((r = lp->pending) != NULL) {
+        lp->pending = r->next;
+        execute(r);
+        r->next = NULL;
+        lp->inflight++;
+        addready(lp, r);
+      }
+      break;
+    }
+  }
+  lp->lastpending = &lp->pending;
+  (void)L;
+}
+
+
+/* wait until some submitted request completes */
+static void waitsome (Loop *lp) {
+  switch (lp->backend) {
+#if defined(LUA_USE_IOURING)
+    case BURING: waitring(lp); break;
+#endif
+#if defined(LUA_USE_AIOTHREADS)
+    case BTHREADS: waitthreads(lp); break;
+#endif
+    default: break;  /* BSYNC: requests complete when submitted */
+  }
+  (void)lp;
+}
+
+
+static void closeloop (Loop *lp) {
+#if defined(LUA_USE_IOURING)
+  if (lp->backend == BURING)
+    closering(lp);
+#endif
+#if defined(LUA_USE_AIOTHREADS)
+  closethreads(lp);  /* (also initialized with io_uring) */
+#endif
+  (void)lp;
+}
+
+/* }====================================================== */
+
+
+#else				/* }{ */
+
+/* ISO C: no file descriptors */
+
+typedef struct Loop {
+  int backend;
+  lua_State *yielded;
+} Loop;
+
+#define initloop(lp)		((lp)->backend = BSYNC, (lp)->yielded = NULL)
+#define closeloop(lp)		((void)lp)
+
+#endif				/* } */
+
+
+
+/*
+** {======================================================
+** Operations
+** =======================================================
+*/
+
+/* upvalues of all library functions */
+/*
+** The set of 'aio' coroutines maps each one to the request it is
+** waiting for (or to true). So, it anchors all pending and in-flight
+** requests (and the strings they use) until the event loop takes them
+** back; it is also the user value of the loop, which keeps it alive
+** until the loop is closed and its requests are all completed.
+*/
+#define LOOPIDX		lua_upvalueindex(1)
+#define THREADSIDX	lua_upvalueindex(2)  /* set of 'aio' coroutines */
+
+
+#define getloop(L)	((Loop *)lua_touserdata(L, LOOPIDX))
+
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+/* check whether 'L' is a coroutine started by 'aio.spawn' */
+static int isaiothread (lua_State *L) {
+  int res;
+  if (!lua_isyieldable(L))
+    return 0;
+  lua_pushthread(L);
+  res = (lua_rawget(L, THREADSIDX) != LUA_TNIL);
+  lua_pop(L, 1);
+  return res;
+}
+
+
+/* new request, with 'extra' bytes of buffer, on the top of the stack */
+static Request *newrequest (lua_State *L, int op, size_t extra) {
+  Request *r = (Request *)lua_newuserdata(L, sizeof(Request) + extra);
+  memset(r, 0, sizeof(Request));
+  r->op = op;
+  r->fd = -1;
+  r->offset = -1;
+  r->buff = (char *)(r + 1);
+  r->len = extra;
+  return r;
+}
+
+
+/*
+** Perform the request on the top of the stack: queue it and yield, if
+** running in an 'aio' coroutine, or execute it right away. In both
+** cases 'k' builds the results.
+*/
+static int dorequest (lua_State *L, Request *r, lua_KFunction k) {
+  int ctx = lua_gettop(L);  /* index of the request */
+  if (isaiothread(L)) {
+    Loop *lp = getloop(L);
+    r->co = L;
+    r->next = NULL;
+    r->waiting = 1;
+    lua_pushthread(L);
+    lua_pushvalue(L, ctx);
+    lua_rawset(L, THREADSIDX);  /* anchor request until it completes */
+    *lp->lastpending = r;
+    lp->lastpending = &r->next;
+    lp->yielded = L;
+    return lua_yieldk(L, 0, ctx, k);
+  }
+  else {
+    execute(r);
+    return k(L, LUA_OK, ctx);
+  }
+}
+
+
+/*
+** Get the request of a continuation. The request must have been taken
+** back by the event loop: the coroutine cannot be resumed from anywhere
+** else while it waits.
+*/
+static Request *getrequest (lua_State *L, lua_KContext ctx) {
+  Request *r = (Request *)lua_touserdata(L, (int)ctx);
+  if (r->waiting)
+    luaL_error(L, "aio coroutine resumed while waiting for a request");
+  return r;
+}
+
+
+static int failure (lua_State *L, Request *r) {
+  errno = (int)-r->res;
+  return luaL_fileresult(L, 0, r->path);
+}
+
+
+static int finishopen (lua_State *L, int status, lua_KContext ctx) {
+  Request *r = getrequest(L, ctx);
+  (void)status;
+  if (r->res < 0) return failure(L, r);
+  lua_pushinteger(L, r->res);
+  return 1;
+}
+
+
+static int finishread (lua_State *L, int status, lua_KContext ctx) {
+  Request *r = getrequest(L, ctx);
+  (void)status;
+  if (r->res < 0) return failure(L, r);
+  if (r->res == 0 && r->len > 0)  /* end of file? */
+    lua_pushnil(L);
+  else
+    lua_pushlstring(L, r->buff, (size_t)r->res);
+  return 1;
+}
+
+
+static int finishwrite (lua_State *L, int status, lua_KContext ctx) {
+  Request *r = getrequest(L, ctx);
+  (void)status;
+  if (r->res < 0) return failure(L, r);
+  lua_pushinteger(L, r->res);  /* number of bytes written */
+  return 1;
+}
+
+
+static int finishok (lua_State *L, int status, lua_KContext ctx) {
+  Request *r = getrequest(L, ctx);
+  (void)status;
+  if (r->res < 0) return failure(L, r);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int checkfd (lua_State *L, int arg) {
+  lua_Integer fd = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, 0 <= fd && fd <= INT_MAX, arg, "invalid file descriptor");
+  return (int)fd;
+}
+
+
+static lua_Integer checkoffset (lua_State *L, int arg) {
+  lua_Integer off = luaL_optinteger(L, arg, -1);
+  luaL_argcheck(L, off >= -1, arg, "invalid offset");
+  return off;
+}
+
+
+/* aio.open(filename [, mode]): open a file, returning a descriptor */
+static int aio_open (lua_State *L) {
+  static const char *const modes[] =
+    {"r", "w", "a", "r+", "w+", "a+", "rb", "wb", "ab", "r+b", "w+b", "a+b",
+     NULL};
+  static const int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+    O_WRONLY | O_CREAT | O_APPEND, O_RDWR, O_RDWR | O_CREAT | O_TRUNC,
+    O_RDWR | O_CREAT | O_APPEND};
+  const char *path = luaL_checkstring(L, 1);
+  int mode = luaL_checkoption(L, 2, "r", modes);
+  Request *r = newrequest(L, OP_OPEN, 0);
+  lua_pushvalue(L, 1);
+  lua_setuservalue(L, -2);  /* request keeps the path alive */
+  r->path = path;
+  r->flags = flags[mode % 6] | O_CLOEXEC;
+  return dorequest(L, r, finishopen);
+}
+
+
+/*
+** aio.read(fd, n [, offset]): read up to 'n' bytes, at 'offset' or at
+** the current position
+*/
+static int aio_read (lua_State *L) {
+  int fd = checkfd(L, 1);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  lua_Integer off = checkoffset(L, 3);
+  Request *r;
+  luaL_argcheck(L, 0 <= n && n <= INT_MAX, 2, "invalid size");
+  r = newrequest(L, OP_READ, (size_t)n);
+  r->fd = fd;
+  r->offset = off;
+  return dorequest(L, r, finishread);
+}
+
+
+/* aio.write(fd, s [, offset]) */
+static int aio_write (lua_State *L) {
+  int fd = checkfd(L, 1);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  lua_Integer off = checkoffset(L, 3);
+  Request *r;
+  luaL_argcheck(L, l <= INT_MAX, 2, "string too long");
+  r = newrequest(L, OP_WRITE, 0);
+  lua_pushvalue(L, 2);
+  lua_setuservalue(L, -2);  /* request keeps the string alive */
+  r->fd = fd;
+  r->buff = (char *)s;
+  r->len = l;
+  r->offset = off;
+  return dorequest(L, r, finishwrite);
+}
+
+
+static int aio_fsync (lua_State *L) {
+  int fd = checkfd(L, 1);
+  Request *r = newrequest(L, OP_FSYNC, 0);
+  r->fd = fd;
+  return dorequest(L, r, finishok);
+}
+
+
+static int aio_close (lua_State *L) {
+  int fd = checkfd(L, 1);
+  Request *r = newrequest(L, OP_CLOSE, 0);
+  r->fd = fd;
+  return dorequest(L, r, finishok);
+}
+
+
+#else				/* }{ */
+
+static int notsupported (lua_State *L) {
+  return luaL_error(L, "asynchronous I/O not supported");
+}
+
+#define aio_open	notsupported
+#define aio_read	notsupported
+#define aio_write	notsupported
+#define aio_fsync	notsupported
+#define aio_close	notsupported
+
+#endif				/* } */
+
+
+/*
+** Resume coroutine 'co' with 'narg' values on its stack. If it ends,
+** remove it from the set of 'aio' coroutines (propagating its errors).
+*/
+static void resumeaio (lua_State *L, lua_State *co, int narg) {
+  Loop *lp = getloop(L);
+  int status;
+  lp->yielded = NULL;
+  lua_pushthread(co);
+  lua_xmove(co, L, 1);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, THREADSIDX);  /* coroutine is not waiting for a request */
+  status = lua_resume(co, L, narg);
+  if (status == LUA_YIELD) {
+    if (lp->yielded == co)
+      return;  /* waiting for a request */
+    /* else it yielded by other means than an operation */
+    lua_pushliteral(L, "attempt to yield from an aio coroutine");
+    status = LUA_ERRRUN;
+  }
+  else if (status != LUA_OK)
+    lua_xmove(co, L, 1);  /* move error message */
+  lua_pushthread(co);
+  lua_xmove(co, L, 1);
+  lua_pushnil(L);
+  lua_rawset(L, THREADSIDX);  /* coroutine is not waiting anymore */
+  if (status != LUA_OK)
+    lua_error(L);  /* propagate error */
+}
+
+
+/* aio.spawn(f, ...): run 'f(...)' in a new coroutine */
+static int aio_spawn (lua_State *L) {
+  int n = lua_gettop(L);
+  lua_State *co;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  co = lua_newthread(L);
+  lua_pushvalue(L, -1);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, THREADSIDX);  /* add it to the set of 'aio' coroutines */
+  lua_insert(L, 1);  /* keep coroutine at the bottom */
+  lua_xmove(L, co, n);  /* move function and arguments to coroutine */
+  resumeaio(L, co, n - 1);
+  return 1;  /* return the coroutine */
+}
+
+
+/*
+** aio.run(): the event loop. Runs until there are no more requests,
+** which means all 'aio' coroutines have finished.
+*/
+static int aio_run (lua_State *L) {
+#if defined(LUA_USE_POSIX)
+  Loop *lp = getloop(L);
+  if (isaiothread(L))
+    return luaL_error(L, "cannot run the event loop inside an aio coroutine");
+  for (;;) {
+    Request *r;
+    while ((r = lp->ready) != NULL) {  /* resume all completed requests */
+      lp->ready = r->next;
+      r->waiting = 0;
+      if (lua_status(r->co) == LUA_YIELD)
+        resumeaio(L, r->co, 0);
+      else {  /* coroutine died by an error when resumed from outside */
+        if (r->op == OP_OPEN && r->res >= 0)
+          close((int)r->res);  /* nobody will get this descriptor */
+        lua_pushthread(r->co);
+        lua_xmove(r->co, L, 1);
+        lua_pushnil(L);
+        lua_rawset(L, THREADSIDX);  /* release coroutine and request */
+      }
+    }
+    if (lp->pending != NULL)
+      submit(L, lp);  /* submit requests queued in this tick */
+    if (lp->ready == NULL) {
+      if (lp->inflight == 0 && lp->pending == NULL)
+        break;  /* nothing else to do */
+      waitsome(lp);
+    }
+  }
+#else
+  (void)L;
+#endif
+  return 0;
+}
+
+
+static int loop_gc (lua_State *L) {
+  Loop *lp = (Loop *)luaL_checkudata(L, 1, LOOP);
+  closeloop(lp);
+  return 0;
+}
+
+/* }====================================================== */
+
+
+static const luaL_Reg aiolib[] = {
+  {"close", aio_close},
+  {"fsync", aio_fsync},
+  {"open", aio_open},
+  {"read", aio_read},
+  {"run", aio_run},
+  {"spawn", aio_spawn},
+  {"write", aio_write},
+  {"backend", NULL},  /* place holder */
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_aio (lua_State *L) {
+  Loop *lp;
+  luaL_newlibtable(L, aiolib);
+  lp = (Loop *)lua_newuserdata(L, sizeof(Loop));
+  initloop(lp);
+  luaL_newmetatable(L, LOOP);
+  lua_pushcfunction(L, loop_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_newtable(L);  /* set of 'aio' coroutines */
+  lua_pushvalue(L, -1);
+  lua_setuservalue(L, -3);  /* loop keeps it alive */
+  luaL_setfuncs(L, aiolib, 2);
+  lua_pushstring(L, backendnames[lp->backend]);
+  lua_setfield(L, -2, "backend");
+  return 1;
+}
+
@@ -964,6 +964,37 @@ LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
 }
 
 
+// Pushes t[i], ..., t[j] (raw) to the stack, where t is the table at the given
+// index, if these elements are all in the array part of t. Returns 0, pushing
+// nothing, otherwise. The caller must ensure there is room for them on the
+// stack (see lua_checkstack()).
+LUA_API int lua_rawunpack (lua_State *L, int idx, lua_Integer i,
+                                                  lua_Integer j) {
+  StkId o;
+  Table *t;
+  int done = 0;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  t = hvalue(o);
+  if (i > j)
+    done = 1;  // Empty range.
+  else if (i >= 1 && l_castS2U(j) <= t->sizearray) {
+    const TValue *v = &t->array[i - 1];
+    const TValue *last = &t->array[j - 1];
+    api_check(L, j - i < L->ci->top - L->top, "stack overflow");
+    // Copy the values straight out of the array part, with no lookups.
+    for (; v <= last; v++) {
+      setobj2s(L, L->top, v);
+      L->top++;
+    }
+    done = 1;
+  }
+  lua_unlock(L);
+  return done;
+}
+
+
 // Pushes a new, empty Lua table to the stack. If `narray` or `nrec` aren't 0,
 // preallocates the array part and/or the hash part, respectively, to be able to
 // hold that many elements.
@@ -1181,6 +1212,39 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
 }
 
 
+// Copies src[f], ..., src[e] into dst[t], dst[t+1], ..., where src and dst are
+// the tables at the given indices (which may be the same, with overlapping
+// ranges), as the corresponding raw assignments would, if both ranges are in
+// the array parts of the tables. The elements are moved as one block of memory.
+// Returns 0, leaving the tables untouched, otherwise.
+LUA_API int lua_rawmove (lua_State *L, int src, lua_Integer f, lua_Integer e,
+                                       lua_Integer t, int dst) {
+  StkId s, d;
+  int done;
+  lua_lock(L);
+  s = index2addr(L, src);
+  d = index2addr(L, dst);
+  api_check(L, ttistable(s) && ttistable(d), "table expected");
+  // luaH_move() takes care of the barrier, since no single value is at hand.
+  done = luaH_move(L, hvalue(s), f, e, t, hvalue(d));
+  lua_unlock(L);
+  return done;
+}
+
+
+// Removes all entries (raw) from the table at the given index, keeping the
+// memory allocated for its array and hash parts for new entries.
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId o;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  // Only nils are stored, so there is no need for a barrier.
+  luaH_clear(hvalue(o));
+  lua_unlock(L);
+}
+
+
 // Set the metatable of the object at the given index to the table at the top of
 // the stack. Unset the metatable of the object if nil is the top value of the
 // stack. If the object has a type other than table or userdata, this sets the
@@ -1484,6 +1548,34 @@ LUA_API int lua_next (lua_State *L, int idx) {
 }
 
 
+// Tells the core that f is one of the library iterators listed in lua.h, so
+// that generic 'for' loops over it can do its work inline (see OP_TFORCALL in
+// lvm.c) instead of calling it. f must behave exactly like that iterator.
+LUA_API void lua_setiterator (lua_State *L, int what, lua_CFunction f) {
+  lua_lock(L);
+  api_check(L, 0 <= what && what < LUA_NUMITERS, "invalid iterator");
+  G(L)->iterf[what] = f;
+  lua_unlock(L);
+}
+
+
+// Sorts t[1..n] in place, with the order of '<', when these elements are all
+// numbers or all strings stored in the array part of the table. Returns 0
+// (leaving the table untouched) when that is not the case, so the caller must
+// sort some other way. Large arrays are split among up to nthreads threads,
+// which gives the same result as sorting them with a single one.
+LUA_API int lua_rawsort (lua_State *L, int idx, lua_Integer n, int nthreads) {
+  StkId t;
+  int done;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  done = luaH_sort(L, hvalue(t), n, nthreads);
+  lua_unlock(L);
+  return done;
+}
+
+
 LUA_API void lua_concat (lua_State *L, int n) {
   lua_lock(L);
   api_checknelems(L, n);
@@ -1500,6 +1592,28 @@ LUA_API void lua_concat (lua_State *L, int n) {
 }
 
 
+// Pushes the concatenation of t[i], ..., t[j], separated by sep, where t is the
+// table at the given index, if these elements are all strings or numbers in the
+// array part of t. Unlike lua_concat() it builds the result in place, with a
+// single allocation. Returns 0, pushing nothing, otherwise.
+LUA_API int lua_rawconcat (lua_State *L, int idx, lua_Integer i,
+                           lua_Integer j, const char *sep, size_t lsep) {
+  StkId t;
+  TString *ts;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  ts = luaH_concat(L, hvalue(t), i, j, sep, lsep);
+  if (ts != NULL) {
+    setsvalue2s(L, L->top, ts);
+    api_incr_top(L);
+    luaC_checkGC(L);
+  }
+  lua_unlock(L);
+  return (ts != NULL);
+}
+
+
 LUA_API void lua_len (lua_State *L, int idx) {
   StkId t;
   lua_lock(L);
@@ -487,6 +487,8 @@ LUAMOD_API int luaopen_base (lua_State *L) {
   /* open lib into global table */
   lua_pushglobaltable(L);
   luaL_setfuncs(L, base_funcs, 0);
+  lua_setiterator(L, LUA_ITERNEXT, luaB_next);
+  lua_setiterator(L, LUA_ITERIPAIRS, ipairsaux);
   /* set global _G */
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "_G");
@@ -1201,3 +1201,114 @@ void luaK_setlist (FuncState *fs, int base, int nelems, int tostore) {
   fs->freereg = base + 1;  /* free registers with list values */
 }
 
+
+
+/*
+** {======================================================
+** Table templates
+** =======================================================
+*/
+
+/*
+** Runs the code of a table constructor, from its OP_NEWTABLE at 'pc' to
+** the end of the code, with the same steps as the VM, storing into 't'
+** (if not NULL). Returns 0 as soon as it finds something other than
+** constants being stored into the new table (or a key that would raise
+** an error), 1 otherwise.
+*/
+static int runconstructor (FuncState *fs, int pc, Table *t) {
+  lua_State *L = fs->ls->L;
+  const Instruction *code = fs->f->code;
+  const TValue *k = fs->f->k;
+  int base = GETARG_A(code[pc]);  /* register with the new table */
+  TValue regs[MAXREGS];  /* constants loaded into registers */
+  lu_byte loaded[MAXREGS];
+  int i;
+  for (i = base; i < MAXREGS; i++) loaded[i] = 0;
+  for (i = pc + 1; i < fs->pc; i++) {
+    Instruction ins = code[i];
+    int a = GETARG_A(ins);
+    int b = GETARG_B(ins);
+    int c = GETARG_C(ins);
+    switch (GET_OPCODE(ins)) {
+      case OP_LOADK: case OP_LOADKX: {
+        int bx = (GET_OPCODE(ins) == OP_LOADK) ? GETARG_Bx(ins)
+                                               : GETARG_Ax(code[++i]);
+        if (a <= base) return 0;
+        setobj(L, &regs[a], &k[bx]);
+        loaded[a] = 1;
+        break;
+      }
+      case OP_LOADBOOL: {
+        if (a <= base || c != 0) return 0;
+        setbvalue(&regs[a], b);
+        loaded[a] = 1;
+        break;
+      }
+      case OP_LOADNIL: {
+        if (a <= base) return 0;
+        for (; b >= 0; a++, b--) {
+          setnilvalue(&regs[a]);
+          loaded[a] = 1;
+        }
+        break;
+      }
+      case OP_SETTABLE: {
+        const TValue *key = ISK(b) ? &k[INDEXK(b)] :
+                            (b > base && loaded[b]) ? &regs[b] : NULL;
+        const TValue *val = ISK(c) ? &k[INDEXK(c)] :
+                            (c > base && loaded[c]) ? &regs[c] : NULL;
+        if (a != base || key == NULL || val == NULL || ttisnil(key) ||
+            (ttisfloat(key) && luai_numisnan(fltvalue(key))))
+          return 0;
+        if (t != NULL)
+          setobj2t(L, luaH_set(L, t, key), val);
+        break;
+      }
+      case OP_SETLIST: {
+        if (c == 0) c = GETARG_Ax(code[++i]);
+        if (a != base || b == 0) return 0;  /* multiple results? */
+        for (; b > 0; b--) {
+          if (!loaded[a + b]) return 0;
+          if (t != NULL) {
+            unsigned int last = (c - 1) * LFIELDS_PER_FLUSH + b;
+            if (last > t->sizearray)  /* as in the VM */
+              luaH_resizearray(L, t, last);
+            luaH_setint(L, t, last, &regs[a + b]);
+          }
+        }
+        break;
+      }
+      default: return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Called at the end of a table constructor whose OP_NEWTABLE is at
+** 'pc'. If the constructor only stores constants, builds its table now
+** (as a constant of the function, never visible to programs) and
+** replaces its code by an OP_DUPTABLE, which copies that table.
+*/
+void luaK_tabletemplate (FuncState *fs, int pc) {
+  lua_State *L = fs->ls->L;
+  Instruction *ip = &fs->f->code[pc];
+  Table *t;
+  TValue v;
+  int k;
+  if (fs->pc == pc + 1 || fs->nk > MAXARG_Bx ||  /* empty or no room? */
+      !runconstructor(fs, pc, NULL))  /* not only constants? */
+    return;
+  t = luaH_new(L);
+  sethvalue(L, &v, t);
+  k = addk(fs, &v, &v);  /* also anchors the table */
+  luaH_resize(L, t, luaO_fb2int(GETARG_B(*ip)), luaO_fb2int(GETARG_C(*ip)));
+  /* its contents are constants of the function, so need no barrier */
+  runconstructor(fs, pc, t);
+  *ip = CREATE_ABx(OP_DUPTABLE, GETARG_A(*ip), k);
+  fs->pc = pc + 1;  /* remove the rest of the constructor */
+}
+
+/* }====================================================== */
@@ -16,6 +16,7 @@
 
 #include "lobject.h"
 #include "lstate.h"
+#include "ltable.h"
 #include "lundump.h"
 
 
@@ -95,36 +96,70 @@ static void DumpCode (const Proto *f, DumpState *D) {
 
 static void DumpFunction(const Proto *f, TString *psource, DumpState *D);
 
-static void DumpConstants (const Proto *f, DumpState *D) {
+static void DumpValue (const TValue *o, DumpState *D);
+
+
+/*
+** Dumps a table template (see OP_DUPTABLE): its sizes, its array part,
+** and the key-value pairs in its hash part
+*/
+static void DumpTable (const Table *t, DumpState *D) {
+  int sizenode = allocsizenode(t);
+  int n = 0;
   int i;
-  int n = f->sizek;
+  for (i = 0; i < sizenode; i++)
+    if (!ttisnil(gval(gnode(t, i)))) n++;
+  DumpInt(cast_int(t->sizearray), D);
+  DumpInt(sizenode, D);
   DumpInt(n, D);
-  for (i = 0; i < n; i++) {
-    const TValue *o = &f->k[i];
-    DumpByte(ttype(o), D);
-    switch (ttype(o)) {
-    case LUA_TNIL:
-      break;
-    case LUA_TBOOLEAN:
-      DumpByte(bvalue(o), D);
-      break;
-    case LUA_TNUMFLT:
-      DumpNumber(fltvalue(o), D);
-      break;
-    case LUA_TNUMINT:
-      DumpInteger(ivalue(o), D);
-      break;
-    case LUA_TSHRSTR:
-    case LUA_TLNGSTR:
-      DumpString(tsvalue(o), D);
-      break;
-    default:
-      lua_assert(0);
+  for (i = 0; i < cast_int(t->sizearray); i++)
+    DumpValue(&t->array[i], D);
+  for (i = 0; i < sizenode; i++) {
+    const Node *node = gnode(t, i);
+    if (!ttisnil(gval(node))) {
+      DumpValue(gkey(node), D);
+      DumpValue(gval(node), D);
     }
   }
 }
 
 
+static void DumpValue (const TValue *o, DumpState *D) {
+  DumpByte(ttype(o), D);
+  switch (ttype(o)) {
+  case LUA_TNIL:
+    break;
+  case LUA_TBOOLEAN:
+    DumpByte(bvalue(o), D);
+    break;
+  case LUA_TNUMFLT:
+    DumpNumber(fltvalue(o), D);
+    break;
+  case LUA_TNUMINT:
+    DumpInteger(ivalue(o), D);
+    break;
+  case LUA_TSHRSTR:
+  case LUA_TLNGSTR:
+    DumpString(tsvalue(o), D);
+    break;
+  case LUA_TTABLE:
+    DumpTable(hvalue(o), D);
+    break;
+  default:
+    lua_assert(0);
+  }
+}
+
+
+static void DumpConstants (const Proto *f, DumpState *D) {
+  int i;
+  int n = f->sizek;
+  DumpInt(n, D);
+  for (i = 0; i < n; i++)
+    DumpValue(&f->k[i], D);
+}
+
+
 static void DumpProtos (const Proto *f, DumpState *D) {
   int i;
   int n = f->sizep;
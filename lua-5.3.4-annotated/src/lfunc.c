@@ -18,6 +18,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -110,6 +111,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->sizelineinfo = 0;
   f->upvalues = NULL;
   f->sizeupvalues = 0;
+  f->sites = NULL;
+  f->sizesites = 0;
   f->numparams = 0;
   f->is_vararg = 0;
   f->maxstacksize = 0;
@@ -123,16 +126,69 @@ Proto *luaF_newproto (lua_State *L) {
 
 
 void luaF_freeproto (lua_State *L, Proto *f) {
+  int i;
   luaM_freearray(L, f->code, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  for (i = 0; i < f->sizesites; i++) {
+    if (f->sites[i].hint != NULL)
+      luaF_freehint(L, f->sites[i].hint);
+  }
+  luaM_freearray(L, f->sites, f->sizesites);
   luaM_free(L, f);
 }
 
 
+/*
+** Returns the size hint of the OP_NEWTABLE instruction at 'pc' in 'f',
+** creating the list of sites of 'f' and the hint if needed
+*/
+SizeHint *luaF_sitehint (lua_State *L, Proto *f, int pc) {
+  TableSite *s;
+  int lo, hi;
+  if (f->sites == NULL) {  /* first table created by 'f'? */
+    int n = 0;
+    int i;
+    for (i = 0; i < f->sizecode; i++)
+      if (GET_OPCODE(f->code[i]) == OP_NEWTABLE) n++;
+    s = luaM_newvector(L, n, TableSite);
+    for (i = 0, n = 0; i < f->sizecode; i++) {
+      if (GET_OPCODE(f->code[i]) == OP_NEWTABLE) {
+        s[n].pc = i;
+        s[n++].hint = NULL;
+      }
+    }
+    f->sites = s;
+    f->sizesites = n;
+  }
+  lo = 0; hi = f->sizesites - 1;
+  for (;;) {  /* binary search for 'pc' */
+    int m = (lo + hi) / 2;
+    lua_assert(lo <= hi);
+    s = &f->sites[m];
+    if (s->pc < pc) lo = m + 1;
+    else if (s->pc > pc) hi = m - 1;
+    else break;
+  }
+  if (s->hint == NULL) {
+    SizeHint *h = luaM_new(L, SizeHint);
+    h->narray = h->nhash = 0;
+    h->nrefs = 1;  /* 'f' */
+    s->hint = h;
+  }
+  return s->hint;
+}
+
+
+void luaF_freehint (lua_State *L, SizeHint *h) {
+  if (--h->nrefs == 0)
+    luaM_free(L, h);
+}
+
+
 /*
 ** Look for n-th local variable at line 'line' in function 'func'.
 ** Returns NULL if not found.
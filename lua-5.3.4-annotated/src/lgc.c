@@ -433,6 +433,7 @@ static int traverseephemeron (global_State *g, Table *h) {
 static void traversestrongtable (global_State *g, Table *h) {
   Node *n, *limit = gnodelast(h);
   unsigned int i;
+  unsigned int nh = 0;  /* number of entries in the hash part */
   for (i = 0; i < h->sizearray; i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
   for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
@@ -443,8 +444,11 @@ static void traversestrongtable (global_State *g, Table *h) {
       lua_assert(!ttisnil(gkey(n)));
       markvalue(g, gkey(n));  /* mark key */
       markvalue(g, gval(n));  /* mark value */
+      nh++;
     }
   }
+  if (h->hint != NULL)  /* created by OP_NEWTABLE? */
+    luaH_usedsizes(h, nh);  /* tell its site the sizes it uses */
 }
 
 
@@ -467,7 +471,7 @@ static lu_mem traversetable (global_State *g, Table *h) {
   else  /* not weak */
     traversestrongtable(g, h);
   return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, allocsizenode(h));
+                         allocnodebytes(h);
 }
 
 
@@ -494,7 +498,8 @@ static int traverseproto (global_State *g, Proto *f) {
                          sizeof(TValue) * f->sizek +
                          sizeof(int) * f->sizelineinfo +
                          sizeof(LocVar) * f->sizelocvars +
-                         sizeof(Upvaldesc) * f->sizeupvalues;
+                         sizeof(Upvaldesc) * f->sizeupvalues +
+                         sizeof(TableSite) * f->sizesites;
 }
 
 
@@ -0,0 +1,957 @@
+/*
+** $Id: limage.c $
+** Heap images: save the state of an interpreter and restore it later
+** See Copyright Notice in lua.h
+*/
+
+#define limage_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** An image holds every object reachable from the registry and from the
+** metatable for strings, except for the objects created by the standard
+** libraries, which the image refers to by number. Objects are written
+** in two passes: first each object alone (strings, empty tables with
+** their sizes, and Lua functions as binary chunks), then the contents
+** of tables and the upvalues of functions, which refer to objects by
+** number. So, restoring an image creates all objects before linking
+** them, with no parsing or compilation of source code and no names to
+** look up.
+*/
+
+
+/* mark for heap images */
+#define IMAGESIG	"\x1bLuaImg"
+
+/* data to check the format of numbers */
+#define IMAGEINT	0x5678
+#define IMAGENUM	cast_num(370.5)
+
+#define cast_num(x)	((lua_Number)(x))
+
+#define uchar(c)	((unsigned char)(c))
+
+
+/* tags for objects and values in an image */
+#define I_NIL		0
+#define I_FALSE		1
+#define I_TRUE		2
+#define I_INT		3	/* integer (as a raw lua_Integer) */
+#define I_FLT		4	/* float (as a raw lua_Number) */
+#define I_OBJ		5	/* object of the image (by number) */
+#define I_LIB		6	/* builtin object (by number) */
+#define I_JOIN		7	/* upvalue shared with an earlier closure */
+#define I_STRING	8
+#define I_TABLE		9
+#define I_FUNCTION	10
+#define I_PATCH		11	/* builtin table with new contents */
+
+
+/*
+** Entries of the registry with light-userdata keys hold private state
+** of C libraries, and the main thread is not an object that can be
+** saved; images neither save them nor replace them.
+*/
+static int isprivate (lua_State *L, int t, int k) {
+  return lua_rawequal(L, t, LUA_REGISTRYINDEX) &&
+         (lua_islightuserdata(L, k) ||
+          (lua_isinteger(L, k) &&
+           lua_tointeger(L, k) == LUA_RIDX_MAINTHREAD));
+}
+
+
+static void pushstringmt (lua_State *L) {
+  lua_pushliteral(L, "");
+  if (!lua_getmetatable(L, -1))
+    lua_pushnil(L);
+  lua_remove(L, -2);
+}
+
+
+/*
+** {======================================================
+** Builtin objects
+** =======================================================
+*/
+
+/*
+** Tables, full userdata, and C functions created by the standard
+** libraries are numbered in breadth-first order from the registry, the
+** global table, and the metatable for strings, following metatables,
+** fields with string keys (in sorted order), and then elements of
+** sequences. Two fresh states with the same libraries number them
+** equally. When saving, the walk is done over a fresh state 'B' and,
+** in step, over the state 'L' being saved, so that each object of 'L'
+** found in the same path of a builtin table or userdata gets its
+** number; C functions are matched by their addresses. A digest of the
+** walk detects images made by interpreters with different libraries.
+*/
+
+typedef struct Walk {
+  lua_State *B;  /* state being walked */
+  lua_State *L;  /* state matched against 'B' (or NULL) */
+  int queue;  /* index in 'B' of the queue (number -> object) */
+  int seen;  /* index in 'B' of the inverse of 'queue' */
+  int match;  /* index in 'L' of matching objects (number -> object) */
+  int bidx;  /* index in 'L' of builtin numbers (object -> number) */
+  int n;  /* number of objects */
+  unsigned int hash;  /* digest of the walk */
+} Walk;
+
+
+typedef struct Key {
+  const char *s;
+  size_t l;
+} Key;
+
+
+static int keycmp (const void *a, const void *b) {
+  const Key *ka = (const Key *)a;
+  const Key *kb = (const Key *)b;
+  int r = memcmp(ka->s, kb->s, (ka->l < kb->l) ? ka->l : kb->l);
+  if (r != 0) return r;
+  else return (ka->l > kb->l) - (ka->l < kb->l);
+}
+
+
+static void mixhash (Walk *w, const char *k, size_t l, int t) {
+  size_t i;
+  for (i = 0; i < l; i++)
+    w->hash = (w->hash ^ uchar(k[i])) * 16777619u;
+  w->hash = (w->hash ^ (unsigned int)t) * 16777619u;
+}
+
+
+/*
+** Give number 'w->n' to the object matching builtin object at index -2
+** of 'B'; the candidate is at the top of 'L'.
+*/
+static void record (Walk *w) {
+  lua_State *L = w->L;
+  if (lua_iscfunction(w->B, -2))  /* C functions match by address */
+    lua_pushlightuserdata(L, (void *)(size_t)lua_tocfunction(w->B, -2));
+  else if (lua_type(L, -1) == lua_type(w->B, -2)) {
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, w->match, w->n);  /* walk its fields too */
+  }
+  else return;  /* no match */
+  lua_pushvalue(L, -1);
+  if (lua_rawget(L, w->bidx) == LUA_TNIL) {  /* first match? */
+    lua_pop(L, 1);
+    lua_pushinteger(L, w->n);
+    lua_rawset(L, w->bidx);
+  }
+  else lua_pop(L, 2);
+}
+
+
+/*
+** Put the object at the top of 'B' in the queue, if it is a builtin
+** object not seen before. Pops it (and its match from 'L').
+*/
+static void enqueue (Walk *w, const char *k, size_t l) {
+  lua_State *B = w->B;
+  int t = lua_type(B, -1);
+  if (t == LUA_TTABLE || t == LUA_TUSERDATA || lua_iscfunction(B, -1)) {
+    lua_pushvalue(B, -1);
+    if (lua_rawget(B, w->seen) == LUA_TNIL) {  /* new object? */
+      w->n++;
+      lua_pushvalue(B, -2);
+      lua_pushinteger(B, w->n);
+      lua_rawset(B, w->seen);
+      lua_pushvalue(B, -2);
+      lua_rawseti(B, w->queue, w->n);
+      mixhash(w, k, l, t);
+      if (w->L != NULL) record(w);
+    }
+    lua_pop(B, 1);  /* result from 'seen' */
+  }
+  lua_pop(B, 1);
+  if (w->L != NULL) lua_pop(w->L, 1);
+}
+
+
+/*
+** Enqueue the fields with string keys of the table at the top of 'B'
+** (and the same fields of the table at the top of 'L'), in key order,
+** and then the elements of its sequence.
+*/
+static void walkfields (Walk *w) {
+  lua_State *B = w->B;
+  lua_State *L = w->L;
+  Key *keys;
+  int nk = 0;
+  int i;
+  lua_pushnil(B);
+  while (lua_next(B, -2)) {
+    if (lua_type(B, -2) == LUA_TSTRING) nk++;
+    lua_pop(B, 1);
+  }
+  keys = (Key *)lua_newuserdata(B, nk * sizeof(Key));
+  nk = 0;
+  lua_pushnil(B);
+  while (lua_next(B, -3)) {  /* keys are anchored by the table */
+    if (lua_type(B, -2) == LUA_TSTRING) {
+      keys[nk].s = lua_tolstring(B, -2, &keys[nk].l);
+      nk++;
+    }
+    lua_pop(B, 1);
+  }
+  qsort(keys, nk, sizeof(Key), keycmp);
+  for (i = 0; i < nk; i++) {
+    lua_pushlstring(B, keys[i].s, keys[i].l);
+    lua_rawget(B, -3);
+    if (L != NULL) {
+      if (lua_istable(L, -1)) {
+        lua_pushlstring(L, keys[i].s, keys[i].l);
+        lua_rawget(L, -2);
+      }
+      else lua_pushnil(L);
+    }
+    enqueue(w, keys[i].s, keys[i].l);
+  }
+  lua_pop(B, 1);  /* keys */
+  for (i = 1; lua_rawgeti(B, -1, i) != LUA_TNIL; i++) {
+    if (L != NULL) {
+      if (lua_istable(L, -1)) lua_rawgeti(L, -1, i);
+      else lua_pushnil(L);
+    }
+    enqueue(w, "#", 1);
+  }
+  lua_pop(B, 1);  /* nil */
+}
+
+
+static void visit (Walk *w, int i) {
+  lua_State *B = w->B;
+  lua_State *L = w->L;
+  lua_rawgeti(B, w->queue, i);
+  if (L != NULL) lua_rawgeti(L, w->match, i);
+  if (lua_getmetatable(B, -1)) {
+    if (L != NULL && !lua_getmetatable(L, -1))
+      lua_pushnil(L);
+    enqueue(w, "", 0);
+  }
+  if (lua_istable(B, -1))
+    walkfields(w);
+  lua_pop(B, 1);
+  if (L != NULL) lua_pop(L, 1);
+}
+
+
+/*
+** Walk the builtin objects of 'B'. Leaves the queue on the stack of 'B'
+** and, if 'L' is not NULL, the table 'bidx' on the stack of 'L'.
+*/
+static void walkbuiltins (Walk *w, lua_State *B, lua_State *L) {
+  int i;
+  w->B = B;
+  w->L = L;
+  w->n = 0;
+  w->hash = 2166136261u;
+  lua_newtable(B);
+  w->queue = lua_gettop(B);
+  lua_newtable(B);
+  w->seen = lua_gettop(B);
+  if (L != NULL) {
+    lua_newtable(L);
+    w->bidx = lua_gettop(L);
+    lua_newtable(L);
+    w->match = lua_gettop(L);
+    pushstringmt(L);
+    lua_pushglobaltable(L);
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+  }
+  /* push roots in reverse order, as 'enqueue' pops them */
+  pushstringmt(B);
+  lua_pushglobaltable(B);
+  lua_pushvalue(B, LUA_REGISTRYINDEX);
+  enqueue(w, "R", 1);
+  enqueue(w, "G", 1);
+  enqueue(w, "S", 1);
+  for (i = 1; i <= w->n; i++)
+    visit(w, i);
+  lua_pop(B, 1);  /* 'seen' */
+  if (L != NULL) lua_pop(L, 1);  /* 'match' */
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Saving
+** =======================================================
+*/
+
+typedef struct SaveState {
+  lua_State *L;
+  lua_State *B;  /* fresh state with the builtin objects */
+  FILE *f;
+  int strip;
+  int bidx;  /* builtin object -> number */
+  int ids;  /* object -> number */
+  int objs;  /* number -> object */
+  int upvals;  /* upvalue id -> (closure number, upvalue index) */
+  int n;  /* number of objects */
+} SaveState;
+
+
+static void putblock (SaveState *S, const void *b, size_t size) {
+  fwrite(b, 1, size, S->f);
+}
+
+
+static void putbyte (SaveState *S, int c) {
+  putc(c, S->f);
+}
+
+
+static void putvar (SaveState *S, size_t x) {
+  while (x >= 0x80) {
+    putc((int)(x & 0x7f) | 0x80, S->f);
+    x >>= 7;
+  }
+  putc((int)x, S->f);
+}
+
+
+/* number of builtin object at index 'idx' (0 if not builtin) */
+static lua_Integer builtin (SaveState *S, int idx) {
+  lua_State *L = S->L;
+  lua_Integer n;
+  if (lua_iscfunction(L, idx))
+    lua_pushlightuserdata(L, (void *)(size_t)lua_tocfunction(L, idx));
+  else
+    lua_pushvalue(L, idx);
+  lua_rawget(L, S->bidx);
+  n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return n;
+}
+
+
+static int cannotsave (lua_State *L, int idx) {
+  if (lua_iscfunction(L, idx))
+    return luaL_error(L, "cannot save a C function not created by the "
+                         "standard libraries");
+  else
+    return luaL_error(L, "cannot save a %s", luaL_typename(L, idx));
+}
+
+
+/*
+** Give a number to the value at index 'idx', if it is an object of the
+** image not seen before.
+*/
+static void mark (SaveState *S, int idx) {
+  lua_State *L = S->L;
+  idx = lua_absindex(L, idx);
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL: case LUA_TBOOLEAN: case LUA_TNUMBER:
+      return;  /* saved in place */
+    case LUA_TSTRING: case LUA_TTABLE:
+      break;
+    case LUA_TFUNCTION:
+      if (!lua_iscfunction(L, idx))
+        break;
+      /* FALLTHROUGH */
+    case LUA_TUSERDATA:
+      if (builtin(S, idx) == 0)
+        cannotsave(L, idx);
+      return;  /* saved by number */
+    default:
+      cannotsave(L, idx);
+      return;
+  }
+  lua_pushvalue(L, idx);
+  if (lua_rawget(L, S->ids) == LUA_TNIL) {  /* new object? */
+    S->n++;
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, S->n);
+    lua_rawset(L, S->ids);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, S->objs, S->n);
+  }
+  lua_pop(L, 1);
+}
+
+
+/* mark all objects referred by object 'i' */
+static void traverse (SaveState *S, int i) {
+  lua_State *L = S->L;
+  lua_rawgeti(L, S->objs, i);
+  if (lua_istable(L, -1)) {
+    if (lua_getmetatable(L, -1)) {
+      mark(S, -1);
+      lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (!isprivate(L, -3, -2)) {
+        mark(S, -2);
+        mark(S, -1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  else if (lua_type(L, -1) == LUA_TFUNCTION) {
+    int j;
+    for (j = 1; lua_getupvalue(L, -1, j) != NULL; j++) {
+      mark(S, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+
+static void putvalue (SaveState *S, int idx) {
+  lua_State *L = S->L;
+  idx = lua_absindex(L, idx);
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      putbyte(S, I_NIL);
+      break;
+    case LUA_TBOOLEAN:
+      putbyte(S, lua_toboolean(L, idx) ? I_TRUE : I_FALSE);
+      break;
+    case LUA_TNUMBER: {
+      if (lua_isinteger(L, idx)) {
+        lua_Integer x = lua_tointeger(L, idx);
+        putbyte(S, I_INT);
+        putblock(S, &x, sizeof(x));
+      }
+      else {
+        lua_Number x = lua_tonumber(L, idx);
+        putbyte(S, I_FLT);
+        putblock(S, &x, sizeof(x));
+      }
+      break;
+    }
+    default: {
+      lua_pushvalue(L, idx);
+      if (lua_rawget(L, S->ids) != LUA_TNIL) {
+        putbyte(S, I_OBJ);
+        putvar(S, (size_t)lua_tointeger(L, -1));
+      }
+      else {
+        putbyte(S, I_LIB);
+        putvar(S, (size_t)builtin(S, idx));
+      }
+      lua_pop(L, 1);
+      break;
+    }
+  }
+}
+
+
+static int writer (lua_State *L, const void *b, size_t size, void *B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *) B, (const char *)b, size);
+  return 0;
+}
+
+
+/* write object 'i' alone */
+static void putobject (SaveState *S, int i) {
+  lua_State *L = S->L;
+  lua_rawgeti(L, S->objs, i);
+  switch (lua_type(L, -1)) {
+    case LUA_TSTRING: {
+      size_t l;
+      const char *s = lua_tolstring(L, -1, &l);
+      putbyte(S, I_STRING);
+      putvar(S, l);
+      putblock(S, s, l);
+      break;
+    }
+    case LUA_TTABLE: {
+      lua_Integer k = builtin(S, -1);
+      if (k != 0) {  /* builtin table? */
+        putbyte(S, I_PATCH);
+        putvar(S, (size_t)k);
+      }
+      else {
+        size_t na = lua_rawlen(L, -1);
+        size_t n = 0;
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          n++;
+          lua_pop(L, 1);
+        }
+        putbyte(S, I_TABLE);
+        putvar(S, na);
+        putvar(S, (n > na) ? n - na : 0);
+      }
+      break;
+    }
+    default: {  /* Lua function */
+      luaL_Buffer b;
+      size_t l;
+      const char *s;
+      luaL_buffinit(L, &b);
+      if (lua_dump(L, writer, &b, S->strip) != 0)
+        luaL_error(L, "unable to dump given function");
+      luaL_pushresult(&b);
+      s = lua_tolstring(L, -1, &l);
+      putbyte(S, I_FUNCTION);
+      putvar(S, l);
+      putblock(S, s, l);
+      lua_pop(L, 1);
+      break;
+    }
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** Write the upvalues of function 'i' (at the top). An upvalue shared
+** with a function written before refers to that function.
+*/
+static void putupvalues (SaveState *S, int i) {
+  lua_State *L = S->L;
+  lua_Debug ar;
+  int j;
+  lua_pushvalue(L, -1);
+  lua_getinfo(L, ">u", &ar);
+  putvar(S, ar.nups);
+  for (j = 1; j <= ar.nups; j++) {
+    lua_pushlightuserdata(L, lua_upvalueid(L, -1, j));
+    if (lua_rawget(L, S->upvals) != LUA_TNIL) {  /* shared? */
+      lua_Integer p = lua_tointeger(L, -1);
+      putbyte(S, I_JOIN);
+      putvar(S, (size_t)(p >> 8));
+      putvar(S, (size_t)(p & 0xff));
+    }
+    else {
+      lua_pushlightuserdata(L, lua_upvalueid(L, -2, j));
+      lua_pushinteger(L, ((lua_Integer)i << 8) | j);
+      lua_rawset(L, S->upvals);
+      lua_getupvalue(L, -2, j);
+      putvalue(S, -1);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+
+/* write the metatable and fields of table 'i' or upvalues of function 'i' */
+static void putcontents (SaveState *S, int i) {
+  lua_State *L = S->L;
+  lua_rawgeti(L, S->objs, i);
+  if (lua_istable(L, -1)) {
+    if (!lua_getmetatable(L, -1))
+      lua_pushnil(L);
+    putvalue(S, -1);
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (!isprivate(L, -3, -2)) {
+        putvalue(S, -2);
+        putvalue(S, -1);
+      }
+      lua_pop(L, 1);
+    }
+    putbyte(S, I_NIL);  /* end of fields */
+  }
+  else if (lua_type(L, -1) == LUA_TFUNCTION)
+    putupvalues(S, i);
+  lua_pop(L, 1);
+}
+
+
+static void putheader (SaveState *S, const Walk *w) {
+  lua_Integer x = IMAGEINT;
+  lua_Number y = IMAGENUM;
+  putblock(S, IMAGESIG, sizeof(IMAGESIG) - 1);
+  putbyte(S, LUA_VERSION_NUM / 100 * 16 + LUA_VERSION_NUM % 100);
+  putbyte(S, sizeof(lua_Integer));
+  putbyte(S, sizeof(lua_Number));
+  putblock(S, &x, sizeof(x));
+  putblock(S, &y, sizeof(y));
+  putvar(S, w->n);
+  putvar(S, w->hash);
+}
+
+
+static int dosave (lua_State *L) {
+  SaveState *S = (SaveState *)lua_touserdata(L, 1);
+  Walk w;
+  int i;
+  S->L = L;
+  walkbuiltins(&w, S->B, L);
+  S->bidx = w.bidx;
+  lua_newtable(L);
+  S->ids = lua_gettop(L);
+  lua_newtable(L);
+  S->objs = lua_gettop(L);
+  lua_newtable(L);
+  S->upvals = lua_gettop(L);
+  S->n = 0;
+  lua_pushvalue(L, LUA_REGISTRYINDEX);
+  mark(S, -1);
+  pushstringmt(L);
+  mark(S, -1);
+  lua_pop(L, 2);
+  for (i = 1; i <= S->n; i++)  /* 'n' grows while traversing */
+    traverse(S, i);
+  putheader(S, &w);
+  putvar(S, S->n);
+  for (i = 1; i <= S->n; i++)
+    putobject(S, i);
+  for (i = 1; i <= S->n; i++)
+    putcontents(S, i);
+  return 0;
+}
+
+
+LUALIB_API int luaL_saveimage (lua_State *L, const char *filename,
+                               int strip) {
+  SaveState S;
+  int status;
+  S.f = fopen(filename, "wb");
+  if (S.f == NULL) {
+    lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+    return LUA_ERRFILE;
+  }
+  S.B = luaL_newstate();
+  if (S.B == NULL) {
+    fclose(S.f);
+    remove(filename);
+    lua_pushliteral(L, "not enough memory");
+    return LUA_ERRMEM;
+  }
+  luaL_openlibs(S.B);
+  S.strip = strip;
+  lua_pushcfunction(L, dosave);
+  lua_pushlightuserdata(L, &S);
+  status = lua_pcall(L, 1, 0, 0);
+  lua_close(S.B);
+  if (ferror(S.f) && status == LUA_OK) {
+    lua_pushfstring(L, "cannot write %s", filename);
+    status = LUA_ERRFILE;
+  }
+  if (fclose(S.f) != 0 && status == LUA_OK) {
+    lua_pushfstring(L, "cannot write %s: %s", filename, strerror(errno));
+    status = LUA_ERRFILE;
+  }
+  if (status != LUA_OK)
+    remove(filename);
+  return status;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Loading
+** =======================================================
+*/
+
+typedef struct LoadState {
+  lua_State *L;
+  FILE *f;
+  const char *name;  /* image name, for error messages */
+  const char *p;  /* next byte to read */
+  const char *end;  /* end of image */
+  int lib;  /* index of builtin objects (number -> object) */
+  int nlib;  /* number of builtin objects */
+  int objs;  /* index of objects (number -> object) */
+  int n;  /* number of objects */
+} LoadState;
+
+
+static int error (LoadState *S, const char *why) {
+  return luaL_error(S->L, "%s: %s image", S->name, why);
+}
+
+
+static const char *getblock (LoadState *S, size_t size) {
+  const char *b = S->p;
+  if ((size_t)(S->end - S->p) < size)
+    error(S, "truncated");
+  S->p += size;
+  return b;
+}
+
+
+static int getbyte (LoadState *S) {
+  return uchar(*getblock(S, 1));
+}
+
+
+static size_t getvar (LoadState *S) {
+  size_t x = 0;
+  int shift = 0;
+  int c;
+  do {
+    if (shift >= (int)(sizeof(size_t) * CHAR_BIT))
+      error(S, "bad");
+    c = getbyte(S);
+    x |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return x;
+}
+
+
+/* read a number in [1, max] */
+static int getindex (LoadState *S, int max) {
+  size_t i = getvar(S);
+  if (i < 1 || i > (size_t)max)
+    error(S, "bad");
+  return (int)i;
+}
+
+
+static void getvalue (LoadState *S) {
+  lua_State *L = S->L;
+  switch (getbyte(S)) {
+    case I_NIL: lua_pushnil(L); break;
+    case I_FALSE: lua_pushboolean(L, 0); break;
+    case I_TRUE: lua_pushboolean(L, 1); break;
+    case I_INT: {
+      lua_Integer x;
+      memcpy(&x, getblock(S, sizeof(x)), sizeof(x));
+      lua_pushinteger(L, x);
+      break;
+    }
+    case I_FLT: {
+      lua_Number x;
+      memcpy(&x, getblock(S, sizeof(x)), sizeof(x));
+      lua_pushnumber(L, x);
+      break;
+    }
+    case I_OBJ: lua_rawgeti(L, S->objs, getindex(S, S->n)); break;
+    case I_LIB: lua_rawgeti(L, S->lib, getindex(S, S->nlib)); break;
+    default: error(S, "bad");
+  }
+}
+
+
+/* remove all fields from the builtin table at the top */
+static void cleartable (lua_State *L) {
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    lua_pop(L, 1);
+    if (!isprivate(L, -2, -1)) {
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, -4);
+    }
+  }
+}
+
+
+/* create object 'i' */
+static void getobject (LoadState *S) {
+  lua_State *L = S->L;
+  switch (getbyte(S)) {
+    case I_STRING: {
+      size_t l = getvar(S);
+      const char *s = getblock(S, l);
+      lua_pushlstring(L, s, l);
+      break;
+    }
+    case I_TABLE: {
+      size_t na = getvar(S);
+      size_t nh = getvar(S);
+      if (na > (size_t)(S->end - S->p) || nh > (size_t)(S->end - S->p))
+        error(S, "bad");
+      lua_createtable(L, (int)na, (int)nh);
+      break;
+    }
+    case I_FUNCTION: {
+      size_t l = getvar(S);
+      const char *s = getblock(S, l);
+      if (luaL_loadbufferx(L, s, l, S->name, "b") != LUA_OK)
+        lua_error(L);
+      break;
+    }
+    case I_PATCH: {
+      lua_rawgeti(L, S->lib, getindex(S, S->nlib));
+      if (!lua_istable(L, -1))
+        error(S, "bad");
+      cleartable(L);
+      break;
+    }
+    default: error(S, "bad");
+  }
+}
+
+
+static void getupvalues (LoadState *S) {
+  lua_State *L = S->L;
+  lua_Debug ar;
+  int j;
+  lua_pushvalue(L, -1);
+  lua_getinfo(L, ">u", &ar);
+  if (getvar(S) != ar.nups)
+    error(S, "bad");
+  for (j = 1; j <= ar.nups; j++) {
+    if (S->p < S->end && *S->p == I_JOIN) {
+      int k;
+      S->p++;
+      lua_rawgeti(L, S->objs, getindex(S, S->n));
+      k = getindex(S, 255);
+      if (lua_iscfunction(L, -1) || lua_getupvalue(L, -1, k) == NULL)
+        error(S, "bad");
+      lua_pop(L, 1);
+      lua_upvaluejoin(L, -2, j, -1, k);
+      lua_pop(L, 1);
+    }
+    else {
+      getvalue(S);
+      lua_setupvalue(L, -2, j);
+    }
+  }
+}
+
+
+/* fill table 'i' or the upvalues of function 'i' (at the top) */
+static void getcontents (LoadState *S) {
+  lua_State *L = S->L;
+  if (lua_istable(L, -1)) {
+    getvalue(S);  /* metatable */
+    if (!lua_isnil(L, -1) && !lua_istable(L, -1))
+      error(S, "bad");
+    lua_setmetatable(L, -2);
+    for (;;) {
+      getvalue(S);  /* key */
+      if (lua_isnil(L, -1)) break;
+      getvalue(S);
+      lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);  /* nil */
+  }
+  else if (lua_type(L, -1) == LUA_TFUNCTION)
+    getupvalues(S);
+}
+
+
+static void checkheader (LoadState *S) {
+  lua_Integer x;
+  lua_Number y;
+  if (memcmp(getblock(S, sizeof(IMAGESIG) - 1), IMAGESIG,
+             sizeof(IMAGESIG) - 1) != 0)
+    error(S, "not an");
+  if (getbyte(S) != LUA_VERSION_NUM / 100 * 16 + LUA_VERSION_NUM % 100)
+    error(S, "version mismatch in");
+  if (getbyte(S) != sizeof(lua_Integer) || getbyte(S) != sizeof(lua_Number))
+    error(S, "incompatible");
+  memcpy(&x, getblock(S, sizeof(x)), sizeof(x));
+  memcpy(&y, getblock(S, sizeof(y)), sizeof(y));
+  if (x != IMAGEINT || y != IMAGENUM)
+    error(S, "incompatible");
+}
+
+
+static int doload (lua_State *L) {
+  LoadState *S = (LoadState *)lua_touserdata(L, 1);
+  Walk w;
+  size_t size, nlib, hash;
+  int i;
+  char *b;
+  long l;
+  S->L = L;
+  if (fseek(S->f, 0, SEEK_END) != 0 || (l = ftell(S->f)) < 0)
+    return luaL_error(L, "cannot read %s", S->name);
+  rewind(S->f);
+  size = (size_t)l;
+  b = (char *)lua_newuserdata(L, size);
+  if (fread(b, 1, size, S->f) != size)
+    return luaL_error(L, "cannot read %s", S->name);
+  S->p = b;
+  S->end = b + size;
+  checkheader(S);
+  nlib = getvar(S);
+  hash = getvar(S);
+  walkbuiltins(&w, L, NULL);
+  if (nlib != (size_t)w.n || hash != w.hash)
+    error(S, "incompatible");
+  S->lib = w.queue;
+  S->nlib = w.n;
+  S->n = getindex(S, INT_MAX);
+  if ((size_t)S->n > size)
+    error(S, "bad");
+  lua_createtable(L, S->n, 0);
+  S->objs = lua_gettop(L);
+  for (i = 1; i <= S->n; i++) {
+    getobject(S);
+    lua_rawseti(L, S->objs, i);
+  }
+  for (i = 1; i <= S->n; i++) {
+    lua_rawgeti(L, S->objs, i);
+    getcontents(S);
+    lua_pop(L, 1);
+  }
+  if (S->p != S->end)
+    error(S, "bad");
+  return 0;
+}
+
+
+LUALIB_API int luaL_loadimage (lua_State *L, const char *filename) {
+  LoadState S;
+  int status;
+  int gcrunning;
+  S.f = fopen(filename, "rb");
+  if (S.f == NULL) {
+    lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+    return LUA_ERRFILE;
+  }
+  S.name = filename;
+  /* all objects in an image are alive; do not collect while loading */
+  gcrunning = lua_gc(L, LUA_GCISRUNNING, 0);
+  lua_gc(L, LUA_GCSTOP, 0);
+  lua_pushcfunction(L, doload);
+  lua_pushlightuserdata(L, &S);
+  status = lua_pcall(L, 1, 0, 0);
+  if (gcrunning) lua_gc(L, LUA_GCRESTART, 0);
+  fclose(S.f);
+  return status;
+}
+
+/* }====================================================== */
+
+
+static int image_save (lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  int strip = lua_toboolean(L, 2);
+  if (luaL_saveimage(L, filename, strip) != LUA_OK)
+    return lua_error(L);
+  return 0;
+}
+
+
+static const luaL_Reg imagelib[] = {
+  {"save", image_save},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_image (lua_State *L) {
+  luaL_newlib(L, imagelib);
+  return 1;
+}
+
@@ -49,6 +49,10 @@ static const luaL_Reg loadedlibs[] = {
   {LUA_STRLIBNAME, luaopen_string},
   {LUA_MATHLIBNAME, luaopen_math},
   {LUA_UTF8LIBNAME, luaopen_utf8},
+  {LUA_SEARCHLIBNAME, luaopen_search},
+  {LUA_PEGLIBNAME, luaopen_peg},
+  {LUA_AIOLIBNAME, luaopen_aio},
+  {LUA_IMAGELIBNAME, luaopen_image},
   {LUA_DBLIBNAME, luaopen_debug},
 #if defined(LUA_COMPAT_BITLIB)
   {LUA_BITLIBNAME, luaopen_bit32},
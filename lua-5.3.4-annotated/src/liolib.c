@@ -7,11 +7,17 @@
 #define liolib_c
 #define LUA_LIB
 
+/* 'getdelim' needs POSIX.1-2008 */
+#if !defined(LUA_USE_C89) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE		700
+#endif
+
 #include "lprefix.h"
 
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -95,6 +101,49 @@ static int l_checkmode (const char *mode) {
 #endif				/* } */
 
 
+/*
+** l_getline reads a line (with its '\n') into a buffer that it grows
+** with 'malloc' as needed, returning its length or -1 on end of file.
+** Implementations scan stdio's own buffer for the newline and copy
+** whole blocks, so it is much faster than reading char by char, and
+** it keeps reads interleaved correctly with other operations on the
+** stream. Like the stream buffers themselves, this buffer does not
+** come from the state's allocation function, which cannot see or
+** limit it; L_MAXLINEKEEP bounds how much of it stays allocated
+** between reads.
+*/
+#if !defined(l_getline)		/* { */
+
+#if defined(LUA_USE_POSIX)
+#define l_getline(b,sz,f)	getdelim(b,sz,'\n',f)
+#endif
+
+#endif				/* } */
+
+
+/*
+** l_writev writes an array of buffers ('struct iovec') to the file
+** descriptor of a stream with a single system call.
+*/
+#if !defined(l_writev)		/* { */
+
+#if defined(LUA_USE_POSIX)
+#include <sys/uio.h>
+#define l_writev(f,iov,n)	writev(fileno(f), iov, n)
+#endif
+
+#endif				/* } */
+
+
+/*
+** line buffers (allocated by 'l_getline' with 'malloc') larger than
+** this are released after each read
+*/
+#if !defined(L_MAXLINEKEEP)
+#define L_MAXLINEKEEP	(LUAL_BUFFERSIZE * 64)
+#endif
+
+
 /*
 ** {======================================================
 ** l_fseek: configuration for longer offsets
@@ -142,11 +191,49 @@ static int l_checkmode (const char *mode) {
 typedef luaL_Stream LStream;
 
 
+/*
+** File handles created by this library have some private fields after
+** their 'luaL_Stream'. Handles created by other libraries may have only
+** the 'luaL_Stream' part; 'toext' returns NULL for them.  An open handle
+** is known to be from this library by its close function.
+*/
+typedef struct LStreamExt {
+  LStream s;
+  char *line;  /* buffer reused by 'l_getline' (from 'malloc'; or NULL) */
+  size_t linesize;  /* size of 'line' */
+  int vbuf;  /* buffering mode set by 'setvbuf' (-1 if never set) */
+} LStreamExt;
+
+
 #define tolstream(L)	((LStream *)luaL_checkudata(L, 1, LUA_FILEHANDLE))
 
 #define isclosed(p)	((p)->closef == NULL)
 
 
+static int io_fclose (lua_State *L);
+static int io_pclose (lua_State *L);
+static int io_noclose (lua_State *L);
+
+
+/* 'idx' must be an open file handle */
+static LStreamExt *toext (lua_State *L, int idx) {
+  LStream *p = (LStream *)lua_touserdata(L, idx);
+  lua_assert(!isclosed(p));
+  if (p->closef == &io_fclose || p->closef == &io_pclose ||
+      p->closef == &io_noclose)
+    return (LStreamExt *)p;
+  else
+    return NULL;
+}
+
+
+static void freeline (LStreamExt *pe) {
+  free(pe->line);
+  pe->line = NULL;
+  pe->linesize = 0;
+}
+
+
 static int io_type (lua_State *L) {
   LStream *p;
   luaL_checkany(L, 1);
@@ -186,10 +273,13 @@ static FILE *tofile (lua_State *L) {
 ** handle is in a consistent state.
 */
 static LStream *newprefile (lua_State *L) {
-  LStream *p = (LStream *)lua_newuserdata(L, sizeof(LStream));
-  p->closef = NULL;  /* mark file handle as 'closed' */
+  LStreamExt *pe = (LStreamExt *)lua_newuserdata(L, sizeof(LStreamExt));
+  pe->s.closef = NULL;  /* mark file handle as 'closed' */
+  pe->line = NULL;
+  pe->linesize = 0;
+  pe->vbuf = -1;
   luaL_setmetatable(L, LUA_FILEHANDLE);
-  return p;
+  return &pe->s;
 }
 
 
@@ -200,8 +290,11 @@ static LStream *newprefile (lua_State *L) {
 */
 static int aux_close (lua_State *L) {
   LStream *p = tolstream(L);
+  LStreamExt *pe = toext(L, 1);
   volatile lua_CFunction cf = p->closef;
   p->closef = NULL;  /* mark stream as closed */
+  if (pe != NULL)
+    freeline(pe);
   return (*cf)(L);  /* close it */
 }
 
@@ -427,6 +520,32 @@ static int readdigits (RN *rn, int hex) {
 }
 
 
+/*
+** Read a valid prefix of a numeral into 'rn->buff'. 'decp' has the
+** accepted decimal points. The file must be locked.
+*/
+static void scannumeral (RN *rn, const char *decp) {
+  int count = 0;
+  int hex = 0;
+  rn->n = 0;
+  do { rn->c = l_getc(rn->f); } while (isspace(rn->c));  /* skip spaces */
+  test2(rn, "-+");  /* optional signal */
+  if (test2(rn, "00")) {
+    if (test2(rn, "xX")) hex = 1;  /* numeral is hexadecimal */
+    else count = 1;  /* count initial '0' as a valid digit */
+  }
+  count += readdigits(rn, hex);  /* integral part */
+  if (test2(rn, decp))  /* decimal point? */
+    count += readdigits(rn, hex);  /* fractional part */
+  if (count > 0 && test2(rn, (hex ? "pP" : "eE"))) {  /* exponent mark? */
+    test2(rn, "-+");  /* exponent signal */
+    readdigits(rn, 0);  /* exponent digits */
+  }
+  ungetc(rn->c, rn->f);  /* unread look-ahead char */
+  rn->buff[rn->n] = '\0';  /* finish string */
+}
+
+
 /*
 ** Read a number: first reads a valid prefix of a numeral into a buffer.
 ** Then it calls 'lua_stringtonumber' to check whether the format is
@@ -434,29 +553,13 @@ static int readdigits (RN *rn, int hex) {
 */
 static int read_number (lua_State *L, FILE *f) {
   RN rn;
-  int count = 0;
-  int hex = 0;
   char decp[2];
-  rn.f = f; rn.n = 0;
+  rn.f = f;
   decp[0] = lua_getlocaledecpoint();  /* get decimal point from locale */
   decp[1] = '.';  /* always accept a dot */
   l_lockfile(rn.f);
-  do { rn.c = l_getc(rn.f); } while (isspace(rn.c));  /* skip spaces */
-  test2(&rn, "-+");  /* optional signal */
-  if (test2(&rn, "00")) {
-    if (test2(&rn, "xX")) hex = 1;  /* numeral is hexadecimal */
-    else count = 1;  /* count initial '0' as a valid digit */
-  }
-  count += readdigits(&rn, hex);  /* integral part */
-  if (test2(&rn, decp))  /* decimal point? */
-    count += readdigits(&rn, hex);  /* fractional part */
-  if (count > 0 && test2(&rn, (hex ? "pP" : "eE"))) {  /* exponent mark? */
-    test2(&rn, "-+");  /* exponent signal */
-    readdigits(&rn, 0);  /* exponent digits */
-  }
-  ungetc(rn.c, rn.f);  /* unread look-ahead char */
+  scannumeral(&rn, decp);
   l_unlockfile(rn.f);
-  rn.buff[rn.n] = '\0';  /* finish string */
   if (lua_stringtonumber(L, rn.buff))  /* is this a valid number? */
     return 1;  /* ok */
   else {  /* invalid format */
@@ -466,6 +569,116 @@ static int read_number (lua_State *L, FILE *f) {
 }
 
 
+/*
+** Fast conversion for the common numerals: decimal integers and plain
+** decimal fractions ("-12", "3.25"). Returns 1 for an integer (in 'i'),
+** 2 for a float (in 'n'), or 0 if the numeral must go through
+** 'lua_stringtonumber'. A fraction is converted with a single division
+** of two exactly-representable doubles, which is correctly rounded.
+*/
+static int fastnumeral (const char *s, const char *decp,
+                        lua_Integer *i, lua_Number *n) {
+  lua_Unsigned m = 0;
+  int neg = 0;
+  int digits = 0;
+  int frac = 0;  /* number of fractional digits */
+  if (*s == '-') { neg = 1; s++; }
+  else if (*s == '+') s++;
+  for (; isdigit((unsigned char)*s); s++, digits++) {
+    if (m > (LUA_MAXINTEGER - 9) / 10)
+      return 0;  /* may overflow */
+    m = m * 10 + (*s - '0');
+  }
+  if (*s == '\0') {
+    if (digits == 0) return 0;
+    *i = neg ? (lua_Integer)(0u - m) : (lua_Integer)m;
+    return 1;
+  }
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE
+  if (*s == decp[0] || *s == decp[1]) {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+      1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+      1e19, 1e20, 1e21, 1e22};
+    for (s++; isdigit((unsigned char)*s); s++, frac++) {
+      if (m > (LUA_MAXINTEGER - 9) / 10 || frac == 22)
+        return 0;
+      m = m * 10 + (*s - '0');
+    }
+    if (*s != '\0' || digits + frac == 0 || m > ((lua_Unsigned)1 << 53))
+      return 0;
+    *n = (lua_Number)m / pow10[frac];
+    if (neg) *n = -*n;
+    return 2;
+  }
+#else
+  (void)decp; (void)n; (void)frac;
+#endif
+  return 0;
+}
+
+
+/* maximum number of numerals read in each lock by 'f_readnumbers' */
+#if !defined(L_NUMBATCH)
+#define L_NUMBATCH	256
+#endif
+
+
+/*
+** f:readnumbers([n]): read up to 'n' numbers (default is all of them),
+** as repeated calls to 'f:read("n")', into a new sequence. It stops at
+** the end of the file or at the first invalid numeral. Numerals are
+** scanned and converted in batches under a single lock, and only then
+** stored into the table, so that no memory error can happen inside
+** the lock.
+*/
+static int f_readnumbers (lua_State *L) {
+  FILE *f = tofile(L);
+  lua_Integer max = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+  lua_Integer count = 0;
+  int ok = 1;
+  RN rn;
+  char decp[2];
+  rn.f = f;
+  decp[0] = lua_getlocaledecpoint();
+  decp[1] = '.';
+  lua_createtable(L, (0 < max && max <= L_NUMBATCH) ? (int)max : 0, 0);
+  luaL_checkstack(L, 1, NULL);  /* for 'lua_stringtonumber' */
+  clearerr(f);
+  while (ok && count < max) {
+    union { lua_Integer i; lua_Number n; } v[L_NUMBATCH];
+    char isint[L_NUMBATCH];
+    int i, k;
+    int nb = (max - count < L_NUMBATCH) ? (int)(max - count) : L_NUMBATCH;
+    l_lockfile(f);
+    for (k = 0; k < nb; k++) {
+      int res;
+      scannumeral(&rn, decp);
+      res = fastnumeral(rn.buff, decp, &v[k].i, &v[k].n);
+      if (res == 0) {  /* not a simple numeral? */
+        if (!lua_stringtonumber(L, rn.buff)) {  /* invalid numeral? */
+          ok = 0;
+          break;
+        }
+        res = lua_isinteger(L, -1) ? 1 : 2;
+        if (res == 1) v[k].i = lua_tointeger(L, -1);
+        else v[k].n = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+      }
+      isint[k] = (res == 1);
+    }
+    l_unlockfile(f);
+    for (i = 0; i < k; i++) {
+      if (isint[i]) lua_pushinteger(L, v[i].i);
+      else lua_pushnumber(L, v[i].n);
+      lua_rawseti(L, -2, ++count);
+    }
+  }
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  return 1;
+}
+
+
 static int test_eof (lua_State *L, FILE *f) {
   int c = getc(f);
   ungetc(c, f);  /* no-op when c == EOF */
@@ -474,6 +687,33 @@ static int test_eof (lua_State *L, FILE *f) {
 }
 
 
+#if defined(l_getline)
+
+/*
+** Read a line with 'l_getline' into the handle's line buffer and push
+** it as a single string.
+*/
+static int read_fastline (lua_State *L, LStreamExt *pe, int chop) {
+  FILE *f = pe->s.f;
+  ssize_t n = l_getline(&pe->line, &pe->linesize, f);
+  if (n < 0) {  /* end of file, error, or no memory */
+    if (!feof(f) && !ferror(f))
+      luaL_error(L, "not enough memory");
+    lua_pushliteral(L, "");
+    return 0;
+  }
+  if (chop && pe->line[n - 1] == '\n')
+    lua_pushlstring(L, pe->line, n - 1);
+  else
+    lua_pushlstring(L, pe->line, n);
+  if (pe->linesize > L_MAXLINEKEEP)  /* buffer too large to keep? */
+    freeline(pe);
+  return 1;  /* read at least a newline */
+}
+
+#endif
+
+
 static int read_line (lua_State *L, FILE *f, int chop) {
   luaL_Buffer b;
   int c = '\0';
@@ -495,6 +735,17 @@ static int read_line (lua_State *L, FILE *f, int chop) {
 }
 
 
+static int aux_readline (lua_State *L, FILE *f, LStreamExt *pe, int chop) {
+#if defined(l_getline)
+  if (pe != NULL)
+    return read_fastline(L, pe, chop);
+#else
+  (void)pe;
+#endif
+  return read_line(L, f, chop);
+}
+
+
 static void read_all (lua_State *L, FILE *f) {
   size_t nr;
   luaL_Buffer b;
@@ -521,13 +772,19 @@ static int read_chars (lua_State *L, FILE *f, size_t n) {
 }
 
 
-static int g_read (lua_State *L, FILE *f, int first) {
+/*
+** Read the formats at 'first' (and following indices) from the file
+** handle at index 'fi'
+*/
+static int g_read (lua_State *L, int fi, int first) {
+  FILE *f = ((LStream *)lua_touserdata(L, fi))->f;
+  LStreamExt *pe = toext(L, fi);
   int nargs = lua_gettop(L) - 1;
   int success;
   int n;
   clearerr(f);
   if (nargs == 0) {  /* no arguments? */
-    success = read_line(L, f, 1);
+    success = aux_readline(L, f, pe, 1);
     n = first+1;  /* to return 1 result */
   }
   else {  /* ensure stack space for all results and for auxlib's buffer */
@@ -546,10 +803,10 @@ static int g_read (lua_State *L, FILE *f, int first) {
             success = read_number(L, f);
             break;
           case 'l':  /* line */
-            success = read_line(L, f, 1);
+            success = aux_readline(L, f, pe, 1);
             break;
           case 'L':  /* line with end-of-line */
-            success = read_line(L, f, 0);
+            success = aux_readline(L, f, pe, 0);
             break;
           case 'a':  /* file */
             read_all(L, f);  /* read entire file */
@@ -572,12 +829,14 @@ static int g_read (lua_State *L, FILE *f, int first) {
 
 
 static int io_read (lua_State *L) {
-  return g_read(L, getiofile(L, IO_INPUT), 1);
+  getiofile(L, IO_INPUT);  /* push default input */
+  return g_read(L, lua_gettop(L), 1);
 }
 
 
 static int f_read (lua_State *L) {
-  return g_read(L, tofile(L), 2);
+  tofile(L);  /* check that it's a valid file handle */
+  return g_read(L, 1, 2);
 }
 
 
@@ -591,7 +850,7 @@ static int io_readline (lua_State *L) {
   luaL_checkstack(L, n, "too many arguments");
   for (i = 1; i <= n; i++)  /* push arguments to 'g_read' */
     lua_pushvalue(L, lua_upvalueindex(3 + i));
-  n = g_read(L, p->f, 2);  /* 'n' is number of results */
+  n = g_read(L, lua_upvalueindex(1), 2);  /* 'n' is number of results */
   lua_assert(n > 0);  /* should return at least a nil */
   if (lua_toboolean(L, -n))  /* read at least one value? */
     return n;  /* return them */
@@ -611,10 +870,380 @@ static int io_readline (lua_State *L) {
 
 /* }====================================================== */
 
+/*
+** {======================================================
+** RECORDS
+** =======================================================
+*/
+
+#define uchar(c)	((unsigned char)(c))
+
+
+/* state of a record reader */
+typedef struct RecState {
+  int sep;  /* field separator */
+  int quote;  /* quote character (-1 if none) */
+  int esc;  /* escape character (equal to 'quote' for doubled quotes) */
+  int nfields;  /* number of fields in last record (size hint) */
+  size_t pos;  /* current position in a string source */
+} RecState;
+
+
+/*
+** Read a record (a line, except for line breaks inside quotes) from
+** [p, end) into the fields of the table at index 't'. Returns a pointer
+** to the end of the record or NULL if the record may continue after
+** 'end' ('final' false). Each field is created with a single copy.
+*/
+static const char *parserecord (lua_State *L, const RecState *rs, int t,
+                                const char *p, const char *end, int final,
+                                int *nf) {
+  const char *eol = (const char *)memchr(p, '\n', end - p);
+  int n = 0;
+  if (eol == NULL) {
+    if (!final) return NULL;
+    eol = end;
+  }
+  for (;;) {
+    const char *q;
+    if (p < eol && uchar(*p) == rs->quote) {  /* quoted field? */
+      luaL_Buffer b;
+      luaL_buffinit(L, &b);
+      p++;  /* skip opening quote */
+      for (;;) {
+        if (rs->esc == rs->quote)  /* only the quote is special? */
+          q = (const char *)memchr(p, rs->quote, end - p);
+        else {
+          for (q = p; q < end && uchar(*q) != rs->quote
+                              && uchar(*q) != rs->esc; q++) ;
+          if (q == end) q = NULL;
+        }
+        if (q == NULL || (uchar(*q) == rs->esc && q + 1 == end && !final)) {
+          if (!final) {  /* field may continue after 'end' */
+            luaL_pushresult(&b);
+            lua_pop(L, 1);
+            return NULL;
+          }
+          q = end;  /* unterminated quote: take the rest */
+        }
+        luaL_addlstring(&b, p, q - p);
+        if (q == end)
+          p = end;
+        else if (uchar(*q) == rs->esc && q + 1 < end &&
+                 (rs->esc != rs->quote || uchar(q[1]) == rs->quote)) {
+          luaL_addchar(&b, q[1]);  /* escaped character */
+          p = q + 2;
+          continue;
+        }
+        else
+          p = q + 1;  /* skip closing quote */
+        break;
+      }
+      /* after the closing quote, take everything up to a separator */
+      eol = (const char *)memchr(p, '\n', end - p);
+      if (eol == NULL) {
+        if (!final) {
+          luaL_pushresult(&b);
+          lua_pop(L, 1);
+          return NULL;
+        }
+        eol = end;
+      }
+      q = (const char *)memchr(p, rs->sep, eol - p);
+      if (q == NULL) q = eol;
+      luaL_addlstring(&b, p, (q == eol && q > p && q[-1] == '\r')
+                             ? q - p - 1 : q - p);
+      luaL_pushresult(&b);
+    }
+    else {
+      size_t l;
+      q = (const char *)memchr(p, rs->sep, eol - p);
+      if (q == NULL) q = eol;
+      l = q - p;
+      if (q == eol && l > 0 && q[-1] == '\r')
+        l--;  /* remove '\r' from a '\r\n' */
+      lua_pushlstring(L, p, l);
+    }
+    lua_rawseti(L, t, ++n);
+    if ((p = q) == eol)
+      break;
+    p++;  /* skip separator */
+  }
+  *nf = n;
+  return (eol < end) ? eol + 1 : end;
+}
+
+
+/*
+** Read a line from 'f' (with its '\n'), either into the handle's line
+** buffer or into a string pushed on the stack. Returns NULL at the end
+** of the file.
+*/
+static const char *recline (lua_State *L, FILE *f, LStreamExt *pe,
+                            size_t *len) {
+#if defined(l_getline)
+  if (pe != NULL) {
+    ssize_t n = l_getline(&pe->line, &pe->linesize, f);
+    if (n < 0) {
+      if (!feof(f) && !ferror(f))
+        luaL_error(L, "not enough memory");
+      return NULL;
+    }
+    *len = (size_t)n;
+    return pe->line;
+  }
+#else
+  (void)pe;
+#endif
+  if (!read_line(L, f, 0)) {
+    lua_pop(L, 1);
+    return NULL;
+  }
+  return lua_tolstring(L, -1, len);
+}
+
+
+static int filerecord (lua_State *L, int src, const RecState *rs, int t,
+                       int *nf) {
+  FILE *f = ((LStream *)lua_touserdata(L, src))->f;
+  LStreamExt *pe = toext(L, src);
+  int top = lua_gettop(L);
+  size_t len;
+  const char *s;
+  clearerr(f);
+  s = recline(L, f, pe, &len);
+  if (s != NULL &&
+      parserecord(L, rs, t, s, s + len, s[len - 1] != '\n', nf) == NULL) {
+    /* open quote: accumulate lines until the record ends */
+    lua_pushlstring(L, s, len);
+    for (;;) {  /* ends when 'final' is true, if not before */
+      int final;
+      s = recline(L, f, pe, &len);
+      final = (s == NULL || s[len - 1] != '\n');
+      if (s != NULL) {
+        lua_pushlstring(L, s, len);
+        if (lua_gettop(L) > top + 2)  /* 'recline' pushed a string? */
+          lua_remove(L, -2);
+        lua_concat(L, 2);
+      }
+      s = lua_tolstring(L, -1, &len);
+      if (parserecord(L, rs, t, s, s + len, final, nf) != NULL)
+        break;
+    }
+  }
+  lua_settop(L, top);
+  if (pe != NULL && pe->linesize > L_MAXLINEKEEP)
+    freeline(pe);
+  if (ferror(f))
+    luaL_error(L, "%s", strerror(errno));
+  return (s != NULL);
+}
+
+
+static int stringrecord (lua_State *L, int src, RecState *rs, int t,
+                         int *nf) {
+  size_t len;
+  const char *s = lua_tolstring(L, src, &len);
+  if (rs->pos >= len)
+    return 0;  /* no more records */
+  rs->pos = parserecord(L, rs, t, s + rs->pos, s + len, 1, nf) - s;
+  return 1;
+}
+
+
+/*
+** Read the next record from source 'src' into table 'row' (if not zero)
+** or into a new table. Leaves the table on the stack and returns 1, or
+** returns 0 after the last record.
+*/
+static int nextrecord (lua_State *L, int src, RecState *rs, int row) {
+  int t, n, oldn, ok;
+  if (row != 0) {
+    lua_pushvalue(L, row);
+    oldn = (int)lua_rawlen(L, -1);
+  }
+  else {
+    lua_createtable(L, rs->nfields, 0);
+    oldn = 0;
+  }
+  t = lua_gettop(L);
+  ok = (lua_type(L, src) == LUA_TSTRING) ? stringrecord(L, src, rs, t, &n)
+                                         : filerecord(L, src, rs, t, &n);
+  if (!ok) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  rs->nfields = n;
+  while (oldn > n) {  /* clear old fields */
+    lua_pushnil(L);
+    lua_rawseti(L, t, oldn--);
+  }
+  return 1;
+}
+
+
+static int io_recordline (lua_State *L) {
+  RecState *rs = (RecState *)lua_touserdata(L, lua_upvalueindex(2));
+  int row = lua_isnil(L, lua_upvalueindex(3)) ? 0 : lua_upvalueindex(3);
+  if (lua_type(L, lua_upvalueindex(1)) != LUA_TSTRING &&
+      isclosed((LStream *)lua_touserdata(L, lua_upvalueindex(1))))
+    return luaL_error(L, "file is already closed");
+  return nextrecord(L, lua_upvalueindex(1), rs, row);
+}
+
+
+static int getrecchar (lua_State *L, const char *field, int def, int none) {
+  size_t l;
+  const char *s;
+  int c = def;
+  if (lua_getfield(L, 2, field) != LUA_TNIL) {
+    s = lua_tolstring(L, -1, &l);
+    if (s != NULL && l == 1)
+      c = uchar(*s);
+    else if (s != NULL && l == 0 && none)
+      c = -1;
+    else
+      luaL_error(L, "option '%s' must be a single character", field);
+  }
+  lua_pop(L, 1);
+  return c;
+}
+
+
+/*
+** io.records(src [, options [, f]]): reads records from 'src' (a file
+** handle or a string with the data). Without 'f', returns an iterator;
+** otherwise, calls 'f' with each record and returns their number.
+*/
+static int io_records (lua_State *L) {
+  RecState *rs;
+  if (luaL_testudata(L, 1, LUA_FILEHANDLE))
+    tofile(L);  /* check that it's an open file */
+  else
+    luaL_checkstring(L, 1);
+  lua_settop(L, 3);
+  rs = (RecState *)lua_newuserdata(L, sizeof(RecState));  /* index 4 */
+  rs->nfields = 0;
+  rs->pos = 0;
+  if (lua_isnil(L, 2)) {
+    rs->sep = ',';
+    rs->quote = rs->esc = '"';
+    lua_pushnil(L);  /* no row table */
+  }
+  else {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    rs->sep = getrecchar(L, "sep", ',', 0);
+    rs->quote = getrecchar(L, "quote", '"', 1);
+    rs->esc = getrecchar(L, "escape", rs->quote, 0);
+    if (rs->sep == rs->quote || rs->sep == '\n' || rs->quote == '\n')
+      return luaL_argerror(L, 2, "invalid separator or quote");
+    if (lua_getfield(L, 2, "row") != LUA_TNIL)
+      luaL_argcheck(L, lua_istable(L, -1), 2, "'row' must be a table");
+  }  /* row table (or nil) at index 5 */
+  if (lua_isnil(L, 3)) {  /* return an iterator */
+    lua_pushvalue(L, 1);
+    lua_rotate(L, 4, 1);
+    lua_pushcclosure(L, io_recordline, 3);
+    return 1;
+  }
+  else {  /* call 'f' for each record */
+    lua_Integer n = 0;
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    while (nextrecord(L, 1, rs, lua_isnil(L, 5) ? 0 : 5)) {
+      lua_pushvalue(L, 3);
+      lua_insert(L, -2);
+      lua_call(L, 1, 0);
+      n++;
+    }
+    lua_pushinteger(L, n);
+    return 1;
+  }
+}
+
+/* }====================================================== */
+
+
+#if defined(l_writev)	/* { */
+
+/* maximum number of buffers in a single call to 'l_writev' */
+#if !defined(L_MAXIOV)
+#define L_MAXIOV	64
+#endif
+
+/* space for a number converted to a string */
+#define L_NUMSCRATCH	64
+
+
+/* write all buffers in 'iov', resuming after partial writes */
+static int writeiov (FILE *f, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = l_writev(f, iov, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;  /* interrupted? try again */
+      return 0;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {  /* skip written buffers */
+      w -= iov->iov_len;
+      iov++; n--;
+    }
+    if (n > 0) {  /* partially written buffer? */
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Write the arguments with 'l_writev', gathering up to L_MAXIOV of
+** them in each call. Strings are written directly from Lua memory;
+** numbers are converted into a scratch area. Used for unbuffered
+** streams, where 'fwrite' would do a system call for each argument.
+** (Buffered streams already write large pieces directly.)
+*/
+static int g_writev (lua_State *L, FILE *f, int arg, int nargs) {
+  struct iovec iov[L_MAXIOV];
+  char scratch[L_MAXIOV][L_NUMSCRATCH];
+  int n = 0;
+  int status = (fflush(f) == 0);  /* previous buffered data goes first */
+  for (; status && nargs--; arg++) {
+    if (lua_type(L, arg) == LUA_TNUMBER) {
+      int len = lua_isinteger(L, arg)
+                ? l_sprintf(scratch[n], L_NUMSCRATCH, LUA_INTEGER_FMT,
+                                        (LUAI_UACINT)lua_tointeger(L, arg))
+                : l_sprintf(scratch[n], L_NUMSCRATCH, LUA_NUMBER_FMT,
+                                        (LUAI_UACNUMBER)lua_tonumber(L, arg));
+      iov[n].iov_base = scratch[n];
+      iov[n].iov_len = (size_t)len;
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      iov[n].iov_base = (void *)s;
+      iov[n].iov_len = l;
+    }
+    if (iov[n].iov_len > 0 && ++n == L_MAXIOV) {  /* batch full? */
+      status = writeiov(f, iov, n);
+      n = 0;
+    }
+  }
+  status = status && writeiov(f, iov, n);
+  if (status) return 1;  /* file handle already on stack top */
+  else return luaL_fileresult(L, status, NULL);
+}
+
+#endif			/* } */
+
 
 static int g_write (lua_State *L, FILE *f, int arg) {
   int nargs = lua_gettop(L) - arg;
   int status = 1;
+#if defined(l_writev)
+  LStreamExt *pe = toext(L, -1);  /* file handle is on the top */
+  if (pe != NULL && pe->vbuf == _IONBF)
+    return g_writev(L, f, arg, nargs);
+#endif
   for (; nargs--; arg++) {
     if (lua_type(L, arg) == LUA_TNUMBER) {
       /* optimization: could be done exactly as for strings */
@@ -674,6 +1303,9 @@ static int f_setvbuf (lua_State *L) {
   int op = luaL_checkoption(L, 2, NULL, modenames);
   lua_Integer sz = luaL_optinteger(L, 3, LUAL_BUFFERSIZE);
   int res = setvbuf(f, NULL, mode[op], (size_t)sz);
+  LStreamExt *pe = toext(L, 1);
+  if (res == 0 && pe != NULL)
+    pe->vbuf = mode[op];  /* keep mode for 'g_write' */
   return luaL_fileresult(L, res == 0, NULL);
 }
 
@@ -689,18 +1321,510 @@ static int f_flush (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** MAPPED FILES AND BUFFERS
+** =======================================================
+*/
+
+#define LUA_MAPHANDLE	"MMAP*"
+#define LUA_BUFFERHANDLE	"BUFFER*"
+
+
+/* bytes of a mapped file or a buffer */
+typedef struct LMap {
+  const char *data;  /* mapped contents (NULL for empty files) */
+  size_t len;  /* length of contents */
+  int closed;
+} LMap;
+
+
+/* a buffer keeps its bytes right after this header */
+typedef struct LBuffer {
+  LMap m;
+  size_t size;  /* capacity */
+} LBuffer;
+
+#define bufferdata(b)	((char *)((b) + 1))
+
+
+static const char *const advicenames[] =
+  {"normal", "random", "sequential", "willneed", "dontneed", NULL};
+
+
+/*
+** l_mapfile maps a whole file for reading, returning 0 or an error
+** code; l_unmapfile undoes it; l_advise passes an access-pattern hint
+** (an index into 'advicenames') for a range of a mapping.
+*/
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int l_mapfile (lua_State *L, const char *fname, LMap *m) {
+  struct stat st;
+  int fd = open(fname, O_RDONLY);
+  int err = 0;
+  (void)L;
+  if (fd < 0)
+    return errno;
+  if (fstat(fd, &st) != 0)
+    err = errno;
+  else if ((off_t)(size_t)st.st_size != st.st_size)
+    err = EFBIG;  /* file does not fit in the address space */
+  else if (st.st_size > 0) {  /* ('mmap' rejects empty files) */
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      err = errno;
+    else {
+      m->data = (const char *)p;
+      m->len = (size_t)st.st_size;
+    }
+  }
+  close(fd);  /* mapping does not need it */
+  return err;
+}
+
+
+static void l_unmapfile (LMap *m) {
+  if (m->len > 0)
+    munmap((void *)m->data, m->len);
+}
+
+
+static int l_advise (LMap *m, size_t i, size_t n, int advice) {
+  static const int advices[] = {POSIX_MADV_NORMAL, POSIX_MADV_RANDOM,
+    POSIX_MADV_SEQUENTIAL, POSIX_MADV_WILLNEED, POSIX_MADV_DONTNEED};
+  size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = i - i % pagesize;  /* range must start at a page */
+  return posix_madvise((void *)(m->data + start), n + (i - start),
+                       advices[advice]);
+}
+
+#else				/* }{ */
+
+/* ISO C definitions */
+#define l_mapfile(L,fname,m)  \
+	  ((void)((void)fname, m), \
+	  luaL_error(L, "'mmap' not supported"))
+#define l_unmapfile(m)		((void)m)
+#define l_advise(m,i,n,a)	((void)m, (void)i, (void)n, (void)a, 0)
+
+#endif				/* } */
+
+
+#define tomap(L)	((LMap *)luaL_checkudata(L, 1, LUA_MAPHANDLE))
+
+
+static LMap *toopenmap (lua_State *L) {
+  LMap *m = tomap(L);
+  if (m->closed)
+    luaL_error(L, "attempt to use a closed mapped file");
+  return m;
+}
+
+
+/* methods to read bytes work both on mapped files and on buffers */
+static LMap *tobytes (lua_State *L) {
+  LMap *m = (LMap *)luaL_testudata(L, 1, LUA_BUFFERHANDLE);
+  return (m != NULL) ? m : toopenmap(L);
+}
+
+
+/* translate a relative string position (from strlib) */
+static lua_Integer posrelat (lua_Integer pos, size_t len) {
+  if (pos >= 0) return pos;
+  else if (0u - (size_t)pos > len) return 0;
+  else return (lua_Integer)len + pos + 1;
+}
+
+
+/*
+** Get the range 'i'..'j' of a mapping (as the arguments of 'string.sub')
+** as an offset and a length
+*/
+static size_t getrange (lua_State *L, LMap *m, int arg, lua_Integer defj,
+                        size_t *n) {
+  lua_Integer i = posrelat(luaL_optinteger(L, arg, 1), m->len);
+  lua_Integer j = posrelat(luaL_optinteger(L, arg + 1, defj), m->len);
+  if (i < 1) i = 1;
+  if (j > (lua_Integer)m->len) j = (lua_Integer)m->len;
+  *n = (i > j) ? 0 : (size_t)(j - i) + 1;
+  return (size_t)i - 1;
+}
+
+
+static int io_mmap (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  int advice = luaL_checkoption(L, 2, "normal", advicenames);
+  LMap *m = (LMap *)lua_newuserdata(L, sizeof(LMap));
+  int err;
+  m->data = NULL;
+  m->len = 0;
+  m->closed = 1;  /* so that a memory error leaves it consistent */
+  luaL_setmetatable(L, LUA_MAPHANDLE);
+  err = l_mapfile(L, fname, m);
+  if (err != 0) {
+    errno = err;
+    return luaL_fileresult(L, 0, fname);
+  }
+  m->closed = 0;
+  if (advice != 0 && m->len > 0)
+    (void)l_advise(m, 0, m->len, advice);
+  return 1;
+}
+
+
+static int m_close (lua_State *L) {
+  LMap *m = toopenmap(L);
+  l_unmapfile(m);
+  m->data = NULL;
+  m->len = 0;
+  m->closed = 1;
+  return 0;
+}
+
+
+static int m_gc (lua_State *L) {
+  LMap *m = tomap(L);
+  if (!m->closed)
+    l_unmapfile(m);
+  return 0;
+}
+
+
+static int m_tostring (lua_State *L) {
+  LMap *m = tomap(L);
+  if (m->closed)
+    lua_pushliteral(L, "mapped file (closed)");
+  else
+    lua_pushfstring(L, "mapped file (%p)", m->data);
+  return 1;
+}
+
+
+static int m_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)tobytes(L)->len);
+  return 1;
+}
+
+
+/* m:sub(i [, j]): a copy of bytes 'i'..'j', as 'string.sub' */
+static int m_sub (lua_State *L) {
+  LMap *m = tobytes(L);
+  size_t n;
+  size_t i = getrange(L, m, 2, -1, &n);
+  lua_pushlstring(L, m->data + i, n);
+  return 1;
+}
+
+
+/* m:byte([i [, j]]): codes of bytes 'i'..'j', as 'string.byte' */
+static int m_byte (lua_State *L) {
+  LMap *m = tobytes(L);
+  lua_Integer defj = posrelat(luaL_optinteger(L, 2, 1), m->len);
+  size_t n, k;
+  size_t i = getrange(L, m, 2, defj, &n);
+  if (n >= INT_MAX)  /* arithmetic overflow? */
+    return luaL_error(L, "mapped slice too long");
+  luaL_checkstack(L, (int)n, "mapped slice too long");
+  for (k = 0; k < n; k++)
+    lua_pushinteger(L, (unsigned char)m->data[i + k]);
+  return (int)n;
+}
+
+
+/* search for a plain string (from strlib) */
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 == 0) return s1;  /* empty strings are everywhere */
+  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else {
+    const char *init;  /* to search for a '*s2' inside 's1' */
+    l2--;  /* 1st char will be checked by 'memchr' */
+    l1 = l1-l2;  /* 's2' cannot be found after that */
+    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+      init++;   /* 1st char is already checked */
+      if (memcmp(init, s2+1, l2) == 0)
+        return init-1;
+      else {  /* correct 'l1' and 's1' to try again */
+        l1 -= init-s1;
+        s1 = init;
+      }
+    }
+    return NULL;  /* not found */
+  }
+}
+
+
+/* m:find(s [, init]): plain search, as 'string.find' with 'plain' */
+static int m_find (lua_State *L) {
+  LMap *m = tobytes(L);
+  size_t ls;
+  const char *s = luaL_checklstring(L, 2, &ls);
+  lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), m->len);
+  const char *r;
+  if (init < 1) init = 1;
+  if (init > (lua_Integer)m->len + 1) {  /* start after the end? */
+    lua_pushnil(L);
+    return 1;
+  }
+  if (m->len == 0)  /* no data to search? */
+    r = (ls == 0) ? "" : NULL;
+  else
+    r = lmemfind(m->data + init - 1, m->len - (size_t)init + 1, s, ls);
+  if (r == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  else {
+    lua_Integer start = (m->len == 0) ? 1 : (r - m->data) + 1;
+    lua_pushinteger(L, start);
+    lua_pushinteger(L, start + (lua_Integer)ls - 1);
+    return 2;
+  }
+}
+
+
+/* m:advise(advice [, i [, j]]): hint the access pattern for a range */
+static int m_advise (lua_State *L) {
+  LMap *m = toopenmap(L);
+  int advice = luaL_checkoption(L, 2, NULL, advicenames);
+  size_t n;
+  size_t i = getrange(L, m, 3, -1, &n);
+  int err = (n > 0) ? l_advise(m, i, n, advice) : 0;
+  if (err != 0)
+    errno = err;
+  return luaL_fileresult(L, err == 0, NULL);
+}
+
+
+/* dummy union to get native endianness (from strlib) */
+static const union {
+  int dummy;
+  char little;  /* true iff machine is little endian */
+} nativeendian = {1};
+
+
+/* maximum size for the binary representation of an integer */
+#define MAXINTSIZE	16
+
+
+/* read an integer numeral from 'fmt' (from strlib) */
+static int getnum (const char **fmt, int df) {
+  if (!isdigit((unsigned char)**fmt))  /* no number? */
+    return df;  /* return default value */
+  else {
+    int a = 0;
+    do {
+      a = a*10 + (*((*fmt)++) - '0');
+    } while (isdigit((unsigned char)**fmt) && a <= (INT_MAX - 9)/10);
+    return a;
+  }
+}
+
+
+/* (from strlib) */
+static lua_Integer unpackint (lua_State *L, const char *str,
+                              int islittle, int size, int issigned) {
+  lua_Unsigned res = 0;
+  int i;
+  int limit = (size  <= (int)sizeof(lua_Integer)) ? size
+                                                  : (int)sizeof(lua_Integer);
+  for (i = limit - 1; i >= 0; i--) {
+    res <<= CHAR_BIT;
+    res |= (lua_Unsigned)(unsigned char)str[islittle ? i : size - 1 - i];
+  }
+  if (size < (int)sizeof(lua_Integer)) {  /* needs sign extension? */
+    if (issigned) {
+      lua_Unsigned mask = (lua_Unsigned)1 << (size*CHAR_BIT - 1);
+      res = ((res ^ mask) - mask);  /* do sign extension */
+    }
+  }
+  else if (size > (int)sizeof(lua_Integer)) {  /* check unread bytes */
+    int mask = (!issigned || (lua_Integer)res >= 0) ? 0 : UCHAR_MAX;
+    for (i = limit; i < size; i++) {
+      if ((unsigned char)str[islittle ? i : size - 1 - i] != mask)
+        luaL_error(L, "%d-byte integer does not fit into Lua Integer", size);
+    }
+  }
+  return (lua_Integer)res;
+}
+
+
+/*
+** m:unpack(fmt [, pos]): as 'string.unpack', for the fixed-size numeric
+** options only (endianness, integers, and floats); use 'm:sub' for
+** strings.
+*/
+static int m_unpack (lua_State *L) {
+  LMap *m = tobytes(L);
+  const char *fmt = luaL_checkstring(L, 2);
+  size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), m->len) - 1;
+  int islittle = nativeendian.little;
+  int n = 0;  /* number of results */
+  luaL_argcheck(L, pos <= m->len, 3, "initial position out of range");
+  while (*fmt != '\0') {
+    int size;
+    int kind = 0;  /* 0: signed integer; 1: unsigned integer; 2: float */
+    int opt = *fmt++;
+    switch (opt) {
+      case ' ': continue;
+      case '<': islittle = 1; continue;
+      case '>': islittle = 0; continue;
+      case '=': islittle = nativeendian.little; continue;
+      case 'b': size = sizeof(char); break;
+      case 'B': size = sizeof(char); kind = 1; break;
+      case 'h': size = sizeof(short); break;
+      case 'H': size = sizeof(short); kind = 1; break;
+      case 'l': size = sizeof(long); break;
+      case 'L': size = sizeof(long); kind = 1; break;
+      case 'j': size = sizeof(lua_Integer); break;
+      case 'J': size = sizeof(lua_Integer); kind = 1; break;
+      case 'T': size = sizeof(size_t); kind = 1; break;
+      case 'f': size = sizeof(float); kind = 2; break;
+      case 'd': size = sizeof(double); kind = 2; break;
+      case 'n': size = sizeof(lua_Number); kind = 2; break;
+      case 'i': case 'I': {
+        size = getnum(&fmt, sizeof(int));
+        if (size > MAXINTSIZE || size <= 0)
+          luaL_error(L, "integral size (%d) out of limits [1,%d]",
+                        size, MAXINTSIZE);
+        kind = (opt == 'I');
+        break;
+      }
+      default: return luaL_error(L, "invalid format option '%c'", opt);
+    }
+    luaL_argcheck(L, (size_t)size <= m->len - pos, 2, "data string too short");
+    luaL_checkstack(L, 2, "too many results");
+    n++;
+    if (kind == 2) {
+      union { float f; double d; lua_Number n;
+              char buff[5 * sizeof(lua_Number)]; } u;
+      int i;
+      for (i = 0; i < size; i++)  /* copy bytes in native order */
+        u.buff[i] = m->data[pos + (islittle == nativeendian.little
+                                   ? i : size - 1 - i)];
+      if (opt == 'f')
+        lua_pushnumber(L, (lua_Number)u.f);
+      else if (opt == 'd')
+        lua_pushnumber(L, (lua_Number)u.d);
+      else
+        lua_pushnumber(L, u.n);
+    }
+    else
+      lua_pushinteger(L, unpackint(L, m->data + pos, islittle, size, !kind));
+    pos += size;
+  }
+  lua_pushinteger(L, (lua_Integer)pos + 1);  /* next position */
+  return n + 1;
+}
+
+
+/*
+** io.buffer(size): a new buffer for 'f:readinto', which can hold up
+** to 'size' bytes
+*/
+static int io_buffer (lua_State *L) {
+  lua_Integer size = luaL_checkinteger(L, 1);
+  LBuffer *b;
+  luaL_argcheck(L, 0 <= size && (lua_Unsigned)size < (size_t)~0 / 2, 1,
+                   "invalid size");
+  b = (LBuffer *)lua_newuserdata(L, sizeof(LBuffer) + (size_t)size);
+  b->m.data = bufferdata(b);
+  b->m.len = 0;
+  b->m.closed = 0;
+  b->size = (size_t)size;
+  luaL_setmetatable(L, LUA_BUFFERHANDLE);
+  return 1;
+}
+
+
+static int b_tostring (lua_State *L) {
+  LBuffer *b = (LBuffer *)luaL_checkudata(L, 1, LUA_BUFFERHANDLE);
+  lua_pushfstring(L, "buffer (%p)", b);
+  return 1;
+}
+
+
+/*
+** f:readinto(buffer [, n]): read up to 'n' bytes (default is the size
+** of the buffer) directly into 'buffer', replacing its contents.
+** Returns the number of bytes read, or nil at the end of file.
+*/
+static int f_readinto (lua_State *L) {
+  FILE *f = tofile(L);
+  LBuffer *b = (LBuffer *)luaL_checkudata(L, 2, LUA_BUFFERHANDLE);
+  lua_Integer n = luaL_optinteger(L, 3, (lua_Integer)b->size);
+  size_t nr;
+  luaL_argcheck(L, 0 <= n && (lua_Unsigned)n <= b->size, 3,
+                   "out of buffer bounds");
+  clearerr(f);
+  nr = fread(bufferdata(b), sizeof(char), (size_t)n, f);
+  b->m.len = nr;
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  if (nr == 0 && n > 0)  /* end of file? */
+    lua_pushnil(L);
+  else
+    lua_pushinteger(L, (lua_Integer)nr);
+  return 1;
+}
+
+
+/*
+** methods for mapped files
+*/
+static const luaL_Reg mlib[] = {
+  {"advise", m_advise},
+  {"byte", m_byte},
+  {"close", m_close},
+  {"find", m_find},
+  {"len", m_len},
+  {"sub", m_sub},
+  {"unpack", m_unpack},
+  {"__gc", m_gc},
+  {"__len", m_len},
+  {"__tostring", m_tostring},
+  {NULL, NULL}
+};
+
+
+/*
+** methods for buffers
+*/
+static const luaL_Reg blib[] = {
+  {"byte", m_byte},
+  {"find", m_find},
+  {"len", m_len},
+  {"sub", m_sub},
+  {"unpack", m_unpack},
+  {"__len", m_len},
+  {"__tostring", b_tostring},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
 /*
 ** functions for 'io' library
 */
 static const luaL_Reg iolib[] = {
+  {"buffer", io_buffer},
   {"close", io_close},
   {"flush", io_flush},
   {"input", io_input},
   {"lines", io_lines},
+  {"mmap", io_mmap},
   {"open", io_open},
   {"output", io_output},
   {"popen", io_popen},
   {"read", io_read},
+  {"records", io_records},
   {"tmpfile", io_tmpfile},
   {"type", io_type},
   {"write", io_write},
@@ -716,6 +1840,9 @@ static const luaL_Reg flib[] = {
   {"flush", f_flush},
   {"lines", f_lines},
   {"read", f_read},
+  {"readinto", f_readinto},
+  {"readnumbers", f_readnumbers},
+  {"records", io_records},
   {"seek", f_seek},
   {"setvbuf", f_setvbuf},
   {"write", f_write},
@@ -725,12 +1852,23 @@ static const luaL_Reg flib[] = {
 };
 
 
+static void newmeta (lua_State *L, const char *tname, const luaL_Reg *l) {
+  luaL_newmetatable(L, tname);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, l, 0);
+  lua_pop(L, 1);
+}
+
+
 static void createmeta (lua_State *L) {
   luaL_newmetatable(L, LUA_FILEHANDLE);  /* create metatable for file handles */
   lua_pushvalue(L, -1);  /* push metatable */
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, flib, 0);  /* add file methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+  newmeta(L, LUA_MAPHANDLE, mlib);  /* same for mapped files */
+  newmeta(L, LUA_BUFFERHANDLE, blib);  /* and for buffers */
 }
 
 
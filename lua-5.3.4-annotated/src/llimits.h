@@ -178,6 +178,15 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** Define LUAI_COMPACTHASH to keep the hash part of tables as a dense
+** array of entries, in insertion order and sized to fit, plus an index
+** of 8-, 16- or 32-bit entry numbers, instead of a power-of-2 array of
+** nodes (see ltable.c).
+*/
+/* #define LUAI_COMPACTHASH */
+
+
 /*
 ** Initial size for the string table (must be power of 2).
 ** The Lua core alone registers ~50 strings (reserved words +
@@ -14,6 +14,8 @@
 #include "lprefix.h"
 
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -421,6 +423,218 @@ static int readable (const char *filename) {
 }
 
 
+/*
+** {======================================================
+** Search cache
+** =======================================================
+*/
+
+/*
+** key, in the registry, for the search cache. The cache maps each
+** directory already looked at to its listing, a table mapping entry
+** names to true (exists) or false (does not exist); a listing with
+** a true at index 1 is complete, so that names not in it do not
+** exist. Entries 1 and 2 of the cache keep the values of 'package.path'
+** and 'package.cpath' the cache is valid for. Files created after
+** their directory was listed are not seen until the cache is cleared.
+*/
+static const int SEARCHCACHE = 0;
+
+
+/*
+** l_listdir pushes a complete listing of directory 'dir', or an empty
+** incomplete one if the directory cannot be listed.
+*/
+#if !defined(l_listdir)		/* { */
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <dirent.h>
+
+static void l_listdir (lua_State *L, const char *dir) {
+  DIR *d = opendir(dir);
+  int complete = (d != NULL || errno == ENOENT || errno == ENOTDIR);
+  lua_newtable(L);
+  if (d != NULL) {
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, e->d_name);
+    }
+    closedir(d);
+  }
+  if (complete) {
+    lua_pushboolean(L, 1);
+    lua_rawseti(L, -2, 1);  /* listing is complete */
+  }
+}
+
+#else				/* }{ */
+
+#define l_listdir(L,dir)	((void)(dir), lua_newtable(L))
+
+#endif				/* } */
+
+#endif				/* } */
+
+
+static void newcache (lua_State *L) {
+  lua_createtable(L, 2, 0);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &SEARCHCACHE);
+}
+
+
+/*
+** Clear the cache if the path at index 'pathidx' is not the one it was
+** built for. ('slot' is 1 for 'package.path', 2 for 'package.cpath'.)
+*/
+static void checkcache (lua_State *L, int slot, int pathidx) {
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &SEARCHCACHE);
+  if (lua_rawgeti(L, -1, slot) == LUA_TNIL) {  /* first use of this path? */
+    lua_pushvalue(L, pathidx);
+    lua_rawseti(L, -3, slot);
+  }
+  else if (!lua_rawequal(L, -1, pathidx)) {  /* path changed? */
+    lua_createtable(L, 2, 0);  /* new cache */
+    lua_rawgeti(L, -3, 3 - slot);  /* keep the other path */
+    lua_rawseti(L, -2, 3 - slot);
+    lua_pushvalue(L, pathidx);
+    lua_rawseti(L, -2, slot);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &SEARCHCACHE);
+  }
+  lua_pop(L, 2);
+}
+
+
+/* push the directory part of 'filename' and return its last part */
+static const char *pushdirname (lua_State *L, const char *filename) {
+  const char *base = strrchr(filename, *LUA_DIRSEP);
+  if (base == NULL) {
+    lua_pushliteral(L, ".");
+    return filename;
+  }
+  /* keep the separator of a root directory */
+  lua_pushlstring(L, filename, (base == filename) ? 1 : base - filename);
+  return base + 1;
+}
+
+
+/*
+** Check whether the cache at index 'cache' knows that 'filename' does
+** not exist, because it has a complete listing of its directory.
+*/
+static int knownmissing (lua_State *L, int cache, const char *filename) {
+  int top = lua_gettop(L);
+  const char *base = pushdirname(L, filename);
+  int res = (*base != '\0' && lua_rawget(L, cache) == LUA_TTABLE &&
+             lua_getfield(L, top + 1, base) == LUA_TNIL &&
+             lua_rawgeti(L, top + 1, 1) != LUA_TNIL);
+  lua_settop(L, top);
+  return res;
+}
+
+
+/*
+** Same as 'readable', but avoiding system calls for files that are
+** known not to exist.
+*/
+static int cachedreadable (lua_State *L, const char *filename) {
+  int top = lua_gettop(L);
+  const char *base;
+  int res;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &SEARCHCACHE);  /* at 'top + 1' */
+  base = pushdirname(L, filename);  /* directory name at 'top + 2' */
+  lua_pushvalue(L, top + 2);
+  if (lua_rawget(L, top + 1) != LUA_TTABLE) {  /* not listed yet? */
+    lua_pop(L, 1);
+    if (knownmissing(L, top + 1, lua_tostring(L, top + 2))) {
+      lua_createtable(L, 1, 0);  /* empty listing */
+      lua_pushboolean(L, 1);
+      lua_rawseti(L, -2, 1);  /* that is complete */
+    }
+    else
+      l_listdir(L, lua_tostring(L, top + 2));
+    lua_pushvalue(L, top + 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, top + 1);  /* cache[dir] = listing */
+  }  /* listing at 'top + 3' */
+  switch (lua_getfield(L, top + 3, base)) {
+    case LUA_TNIL:  /* unknown entry */
+      if (lua_rawgeti(L, top + 3, 1) != LUA_TNIL)  /* complete listing? */
+        res = 0;
+      else if (!(res = readable(filename))) {
+        lua_pushboolean(L, 0);
+        lua_setfield(L, top + 3, base);  /* remember it does not exist */
+      }
+      break;
+    case LUA_TBOOLEAN:
+      res = lua_toboolean(L, -1) && readable(filename);
+      break;
+    default:  /* cannot happen */
+      res = readable(filename);
+      break;
+  }
+  lua_settop(L, top);
+  return res;
+}
+
+
+static int ll_clearcache (lua_State *L) {
+  newcache(L);
+  return 0;
+}
+
+
+/*
+** Read an index file: each non-empty line not starting with '#' has a
+** module name and its file name, separated by blanks. Returns a table
+** mapping names to file names, to be used as 'package.index'.
+*/
+static int ll_loadindex (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  FILE *f = fopen(fname, "r");
+  int c;
+  if (f == NULL)
+    return luaL_fileresult(L, 0, fname);
+  lua_newtable(L);
+  do {
+    luaL_Buffer b;
+    size_t l, i;
+    const char *line;
+    luaL_buffinit(L, &b);
+    while ((c = getc(f)) != EOF && c != '\n')
+      luaL_addchar(&b, c);
+    luaL_pushresult(&b);
+    line = lua_tolstring(L, -1, &l);
+    while (l > 0 && isspace((unsigned char)line[l - 1])) l--;
+    while (l > 0 && isspace((unsigned char)*line)) line++, l--;
+    if (l > 0 && *line != '#') {
+      for (i = 0; i < l && !isspace((unsigned char)line[i]); i++) ;
+      lua_pushlstring(L, line, i);  /* module name */
+      while (i < l && isspace((unsigned char)line[i])) i++;
+      if (i == l) {
+        fclose(f);
+        return luaL_error(L, "%s: missing file name for module '%s'",
+                             fname, lua_tostring(L, -1));
+      }
+      lua_pushlstring(L, line + i, l - i);  /* file name */
+      lua_rawset(L, -4);
+    }
+    lua_pop(L, 1);  /* line */
+  } while (c != EOF);
+  if (ferror(f)) {
+    int en = errno;
+    fclose(f);
+    errno = en;
+    return luaL_fileresult(L, 0, fname);
+  }
+  fclose(f);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static const char *pushnexttemplate (lua_State *L, const char *path) {
   const char *l;
   while (*path == *LUA_PATH_SEP) path++;  /* skip separators */
@@ -435,7 +649,8 @@ static const char *pushnexttemplate (lua_State *L, const char *path) {
 static const char *searchpath (lua_State *L, const char *name,
                                              const char *path,
                                              const char *sep,
-                                             const char *dirsep) {
+                                             const char *dirsep,
+                                             int cached) {
   luaL_Buffer msg;  /* to build error message */
   luaL_buffinit(L, &msg);
   if (*sep != '\0')  /* non-empty separator? */
@@ -444,7 +659,8 @@ static const char *searchpath (lua_State *L, const char *name,
     const char *filename = luaL_gsub(L, lua_tostring(L, -1),
                                      LUA_PATH_MARK, name);
     lua_remove(L, -2);  /* remove path template */
-    if (readable(filename))  /* does file exist and is readable? */
+    /* does file exist and is readable? */
+    if (cached ? cachedreadable(L, filename) : readable(filename))
       return filename;  /* return that file name */
     lua_pushfstring(L, "\n\tno file '%s'", filename);
     lua_remove(L, -2);  /* remove file name */
@@ -459,7 +675,7 @@ static int ll_searchpath (lua_State *L) {
   const char *f = searchpath(L, luaL_checkstring(L, 1),
                                 luaL_checkstring(L, 2),
                                 luaL_optstring(L, 3, "."),
-                                luaL_optstring(L, 4, LUA_DIRSEP));
+                                luaL_optstring(L, 4, LUA_DIRSEP), 0);
   if (f != NULL) return 1;
   else {  /* error message is on top of the stack */
     lua_pushnil(L);
@@ -469,15 +685,47 @@ static int ll_searchpath (lua_State *L) {
 }
 
 
+/*
+** Look for module 'name' in 'package.index'. The file name found there
+** is used only if the search through 'path' could give it.
+*/
+static const char *findinindex (lua_State *L, const char *name,
+                                              const char *path,
+                                              const char *dirsep) {
+  int top = lua_gettop(L);
+  if (lua_getfield(L, lua_upvalueindex(1), "index") == LUA_TTABLE &&
+      lua_getfield(L, -1, name) == LUA_TSTRING) {
+    const char *indexed = lua_tostring(L, -1);
+    name = luaL_gsub(L, name, ".", dirsep);
+    while ((path = pushnexttemplate(L, path)) != NULL) {
+      const char *filename = luaL_gsub(L, lua_tostring(L, -1),
+                                       LUA_PATH_MARK, name);
+      if (strcmp(filename, indexed) == 0) {
+        lua_replace(L, top + 1);
+        lua_settop(L, top + 1);
+        return lua_tostring(L, -1);
+      }
+      lua_pop(L, 2);  /* remove template and file name */
+    }
+  }
+  lua_settop(L, top);
+  return NULL;
+}
+
+
 static const char *findfile (lua_State *L, const char *name,
                                            const char *pname,
                                            const char *dirsep) {
   const char *path;
+  const char *filename;
   lua_getfield(L, lua_upvalueindex(1), pname);
   path = lua_tostring(L, -1);
   if (path == NULL)
     luaL_error(L, "'package.%s' must be a string", pname);
-  return searchpath(L, name, path, ".", dirsep);
+  if ((filename = findinindex(L, name, path, dirsep)) != NULL)
+    return filename;
+  checkcache(L, (strcmp(pname, "path") == 0) ? 1 : 2, lua_gettop(L));
+  return searchpath(L, name, path, ".", dirsep, 1);
 }
 
 
@@ -492,11 +740,260 @@ static int checkload (lua_State *L, int stat, const char *filename) {
 }
 
 
+/*
+** {======================================================
+** Bundles
+** =======================================================
+*/
+
+/*
+** A bundle is a file with precompiled modules, as created by 'luac -b'.
+** It starts with LUA_BUNDLESIG and the number of modules, followed by
+** an index with an entry for each module, sorted by module name: the
+** offset and size of its name and the offset and size of its chunk.
+** All numbers are 4-byte little-endian integers; offsets count from
+** the start of the file.
+*/
+#define BUNDLEHEADER	(sizeof(LUA_BUNDLESIG) - 1 + 4)
+#define BUNDLEENTRY	16
+
+
+/*
+** unique key for table in the registry that keeps the bundles already
+** opened, indexed by file name
+*/
+static const int BUNDLES = 0;
+
+#define BUNDLEHANDLE	"_BUNDLE"
+
+
+typedef struct Bundle {
+  const char *data;  /* contents of the bundle file (NULL if closed) */
+  size_t size;  /* size of 'data' */
+} Bundle;
+
+
+/*
+** l_mapbundle returns the contents of a whole file, mapped in memory
+** when possible; l_unmapbundle releases them.
+*/
+#if !defined(l_mapbundle)	/* { */
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *l_mapbundle (const char *fname, size_t *size) {
+  struct stat st;
+  void *p = MAP_FAILED;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+      (off_t)(size_t)st.st_size == st.st_size) {
+    *size = (size_t)st.st_size;
+    p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  return (p == MAP_FAILED) ? NULL : (const char *)p;
+}
+
+#define l_unmapbundle(p,size)	munmap((void *)(p), size)
+
+#else				/* }{ */
+
+/* ISO C definitions: read whole file */
+static const char *l_mapbundle (const char *fname, size_t *size) {
+  FILE *f = fopen(fname, "rb");
+  char *p = NULL;
+  long l = 0;
+  if (f == NULL)
+    return NULL;
+  if (fseek(f, 0, SEEK_END) == 0 && (l = ftell(f)) > 0 &&
+      fseek(f, 0, SEEK_SET) == 0 && (p = (char *)malloc(l)) != NULL &&
+      fread(p, 1, l, f) != (size_t)l) {
+    free(p);
+    p = NULL;
+  }
+  fclose(f);
+  *size = (size_t)l;
+  return p;
+}
+
+#define l_unmapbundle(p,size)	((void)(size), free((void *)(p)))
+
+#endif				/* } */
+
+#endif				/* } */
+
+
+static size_t getu32 (const char *p) {
+  const unsigned char *s = (const unsigned char *)p;
+  return (size_t)s[0] | ((size_t)s[1] << 8) | ((size_t)s[2] << 16) |
+         ((size_t)s[3] << 24);
+}
+
+
+/*
+** check that the offset and the size at 'p' give a block inside bundle
+** 'b' (comparing each one with the size of the bundle before adding)
+*/
+static int inbundle (const Bundle *b, const char *p) {
+  size_t offset = getu32(p);
+  return (offset <= b->size && getu32(p + 4) <= b->size - offset);
+}
+
+
+/* check that the contents of a bundle are consistent */
+static int checkbundle (const Bundle *b) {
+  size_t n, i;
+  if (b->size < BUNDLEHEADER ||
+      memcmp(b->data, LUA_BUNDLESIG, sizeof(LUA_BUNDLESIG) - 1) != 0)
+    return 0;
+  n = getu32(b->data + BUNDLEHEADER - 4);
+  if (n > (b->size - BUNDLEHEADER) / BUNDLEENTRY)
+    return 0;
+  for (i = 0; i < n; i++) {
+    const char *e = b->data + BUNDLEHEADER + i * BUNDLEENTRY;
+    if (!inbundle(b, e) || !inbundle(b, e + 8))  /* name and chunk */
+      return 0;
+  }
+  return 1;
+}
+
+
+static int bundle_gc (lua_State *L) {
+  Bundle *b = (Bundle *)luaL_checkudata(L, 1, BUNDLEHANDLE);
+  if (b->data != NULL) {
+    l_unmapbundle(b->data, b->size);
+    b->data = NULL;
+  }
+  return 0;
+}
+
+
+/*
+** Return the bundle in file 'fname', opening it if needed, or NULL if
+** the file cannot be opened.
+*/
+static const Bundle *getbundle (lua_State *L, const char *fname) {
+  Bundle *b;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &BUNDLES);
+  if (lua_getfield(L, -1, fname) == LUA_TNIL) {  /* not opened yet? */
+    lua_pop(L, 1);
+    b = (Bundle *)lua_newuserdata(L, sizeof(Bundle));
+    b->data = NULL;
+    luaL_setmetatable(L, BUNDLEHANDLE);
+    b->data = l_mapbundle(fname, &b->size);
+    if (b->data == NULL) {
+      lua_pop(L, 2);  /* bundle and BUNDLES table */
+      return NULL;
+    }
+    if (!checkbundle(b))
+      luaL_error(L, "file '%s' is not a valid bundle", fname);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, fname);  /* BUNDLES[fname] = bundle */
+  }
+  b = (Bundle *)lua_touserdata(L, -1);
+  lua_pop(L, 2);  /* bundle stays alive in BUNDLES */
+  return b;
+}
+
+
+/* binary search for module 'name' in the index of bundle 'b' */
+static const char *findinbundle (const Bundle *b, const char *name,
+                                 size_t *size) {
+  size_t len = strlen(name);
+  size_t lo = 0;
+  size_t hi = getu32(b->data + BUNDLEHEADER - 4);
+  while (lo < hi) {
+    size_t m = lo + (hi - lo) / 2;
+    const char *e = b->data + BUNDLEHEADER + m * BUNDLEENTRY;
+    size_t elen = getu32(e + 4);
+    int res = memcmp(name, b->data + getu32(e), (len < elen) ? len : elen);
+    if (res == 0)
+      res = (len > elen) - (len < elen);
+    if (res == 0) {  /* found it */
+      *size = getu32(e + 12);
+      return b->data + getu32(e + 8);
+    }
+    else if (res < 0) hi = m;
+    else lo = m + 1;
+  }
+  return NULL;
+}
+
+
+/*
+** Look for module 'name' in the bundles listed in 'package.bundles'.
+** Return 2 with the loader and the bundle name on the stack if it
+** finds the module; otherwise return 1 with an error message.
+*/
+static int searchbundles (lua_State *L, const char *name) {
+  luaL_Buffer msg;  /* to build error message */
+  int t, i;
+  if (lua_getfield(L, lua_upvalueindex(1), "bundles") != LUA_TTABLE)
+    luaL_error(L, "'package.bundles' must be a table");
+  t = lua_gettop(L);
+  luaL_buffinit(L, &msg);
+  for (i = 1; lua_rawgeti(L, t, i) != LUA_TNIL; i++) {
+    const char *fname = lua_tostring(L, -1);
+    const Bundle *b;
+    const char *chunk;
+    size_t size;
+    if (fname == NULL)
+      luaL_error(L, "'package.bundles' must contain file names");
+    b = getbundle(L, fname);
+    if (b != NULL && (chunk = findinbundle(b, name, &size)) != NULL) {
+      const char *chunkname = lua_pushfstring(L, "@%s", fname);
+      int stat = luaL_loadbufferx(L, chunk, size, chunkname, "b");
+      lua_remove(L, -2);  /* remove chunk name */
+      return checkload(L, (stat == LUA_OK), fname);
+    }
+    lua_pushfstring(L, "\n\tno module '%s' in %s '%s'", name,
+                       (b != NULL) ? "bundle" : "missing bundle", fname);
+    lua_remove(L, -2);  /* remove file name */
+    luaL_addvalue(&msg);
+  }
+  lua_pop(L, 1);  /* remove nil */
+  luaL_pushresult(&msg);
+  lua_remove(L, t);  /* remove 'package.bundles' */
+  return 1;
+}
+
+
+/*
+** create table BUNDLES and the metatable for bundles
+*/
+static void createbundlestable (lua_State *L) {
+  lua_newtable(L);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &BUNDLES);
+  luaL_newmetatable(L, BUNDLEHANDLE);
+  lua_pushcfunction(L, bundle_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
+
+
 static int searcher_Lua (lua_State *L) {
   const char *filename;
   const char *name = luaL_checkstring(L, 1);
+  int msg;
+  if (searchbundles(L, name) == 2)
+    return 2;  /* found it in a bundle */
+  msg = lua_gettop(L);  /* index of error message from bundles */
   filename = findfile(L, name, "path", LUA_LSUBSEP);
-  if (filename == NULL) return 1;  /* module not found in this path */
+  if (filename == NULL) {  /* module not found in this path? */
+    lua_pushvalue(L, msg);
+    lua_insert(L, -2);  /* put bundle message before path message */
+    lua_concat(L, 2);
+    return 1;
+  }
   return checkload(L, (luaL_loadfile(L, filename) == LUA_OK), filename);
 }
 
@@ -706,6 +1203,8 @@ static int ll_seeall (lua_State *L) {
 
 
 static const luaL_Reg pk_funcs[] = {
+  {"clearcache", ll_clearcache},
+  {"loadindex", ll_loadindex},
   {"loadlib", ll_loadlib},
   {"searchpath", ll_searchpath},
 #if defined(LUA_COMPAT_MODULE)
@@ -713,6 +1212,7 @@ static const luaL_Reg pk_funcs[] = {
 #endif
   /* placeholders */
   {"preload", NULL},
+  {"bundles", NULL},
   {"cpath", NULL},
   {"path", NULL},
   {"searchers", NULL},
@@ -766,6 +1266,8 @@ static void createclibstable (lua_State *L) {
 
 LUAMOD_API int luaopen_package (lua_State *L) {
   createclibstable(L);
+  createbundlestable(L);
+  newcache(L);
   luaL_newlib(L, pk_funcs);  /* create 'package' table */
   createsearcherstable(L);
   /* set paths */
@@ -781,6 +1283,8 @@ LUAMOD_API int luaopen_package (lua_State *L) {
   /* set field 'preload' */
   luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
   lua_setfield(L, -2, "preload");
+  lua_newtable(L);  /* no bundles */
+  lua_setfield(L, -2, "bundles");
   lua_pushglobaltable(L);
   lua_pushvalue(L, -2);  /* set 'package' as upvalue for next lib */
   luaL_setfuncs(L, ll_funcs, 1);  /* open lib into global table */
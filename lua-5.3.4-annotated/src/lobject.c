@@ -542,19 +542,14 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 }
 
 
-/* maximum length of the conversion of a number to a string */
-#define MAXNUMBER2STR	50
-
-
 /*
-** Convert a number object to a string
+** Convert a number object to a string, writing it in a buffer
 */
-// Used by luaO_pushvfstring() below. Also by the Lua API function
-// lua_tolstring(). Note that StkId is just a TValue*, but it's understood that
-// it's a pointer into a Lua stack (array of `TValue`s). This function replaces
-// the numeric TValue at the given stack slot with a string TValue.
-void luaO_tostring (lua_State *L, StkId obj) {
-  char buff[MAXNUMBER2STR];
+// The buffer must have room for MAXNUMBER2STR chars. Returns the length of the
+// result, which is not necessarily nul-terminated. Used by luaO_tostring()
+// below, and by luaH_concat() to join numbers without creating strings for
+// them.
+size_t luaO_tostringbuff (const TValue *obj, char *buff) {
   size_t len;
   lua_assert(ttisnumber(obj));
   // lua_integer2str() and lua_number2str() are defined in luaconf.h to use the
@@ -562,9 +557,9 @@ void luaO_tostring (lua_State *L, StkId obj) {
   // doesn't support formatting numbers as hexadecimal, so lua provides its own
   // implementation in lstrlib.c:lua_number2strx().
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = lua_integer2str(buff, MAXNUMBER2STR, ivalue(obj));
   else {
-    len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
+    len = lua_number2str(buff, MAXNUMBER2STR, fltvalue(obj));
     // Show floats that contain integer values as '123.0' instead of '123',
     // unless LUA_COMPAT_FLOATSTRING is defined. Lua used to use floats to
     // represent all numbers, and so omitting the '.0' for integers was
@@ -581,6 +576,20 @@ void luaO_tostring (lua_State *L, StkId obj) {
     }
 #endif
   }
+  return len;
+}
+
+
+/*
+** Convert a number object to a string
+*/
+// Used by luaO_pushvfstring() below. Also by the Lua API function
+// lua_tolstring(). Note that StkId is just a TValue*, but it's understood that
+// it's a pointer into a Lua stack (array of `TValue`s). This function replaces
+// the numeric TValue at the given stack slot with a string TValue.
+void luaO_tostring (lua_State *L, StkId obj) {
+  char buff[MAXNUMBER2STR];
+  size_t len = luaO_tostringbuff(obj, buff);
   // luaS_newlstr() creates a Lua string out of a given C string and length.
   // setsvalue2s() is just setsvalue(), but self-documents that it's setting a
   // value on the stack ('2s' stands for 'to stack').
@@ -593,6 +593,27 @@ typedef struct LocVar {
 // instantiated from a Proto. `Proto`s are created by the parser. There is one
 // for each lexical function expression in a piece of parsed Lua code. `Proto`s
 // contain "upvalue information", whereas Lua closures contain actual upvalues.
+/*
+** Sizes reached by tables created by an OP_NEWTABLE instruction, used
+** to presize the next tables it creates. Shared by the instruction and
+** the live tables it created, and freed with the last of them.
+*/
+typedef struct SizeHint {
+  unsigned int narray;  /* size of the array part */
+  unsigned int nhash;  /* number of entries in the hash part */
+  lu_mem nrefs;  /* number of references to it */
+} SizeHint;
+
+
+/*
+** OP_NEWTABLE instructions of a function, ordered by 'pc'
+*/
+typedef struct TableSite {
+  int pc;
+  SizeHint *hint;  /* NULL until the instruction runs */
+} TableSite;
+
+
 typedef struct Proto {
   CommonHeader;
   // Number of named parameters.
@@ -610,6 +631,7 @@ typedef struct Proto {
   int sizelineinfo;
   int sizep;  /* size of 'p' */
   int sizelocvars;
+  int sizesites;  /* size of 'sites' */
   // Line number this function was defined on.
   int linedefined;  /* debug information  */
   // Line number the function definition ends on.
@@ -624,6 +646,8 @@ typedef struct Proto {
   int *lineinfo;  /* map from opcodes to source lines (debug information) */
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
+  // Built the first time one of its OP_NEWTABLE instructions runs.
+  TableSite *sites;  /* allocation sites of tables */
   // In functional code you often have an anonymous function being instantiated
   // over and over inside a loop. This probably allows such a closure to be
   // reused somehow for better performance?
@@ -743,13 +767,22 @@ typedef struct Table {
   TValue *array;  /* array part */
   // Hash table part.
   Node *node;
+#if defined(LUAI_COMPACTHASH)
+  // In the compact layout, `node` holds `sizenodes` entries followed by the
+  // index (see ltable.c), and new keys are appended at `node[firstfree]`.
+  unsigned int sizenodes;  /* number of entries in 'node' (0 if dummy) */
+  unsigned int firstfree;  /* entries from here on were never used */
+#else
   // Tables are searched for free positions from the end, so remember where the
   // search ended last time and start searching from there next time. Right?
   // (See `ltable.c:getfreepos()`.)
   Node *lastfree;  /* any free position is before this position */
+#endif
   // Like Udata, Tables can have their own metatable. (Other types just have one
   // global metatable shared by all objects of that type.)
   struct Table *metatable;
+  // Set for tables created by OP_NEWTABLE, which tell it the sizes they reach.
+  SizeHint *hint;  /* sizes for tables from the same site (or NULL) */
   // Used for garbage collection, but how exactly?
   GCObject *gclist;
 } Table;
@@ -766,8 +799,13 @@ typedef struct Table {
 
 #define twoto(x)	(1<<(x))
 // Get the actual number of elements in a hash table by calculating the power of
-// two that is stored in `lsizenode`.
+// two that is stored in `lsizenode`. (In the compact layout, `lsizenode` gives
+// the size of the index instead.)
+#if defined(LUAI_COMPACTHASH)
+#define sizenode(t)	cast_int((t)->sizenodes)
+#else
 #define sizenode(t)	(twoto((t)->lsizenode))
+#endif
 
 
 /*
@@ -783,6 +821,9 @@ LUAI_DDEC const TValue luaO_nilobject_;
 /* size of buffer for 'luaO_utf8esc' function */
 #define UTF8BUFFSZ	8
 
+/* maximum length of the conversion of a number to a string */
+#define MAXNUMBER2STR	50
+
 // LUAI_FUNC is usually defined as `extern`, in luaconf.h.
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
@@ -792,6 +833,7 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC size_t luaO_tostringbuff (const TValue *obj, char *buff);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -221,8 +221,8 @@ OP_FORLOOP,/*	A sBx	R(A)+=R(A+2);
 			if R(A) <?= R(A+1) then { pc+=sBx; R(A+3)=R(A) }*/
 OP_FORPREP,/*	A sBx	R(A)-=R(A+2); pc+=sBx				*/
 
-OP_TFORCALL,/*	A C	R(A+3), ... ,R(A+2+C) := R(A)(R(A+1), R(A+2));	*/
-OP_TFORLOOP,/*	A sBx	if R(A+1) ~= nil then { R(A)=R(A+1); pc += sBx }*/
+OP_TFORCALL,/*	A C	R(A+4), ... ,R(A+3+C) := R(A)(R(A+1), R(A+2));	*/
+OP_TFORLOOP,/*	A sBx	if R(A+2) ~= nil then { R(A)=R(A+2); pc += sBx }*/
 
 OP_SETLIST,/*	A B C	R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B	*/
 
@@ -230,11 +230,13 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+OP_DUPTABLE/*	A Bx	R(A) := copy of table Kst(Bx)			*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_EXTRAARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_DUPTABLE) + 1)
 
 
 
@@ -254,6 +256,15 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
   (*) In OP_LOADKX, the next 'instruction' is always EXTRAARG.
 
+  (*) OP_DUPTABLE replaces the code of a constructor that only stores
+  constants; Kst(Bx) is the table that code would build, made by the
+  compiler and never visible to programs.
+
+  (*) In OP_TFORCALL, when R(A) is the library 'next' or the iterator
+  of 'ipairs' and R(A+1) is a table, the loop does the step itself,
+  with no call. For 'next', R(A+3) is a cursor that keeps the position
+  of the control variable (an integer, or nil before the first step).
+
   (*) For comparisons, A specifies what condition the test should accept
   (true or false).
 
@@ -0,0 +1,1833 @@
+/*
+** $Id: lpeglib.c $
+** Parsing Expression Grammars
+** See Copyright Notice in lua.h
+*/
+
+#define lpeglib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lstrlib.h"
+
+
+/*
+** Patterns are built by combinators into trees, stored as arrays of
+** 'TTree' nodes inside a userdata. Lua values used by a pattern (rule
+** names, capture constants, functions, and tables) live in a table,
+** the pattern's 'ktable', kept as the userdata's user value; nodes
+** refer to them by their indices ('key'). The first time a pattern is
+** used for matching, its tree is compiled into code for a small
+** backtracking machine ('run'), which records captures in a list that
+** is evaluated into Lua values only after a successful match.
+*/
+
+
+#define PATTERN		"peg.Pattern"
+
+
+/* maximum number of rules in a grammar */
+#if !defined(LUAI_MAXRULES)
+#define LUAI_MAXRULES		1000
+#endif
+
+/* maximum size of the backtrack stack */
+#if !defined(LUAI_MAXBACK)
+#define LUAI_MAXBACK		100000
+#endif
+
+/* initial sizes for the backtrack stack and the capture list */
+#define INITBACK	64
+#define INITCAPSIZE	32
+
+
+/* macro to 'unsign' a character */
+#define uchar(c)	((unsigned char)(c))
+
+typedef unsigned char byte;
+
+
+/* size of a character set, in bytes */
+#define CHARSETSIZE	((UCHAR_MAX / CHAR_BIT) + 1)
+
+#define testchar(st,c)	((st)[uchar(c) >> 3] & (1 << ((c) & 7)))
+#define setchar(st,c)	((st)[uchar(c) >> 3] |= (1 << ((c) & 7)))
+
+
+
+/*
+** {======================================================
+** Trees
+** =======================================================
+*/
+
+typedef enum TTag {
+  TChar,  /* 'n' = char */
+  TSet,  /* the set is stored in the next CHARSETSIZE bytes */
+  TAny,
+  TTrue,
+  TFalse,
+  TRep,  /* sib1* */
+  TSeq,  /* sib1 sib2 */
+  TChoice,  /* sib1 / sib2 */
+  TNot,  /* !sib1 */
+  TAnd,  /* &sib1 */
+  TCall,  /* call to rule 'sib2' (a TRule); 'key' is its name */
+  TOpenCall,  /* unresolved call; 'key' is the rule name */
+  TRule,  /* 'sib1' is the rule body, 'sib2' is the next rule;
+             'cap' is the rule index, 'key' its name */
+  TGrammar,  /* 'sib1' is the first rule; 'n' is the number of rules */
+  TCapture  /* 'cap' is the kind, 'key' its Lua value, 'sib1' the body */
+} TTag;
+
+
+/* kinds of captures */
+typedef enum CapKind {
+  Cclose,  /* not a capture; marks the end of an open capture */
+  Csimple,  /* C(p) */
+  Cposition,  /* Cp() */
+  Cconst,  /* Cc(v) */
+  Cgroup,  /* Cg(p [, name]) */
+  Ctable,  /* Ct(p) */
+  Cstring,  /* p / string */
+  Cnum,  /* p / number */
+  Cquery,  /* p / table */
+  Cfunction  /* p / function */
+} CapKind;
+
+
+typedef struct TTree {
+  byte tag;
+  byte cap;  /* kind of capture (if it is a capture) or rule index */
+  unsigned short key;  /* key in ktable for Lua value (0 if none) */
+  union {
+    int ps;  /* offset to second child */
+    int n;  /* other numeric values */
+  } u;
+} TTree;
+
+
+/* number of tree nodes needed to hold 'n' bytes */
+#define bytes2slots(n)	(((n) - 1) / sizeof(TTree) + 1)
+
+/* size of a TSet node, including its set */
+#define SETSLOTS	(1 + bytes2slots(CHARSETSIZE))
+
+#define treebuffer(t)	((byte *)((t) + 1))
+
+#define sib1(t)		((t) + 1)
+#define sib2(t)		((t) + (t)->u.ps)
+
+
+typedef union Instruction {
+  struct Inst {
+    byte code;
+    byte aux;
+    unsigned short key;
+  } i;
+  int offset;
+  byte buff[1];
+} Instruction;
+
+
+typedef struct Pattern {
+  Instruction *code;  /* compiled code (or NULL) */
+  int codesize;  /* size of 'code' */
+  int ncode;  /* number of instructions (0 if not compiled yet) */
+  TTree tree[1];
+} Pattern;
+
+
+static TTree *newgrammar (lua_State *L, int arg);
+
+
+static const char *val2str (lua_State *L, int idx) {
+  const char *k = lua_tostring(L, idx);
+  if (k != NULL)
+    return lua_pushfstring(L, "%s", k);
+  else
+    return lua_pushfstring(L, "(a %s)", luaL_typename(L, idx));
+}
+
+
+/*
+** Fix the keys of all nodes in tree 't' that refer to Lua values,
+** adding 'n' to them (used when the tree moves into a pattern whose
+** ktable has 'n' more values before its own).
+*/
+static void correctkeys (TTree *t, int n) {
+  if (n == 0) return;
+ tailcall:
+  switch (t->tag) {
+    case TOpenCall: case TCall: case TRule:
+      if (t->key > 0)
+        t->key += n;
+      break;
+    case TCapture:
+      if (t->key > 0 && t->cap != Cnum)  /* Cnum keeps a number in 'key' */
+        t->key += n;
+      break;
+    default: break;
+  }
+  switch (t->tag) {
+    case TChar: case TSet: case TAny: case TTrue: case TFalse:
+    case TOpenCall:
+      return;
+    case TCall:  /* rule will be corrected with the grammar */
+      return;
+    case TRep: case TNot: case TAnd: case TCapture: case TGrammar:
+      t = sib1(t); goto tailcall;
+    case TSeq: case TChoice:
+      correctkeys(sib1(t), n);
+      t = sib2(t); goto tailcall;
+    case TRule:  /* body and next rule */
+      correctkeys(sib1(t), n);
+      t = sib2(t);
+      if (t->tag != TRule) return;  /* end of the list of rules */
+      goto tailcall;
+    default: lua_assert(0); return;
+  }
+}
+
+
+/*
+** The ktable of a new pattern combining the patterns at 'idx1' and
+** 'idx2' (whose tree was copied to 't2') becomes the concatenation of
+** their ktables. Tables are shared when possible.
+*/
+static void joinktables (lua_State *L, int idx1, int idx2, TTree *t2) {
+  int n1, n2;
+  lua_getuservalue(L, idx1);
+  lua_getuservalue(L, idx2);
+  n1 = lua_istable(L, -2) ? (int)lua_rawlen(L, -2) : 0;
+  n2 = lua_istable(L, -1) ? (int)lua_rawlen(L, -1) : 0;
+  if (n1 + n2 > USHRT_MAX)
+    luaL_error(L, "too many Lua values in pattern");
+  if (n2 == 0 || lua_rawequal(L, -2, -1)) {  /* second is empty/same? */
+    lua_pop(L, 1);  /* use first (maybe nil) */
+    if (n1 > 0) lua_setuservalue(L, -2);
+    else lua_pop(L, 1);
+  }
+  else if (n1 == 0) {  /* only second has values? */
+    lua_setuservalue(L, -3);
+    lua_pop(L, 1);
+  }
+  else {
+    int i;
+    lua_createtable(L, n1 + n2, 0);
+    for (i = 1; i <= n1; i++) {
+      lua_rawgeti(L, -3, i);
+      lua_rawseti(L, -2, i);
+    }
+    for (i = 1; i <= n2; i++) {
+      lua_rawgeti(L, -2, i);
+      lua_rawseti(L, -2, n1 + i);
+    }
+    lua_setuservalue(L, -4);
+    lua_pop(L, 2);
+    correctkeys(t2, n1);
+  }
+}
+
+
+/*
+** Add value at the top of the stack to the ktable of the pattern at
+** 'idx' (creating it if needed) and return its key. Nil has key 0.
+*/
+static unsigned short addtoktable (lua_State *L, int idx) {
+  int n;
+  idx = lua_absindex(L, idx);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  if (lua_getuservalue(L, idx) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setuservalue(L, idx);
+  }
+  n = (int)lua_rawlen(L, -1);
+  if (n >= USHRT_MAX)
+    luaL_error(L, "too many Lua values in pattern");
+  lua_insert(L, -2);  /* put value on top */
+  lua_rawseti(L, -2, n + 1);
+  lua_pop(L, 1);  /* remove ktable */
+  return (unsigned short)(n + 1);
+}
+
+
+static Pattern *newpattern (lua_State *L, int size) {
+  size_t sz = sizeof(Pattern) + (size - 1) * sizeof(TTree);
+  Pattern *p = (Pattern *)lua_newuserdata(L, sz);
+  luaL_setmetatable(L, PATTERN);
+  p->code = NULL;
+  p->codesize = p->ncode = 0;
+  memset(p->tree, 0, size * sizeof(TTree));
+  return p;
+}
+
+
+static TTree *newtree (lua_State *L, int size) {
+  return newpattern(L, size)->tree;
+}
+
+
+/* size of a pattern's tree, in nodes */
+static int treesize (lua_State *L, int idx) {
+  size_t len = lua_rawlen(L, idx);
+  return (int)((len - sizeof(Pattern)) / sizeof(TTree)) + 1;
+}
+
+
+static TTree *newleaf (lua_State *L, int tag) {
+  TTree *t = newtree(L, 1);
+  t->tag = (byte)tag;
+  return t;
+}
+
+
+static TTree *newset (lua_State *L) {
+  TTree *t = newtree(L, SETSLOTS);
+  t->tag = TSet;
+  return t;
+}
+
+
+/* sequence of 'n' nodes of kind 'tag' (TAny or TChar) */
+static TTree *fillseq (TTree *t, int tag, int n, const char *s) {
+  int i;
+  for (i = 0; i < n - 1; i++) {  /* all but last */
+    t->tag = TSeq;
+    t->u.ps = 2;
+    sib1(t)->tag = (byte)tag;
+    sib1(t)->u.n = s ? uchar(s[i]) : 0;
+    t = sib2(t);
+  }
+  t->tag = (byte)tag;
+  t->u.n = s ? uchar(s[i]) : 0;
+  return t;
+}
+
+
+/*
+** Convert value at index 'idx' to a pattern (in place) and return its
+** tree.
+*/
+static TTree *getpatt (lua_State *L, int idx, int *len) {
+  TTree *t;
+  idx = lua_absindex(L, idx);
+  switch (lua_type(L, idx)) {
+    case LUA_TSTRING: {
+      size_t slen;
+      const char *s = lua_tolstring(L, idx, &slen);
+      if (slen == 0)
+        t = newleaf(L, TTrue);
+      else {
+        if (slen > INT_MAX / 2)
+          luaL_argerror(L, idx, "string too long");
+        t = newtree(L, 2 * ((int)slen - 1) + 1);
+        fillseq(t, TChar, (int)slen, s);
+      }
+      break;
+    }
+    case LUA_TNUMBER: {
+      lua_Integer n = luaL_checkinteger(L, idx);
+      if (n == 0)
+        t = newleaf(L, TTrue);
+      else {
+        lua_Integer an = (n > 0) ? n : -n;
+        luaL_argcheck(L, an <= INT_MAX / 2, idx, "number too large");
+        if (n > 0) {
+          t = newtree(L, 2 * ((int)an - 1) + 1);
+          fillseq(t, TAny, (int)an, NULL);
+        }
+        else {  /* -n == !n */
+          t = newtree(L, 2 * ((int)an - 1) + 2);
+          t->tag = TNot;
+          fillseq(sib1(t), TAny, (int)an, NULL);
+        }
+      }
+      break;
+    }
+    case LUA_TBOOLEAN: {
+      t = newleaf(L, lua_toboolean(L, idx) ? TTrue : TFalse);
+      break;
+    }
+    case LUA_TTABLE: {
+      t = newgrammar(L, idx);
+      break;
+    }
+    default: {
+      Pattern *p = (Pattern *)luaL_testudata(L, idx, PATTERN);
+      if (p == NULL)
+        luaL_argerror(L, idx, lua_pushfstring(L,
+            "pattern expected, got %s", luaL_typename(L, idx)));
+      if (len) *len = treesize(L, idx);
+      return p->tree;
+    }
+  }
+  lua_replace(L, idx);  /* put new pattern in place of old value */
+  if (len) *len = treesize(L, idx);
+  return t;
+}
+
+
+/* copy tree 'src' (at 'idx') into 't', returning the end of the copy */
+static TTree *copytree (lua_State *L, TTree *t, int idx) {
+  int len;
+  TTree *src = getpatt(L, idx, &len);
+  memcpy(t, src, len * sizeof(TTree));
+  return t + len;
+}
+
+
+/* new tree with tag 'tag' and one child (the pattern at index 1) */
+static TTree *newroot1sib (lua_State *L, int tag) {
+  int s1;
+  TTree *t1 = getpatt(L, 1, &s1);
+  TTree *t = newtree(L, 1 + s1);
+  t->tag = (byte)tag;
+  memcpy(sib1(t), t1, s1 * sizeof(TTree));
+  lua_getuservalue(L, 1);
+  lua_setuservalue(L, -2);
+  return t;
+}
+
+
+/* new tree with tag 'tag' and the patterns at 'idx1' and 'idx2' */
+static TTree *newroot2sib (lua_State *L, int tag, int idx1, int idx2) {
+  int s1, s2;
+  TTree *t1 = getpatt(L, idx1, &s1);
+  TTree *t2 = getpatt(L, idx2, &s2);
+  TTree *t = newtree(L, 1 + s1 + s2);
+  t->tag = (byte)tag;
+  t->u.ps = 1 + s1;
+  memcpy(sib1(t), t1, s1 * sizeof(TTree));
+  memcpy(sib2(t), t2, s2 * sizeof(TTree));
+  joinktables(L, idx1, idx2, sib2(t));
+  return t;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Tree properties
+** =======================================================
+*/
+
+/* check whether a tree has unresolved calls */
+static int hasopencalls (TTree *t) {
+ tailcall:
+  switch (t->tag) {
+    case TOpenCall: return 1;
+    case TChar: case TSet: case TAny: case TTrue: case TFalse:
+    case TCall:  /* calls inside grammars are already resolved */
+    case TGrammar:
+      return 0;
+    case TRep: case TNot: case TAnd: case TCapture:
+      t = sib1(t); goto tailcall;
+    case TSeq: case TChoice:
+      if (hasopencalls(sib1(t))) return 1;
+      t = sib2(t); goto tailcall;
+    default: lua_assert(0); return 0;
+  }
+}
+
+
+/*
+** Check whether a pattern can match the empty string. Open calls are
+** assumed to consume input (their loops are checked again when the
+** grammar is built). Grammars without left recursion ensure that
+** this recursion ends.
+*/
+static int nullable (TTree *t) {
+ tailcall:
+  switch (t->tag) {
+    case TChar: case TSet: case TAny: case TFalse: case TOpenCall:
+      return 0;
+    case TTrue: case TRep: case TNot: case TAnd:
+      return 1;
+    case TCapture: case TRule:
+      t = sib1(t); goto tailcall;
+    case TGrammar:  /* first rule */
+      t = sib1(sib1(t)); goto tailcall;
+    case TCall:  /* body of called rule */
+      t = sib1(sib2(t)); goto tailcall;
+    case TSeq:
+      if (!nullable(sib1(t))) return 0;
+      t = sib2(t); goto tailcall;
+    case TChoice:
+      if (nullable(sib1(t))) return 1;
+      t = sib2(t); goto tailcall;
+    default: lua_assert(0); return 0;
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Grammars
+** =======================================================
+*/
+
+/* name of the rule 'rule', from the ktable at the top of the stack */
+static const char *rulename (lua_State *L, TTree *rule) {
+  lua_rawgeti(L, -1, rule->key);
+  return val2str(L, -1);
+}
+
+
+/*
+** Collect the rules of the grammar table at 'arg', pushing for each
+** rule its name and its pattern (the initial rule comes first).
+** Returns the number of rules and stores in '*size' the size of the
+** grammar tree.
+*/
+static int collectrules (lua_State *L, int arg, int *size) {
+  int n = 1;  /* number of rules */
+  int frule = lua_gettop(L) + 1;  /* name of the initial rule */
+  int total = 1 + 1;  /* TGrammar node plus final TTrue */
+  int len;
+  if (lua_rawgeti(L, arg, 1) != LUA_TSTRING)
+    luaL_error(L, "grammar must have the name of its initial rule at [1]");
+  lua_pushvalue(L, -1);
+  if (lua_rawget(L, arg) == LUA_TNIL)
+    luaL_error(L, "initial rule '%s' is not defined in grammar",
+                  lua_tostring(L, frule));
+  getpatt(L, -1, &len);
+  total += len + 1;
+  lua_pushnil(L);
+  while (lua_next(L, arg) != 0) {
+    if ((lua_isinteger(L, -2) && lua_tointeger(L, -2) == 1) ||
+        lua_rawequal(L, -2, frule)) {  /* [1] or initial rule? */
+      lua_pop(L, 1);  /* already collected */
+      continue;
+    }
+    if (lua_type(L, -2) != LUA_TSTRING)
+      luaL_error(L, "invalid rule name %s in grammar", val2str(L, -2));
+    if (n >= LUAI_MAXRULES)
+      luaL_error(L, "grammar has too many rules");
+    luaL_checkstack(L, 4, "grammar has too many rules");
+    lua_pushvalue(L, -2);  /* key for next iteration */
+    getpatt(L, -2, &len);  /* stack: ... name pattern name */
+    total += len + 1;
+    n++;
+  }
+  *size = total;
+  return n;
+}
+
+
+/*
+** Build the tree of the grammar: a TGrammar node, the rules, and a
+** TTrue sentinel. The ktable of the new grammar receives the values
+** of all rules plus the rule names.
+*/
+static void buildgrammar (lua_State *L, TTree *g, int frule, int n) {
+  int i;
+  TTree *nd = sib1(g);
+  int gidx = frule + 2 * n;  /* position of the new grammar */
+  for (i = 0; i < n; i++) {
+    int ridx = frule + 2 * i + 1;  /* rule pattern */
+    int len;
+    TTree *rt;
+    getpatt(L, ridx, &len);
+    nd->tag = TRule;
+    nd->cap = (byte)(i & 0xff);  /* rule index (low bits) */
+    nd->u.n = 0;
+    rt = sib1(nd);
+    copytree(L, rt, ridx);
+    /* join ktables and add rule name */
+    lua_getuservalue(L, ridx);
+    if (lua_istable(L, -1)) {
+      int k, nk = (int)lua_rawlen(L, -1);
+      int base;
+      if (lua_getuservalue(L, gidx) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setuservalue(L, gidx);
+      }
+      base = (int)lua_rawlen(L, -1);
+      if (base + nk >= USHRT_MAX)
+        luaL_error(L, "too many Lua values in pattern");
+      for (k = 1; k <= nk; k++) {
+        lua_rawgeti(L, -2, k);
+        lua_rawseti(L, -2, base + k);
+      }
+      lua_pop(L, 1);
+      correctkeys(rt, base);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, ridx - 1);  /* rule name */
+    nd->key = addtoktable(L, gidx);
+    nd->u.ps = 1 + len;
+    nd = sib2(nd);
+  }
+  nd->tag = TTrue;  /* sentinel */
+}
+
+
+/* find rule named 'key' (in grammar's ktable at the top) */
+static TTree *findrule (lua_State *L, TTree *g, int key) {
+  TTree *rule;
+  for (rule = sib1(g); rule->tag == TRule; rule = sib2(rule)) {
+    lua_rawgeti(L, -1, rule->key);
+    lua_rawgeti(L, -2, key);
+    if (lua_rawequal(L, -1, -2)) {
+      lua_pop(L, 2);
+      return rule;
+    }
+    lua_pop(L, 2);
+  }
+  return NULL;
+}
+
+
+/* resolve open calls in 't' to calls to rules of grammar 'g' */
+static void fixcalls (lua_State *L, TTree *g, TTree *t) {
+ tailcall:
+  switch (t->tag) {
+    case TOpenCall: {
+      TTree *rule = findrule(L, g, t->key);
+      if (rule == NULL) {
+        lua_rawgeti(L, -1, t->key);
+        luaL_error(L, "rule '%s' undefined in given grammar", val2str(L, -1));
+      }
+      t->tag = TCall;
+      t->u.ps = (int)(rule - t);  /* 'sib2' is the rule */
+      return;
+    }
+    case TChar: case TSet: case TAny: case TTrue: case TFalse:
+    case TCall: case TGrammar:
+      return;
+    case TRep: case TNot: case TAnd: case TCapture:
+      t = sib1(t); goto tailcall;
+    case TSeq: case TChoice:
+      fixcalls(L, g, sib1(t));
+      t = sib2(t); goto tailcall;
+    default: lua_assert(0); return;
+  }
+}
+
+
+/*
+** Check whether a rule can call itself without consuming any input
+** (left recursion). 'passed' holds the rules already visited at the
+** current position. Returns whether the tree is nullable ('nb' is
+** the result if the tree cannot end with a call).
+*/
+static int verifyrule (lua_State *L, TTree *t, TTree **passed,
+                       int npassed, int nb) {
+ tailcall:
+  switch (t->tag) {
+    case TChar: case TSet: case TAny: case TFalse:
+      return nb;
+    case TTrue:
+      return 1;
+    case TNot: case TAnd: case TRep:
+      t = sib1(t); nb = 1; goto tailcall;
+    case TCapture:
+      t = sib1(t); goto tailcall;
+    case TSeq:
+      if (!verifyrule(L, sib1(t), passed, npassed, 0))
+        return nb;
+      t = sib2(t); goto tailcall;
+    case TChoice:
+      nb = verifyrule(L, sib1(t), passed, npassed, nb);
+      t = sib2(t); goto tailcall;
+    case TCall: {
+      TTree *rule = sib2(t);
+      int i;
+      for (i = 0; i < npassed; i++) {
+        if (passed[i] == rule)
+          luaL_error(L, "rule '%s' may be left recursive", rulename(L, rule));
+      }
+      if (npassed >= LUAI_MAXRULES)
+        luaL_error(L, "too many left calls in grammar");
+      passed[npassed++] = rule;
+      t = sib1(rule); goto tailcall;
+    }
+    case TGrammar:
+      return nullable(t);
+    default: lua_assert(0); return 0;
+  }
+}
+
+
+/* check that no loop in 't' has a body that can match the empty string */
+static void checkloops (lua_State *L, TTree *t, TTree *rule) {
+ tailcall:
+  switch (t->tag) {
+    case TRep:
+      if (nullable(sib1(t)))
+        luaL_error(L, "empty loop in rule '%s'", rulename(L, rule));
+      t = sib1(t); goto tailcall;
+    case TChar: case TSet: case TAny: case TTrue: case TFalse:
+    case TCall: case TGrammar:
+      return;
+    case TNot: case TAnd: case TCapture:
+      t = sib1(t); goto tailcall;
+    case TSeq: case TChoice:
+      checkloops(L, sib1(t), rule);
+      t = sib2(t); goto tailcall;
+    default: lua_assert(0); return;
+  }
+}
+
+
+static TTree *newgrammar (lua_State *L, int arg) {
+  int size, n;
+  int frule = lua_gettop(L) + 1;  /* first rule name */
+  TTree *g, *rule;
+  TTree *passed[LUAI_MAXRULES];
+  arg = lua_absindex(L, arg);
+  n = collectrules(L, arg, &size);
+  g = newtree(L, size);
+  g->tag = TGrammar;
+  g->u.n = n;
+  buildgrammar(L, g, frule, n);
+  lua_getuservalue(L, -1);  /* ktable */
+  for (rule = sib1(g); rule->tag == TRule; rule = sib2(rule))
+    fixcalls(L, g, sib1(rule));
+  for (rule = sib1(g); rule->tag == TRule; rule = sib2(rule)) {
+    passed[0] = rule;
+    verifyrule(L, sib1(rule), passed, 1, 0);
+  }
+  for (rule = sib1(g); rule->tag == TRule; rule = sib2(rule))
+    checkloops(L, sib1(rule), rule);
+  lua_pop(L, 1);  /* ktable */
+  lua_replace(L, frule);  /* move grammar to its final place */
+  lua_settop(L, frule);
+  return g;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Constructors
+** =======================================================
+*/
+
+static int lp_P (lua_State *L) {
+  luaL_checkany(L, 1);
+  getpatt(L, 1, NULL);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* S(set): any character in the string 'set' */
+static int lp_S (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  TTree *t = newset(L);
+  while (l--) {
+    setchar(treebuffer(t), uchar(*s));
+    s++;
+  }
+  return 1;
+}
+
+
+/* R(range...): any character in the given ranges ("az", "09", ...) */
+static int lp_R (lua_State *L) {
+  int arg;
+  int top = lua_gettop(L);
+  TTree *t = newset(L);
+  for (arg = 1; arg <= top; arg++) {
+    size_t l;
+    const char *r = luaL_checklstring(L, arg, &l);
+    int c;
+    luaL_argcheck(L, l == 2, arg, "range must have two characters");
+    for (c = uchar(r[0]); c <= uchar(r[1]); c++)
+      setchar(treebuffer(t), c);
+  }
+  return 1;
+}
+
+
+/*
+** class(cl): a set with the characters in a class of the string
+** library, either a single class ('%a', '%S', ...) or a set ('[%w_]').
+** The set is computed with the current locale.
+*/
+static int lp_class (lua_State *L) {
+  size_t l;
+  const char *p = luaL_checklstring(L, 1, &l);
+  TTree *t;
+  int c;
+  int single = (l == 2 && p[0] == L_ESC);
+  luaL_argcheck(L, single || (l >= 3 && p[0] == '[' && p[l - 1] == ']'),
+                   1, "invalid character class");
+  t = newset(L);
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (single ? luaI_matchclass(c, uchar(p[1]))
+               : luaI_matchbracketclass(c, p, p + l - 1))
+      setchar(treebuffer(t), c);
+  }
+  return 1;
+}
+
+
+/* V(name): non-terminal, a call to rule 'name' of the enclosing grammar */
+static int lp_V (lua_State *L) {
+  TTree *t = newleaf(L, TOpenCall);
+  luaL_argcheck(L, !lua_isnoneornil(L, 1), 1, "non-nil value expected");
+  lua_pushvalue(L, 1);
+  t->key = addtoktable(L, -2);
+  return 1;
+}
+
+
+static int capture_aux (lua_State *L, int cap, int labelidx) {
+  TTree *t = newroot1sib(L, TCapture);
+  t->cap = (byte)cap;
+  if (labelidx > 0) {
+    lua_pushvalue(L, labelidx);
+    t->key = addtoktable(L, -2);
+  }
+  return 1;
+}
+
+
+static int lp_C (lua_State *L) {
+  return capture_aux(L, Csimple, 0);
+}
+
+
+static int lp_Ct (lua_State *L) {
+  return capture_aux(L, Ctable, 0);
+}
+
+
+/* Cg(p [, name]): group capture; named groups only go into tables */
+static int lp_Cg (lua_State *L) {
+  if (lua_isnoneornil(L, 2))
+    return capture_aux(L, Cgroup, 0);
+  else
+    return capture_aux(L, Cgroup, 2);
+}
+
+
+/* capture with an empty body */
+static TTree *newemptycap (lua_State *L, int cap) {
+  TTree *t = newtree(L, 2);
+  t->tag = TCapture;
+  t->cap = (byte)cap;
+  sib1(t)->tag = TTrue;
+  return t;
+}
+
+
+static int lp_Cp (lua_State *L) {
+  newemptycap(L, Cposition);
+  return 1;
+}
+
+
+/* Cc(...): captures its arguments as constants */
+static int lp_Cc (lua_State *L) {
+  int n = lua_gettop(L);
+  int i;
+  if (n == 0)
+    newleaf(L, TTrue);
+  else {
+    TTree *t = newtree(L, 3 * n - 1);  /* n captures and n - 1 TSeq */
+    for (i = 1; i <= n; i++) {
+      if (i < n) {
+        t->tag = TSeq;
+        t->u.ps = 3;
+        t = sib1(t);
+      }
+      t->tag = TCapture;
+      t->cap = Cconst;
+      sib1(t)->tag = TTrue;
+      lua_pushvalue(L, i);
+      t->key = addtoktable(L, n + 1);
+      t += 2;
+    }
+  }
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Operators
+** =======================================================
+*/
+
+static int lp_seq (lua_State *L) {
+  newroot2sib(L, TSeq, 1, 2);
+  return 1;
+}
+
+
+static int lp_choice (lua_State *L) {
+  newroot2sib(L, TChoice, 1, 2);
+  return 1;
+}
+
+
+/* p1 - p2 == !p2 p1 */
+static int lp_sub (lua_State *L) {
+  int s1, s2;
+  TTree *t1 = getpatt(L, 1, &s1);
+  TTree *t2 = getpatt(L, 2, &s2);
+  TTree *t = newtree(L, 2 + s1 + s2);
+  t->tag = TSeq;
+  t->u.ps = 2 + s2;
+  sib1(t)->tag = TNot;
+  memcpy(sib1(sib1(t)), t2, s2 * sizeof(TTree));
+  memcpy(sib2(t), t1, s1 * sizeof(TTree));
+  joinktables(L, 2, 1, sib2(t));
+  return 1;
+}
+
+
+static int lp_not (lua_State *L) {
+  newroot1sib(L, TNot);
+  return 1;
+}
+
+
+static int lp_and (lua_State *L) {
+  newroot1sib(L, TAnd);
+  return 1;
+}
+
+
+/*
+** p^n: at least 'n' repetitions of p (if n >= 0) or at most '-n'
+** repetitions (if n < 0).
+*/
+static int lp_star (lua_State *L) {
+  int size1;
+  lua_Integer n = luaL_checkinteger(L, 2);
+  TTree *t1 = getpatt(L, 1, &size1);
+  TTree *t;
+  if (n >= 0) {  /* seq tree1 (seq tree1 ... (seq tree1 (rep tree1))) */
+    if (!hasopencalls(t1) && nullable(t1))
+      luaL_error(L, "loop body may accept empty string");
+    luaL_argcheck(L, n < INT_MAX / (size1 + 2), 2, "repetition too large");
+    t = newtree(L, ((int)n + 1) * (size1 + 1));
+    while (n--) {
+      t->tag = TSeq;
+      t->u.ps = size1 + 1;
+      memcpy(sib1(t), t1, size1 * sizeof(TTree));
+      t = sib2(t);
+    }
+    t->tag = TRep;
+    memcpy(sib1(t), t1, size1 * sizeof(TTree));
+  }
+  else {  /* choice (seq tree1 ... choice tree1 true ...) true */
+    lua_Integer an = -n;
+    luaL_argcheck(L, an < INT_MAX / (size1 + 3), 2, "repetition too large");
+    t = newtree(L, (int)an * (size1 + 3) - 1);
+    while (an-- > 1) {
+      t->tag = TChoice;
+      t->u.ps = (int)(an * (size1 + 3) + size1 + 1);  /* to its TTrue */
+      sib1(t)->tag = TSeq;
+      sib1(t)->u.ps = size1 + 1;
+      memcpy(sib1(sib1(t)), t1, size1 * sizeof(TTree));
+      sib2(t)->tag = TTrue;
+      t = sib2(sib1(t));
+    }
+    t->tag = TChoice;
+    t->u.ps = size1 + 1;
+    memcpy(sib1(t), t1, size1 * sizeof(TTree));
+    sib2(t)->tag = TTrue;
+  }
+  lua_getuservalue(L, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+/* p / v: function, table, string, or number capture */
+static int lp_divcapture (lua_State *L) {
+  switch (lua_type(L, 2)) {
+    case LUA_TFUNCTION: return capture_aux(L, Cfunction, 2);
+    case LUA_TTABLE: return capture_aux(L, Cquery, 2);
+    case LUA_TSTRING: return capture_aux(L, Cstring, 2);
+    case LUA_TNUMBER: {
+      lua_Integer n = luaL_checkinteger(L, 2);
+      TTree *t = newroot1sib(L, TCapture);
+      luaL_argcheck(L, 0 <= n && n <= USHRT_MAX, 2, "invalid number");
+      t->cap = Cnum;
+      t->key = (unsigned short)n;
+      return 1;
+    }
+    default: return luaL_argerror(L, 2, "invalid replacement value");
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Code generation
+** =======================================================
+*/
+
+typedef enum Opcode {
+  IAny,  /* if no char, fail */
+  IChar,  /* if char != aux, fail */
+  ISet,  /* if char not in buff, fail */
+  ISpan,  /* read a span of chars in buff */
+  IRet,  /* return from a rule */
+  IEnd,  /* end of pattern */
+  IChoice,  /* stack a choice; next fail will jump to 'offset' */
+  IJmp,  /* jump to 'offset' */
+  ICall,  /* call rule at 'offset' */
+  IOpenCall,  /* call rule number 'offset' (must be corrected) */
+  ICommit,  /* pop choice and jump to 'offset' */
+  IPartialCommit,  /* update top choice to current position and jump */
+  IBackCommit,  /* "fails" but jump to its own 'offset' */
+  IFailTwice,  /* pop one choice and then fail */
+  IFail,  /* go back to saved state on choice and jump to saved offset */
+  IGiveup,  /* internal use */
+  IOpenCapture,  /* start a capture */
+  ICloseCapture  /* end a capture */
+} Opcode;
+
+
+/* number of instructions needed to hold 'n' bytes */
+#define bytes2inst(n)	(((n) - 1) / sizeof(Instruction) + 1)
+
+/* size of an instruction with a character set */
+#define CHARSETINSTSIZE		(1 + (int)bytes2inst(CHARSETSIZE))
+
+
+typedef struct CompileState {
+  lua_State *L;
+  Pattern *p;  /* pattern being compiled */
+  int ncode;  /* next position in 'p->code' to be filled */
+  TTree **rules;  /* rules of the innermost grammar being compiled */
+  int nrules;
+} CompileState;
+
+
+#define getinstr(cs,i)		((cs)->p->code[i])
+
+
+static void realloccode (lua_State *L, Pattern *p, int nsize) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  void *newblock = f(ud, p->code, p->codesize * sizeof(Instruction),
+                                  nsize * sizeof(Instruction));
+  if (newblock == NULL && nsize > 0)
+    luaL_error(L, "not enough memory");
+  p->code = (Instruction *)newblock;
+  p->codesize = nsize;
+}
+
+
+static int nextinstruction (CompileState *cs) {
+  int size = cs->p->codesize;
+  if (cs->ncode >= size) {
+    if (size >= INT_MAX / 2)
+      luaL_error(cs->L, "pattern too large");
+    realloccode(cs->L, cs->p, (size == 0) ? 32 : size * 2);
+  }
+  return cs->ncode++;
+}
+
+
+static int addinstruction (CompileState *cs, Opcode op, int aux) {
+  int i = nextinstruction(cs);
+  getinstr(cs, i).i.code = (byte)op;
+  getinstr(cs, i).i.aux = (byte)aux;
+  getinstr(cs, i).i.key = 0;
+  return i;
+}
+
+
+/* add an instruction followed by space for an offset */
+static int addoffsetinst (CompileState *cs, Opcode op) {
+  int i = addinstruction(cs, op, 0);
+  addinstruction(cs, (Opcode)0, 0);  /* open space for offset */
+  return i;
+}
+
+
+static void addcharset (CompileState *cs, Opcode op, const byte *set) {
+  int i = addinstruction(cs, op, 0);
+  int j;
+  for (j = 1; j < CHARSETINSTSIZE; j++)
+    nextinstruction(cs);
+  memcpy(getinstr(cs, i + 1).buff, set, CHARSETSIZE);
+}
+
+
+static void jumptothere (CompileState *cs, int instruction, int target) {
+  getinstr(cs, instruction + 1).offset = target - instruction;
+}
+
+
+static void jumptohere (CompileState *cs, int instruction) {
+  jumptothere(cs, instruction, cs->ncode);
+}
+
+
+/* size of an instruction */
+static int sizei (const Instruction *i) {
+  switch ((Opcode)i->i.code) {
+    case ISet: case ISpan:
+      return CHARSETINSTSIZE;
+    case IChoice: case IJmp: case ICall: case IOpenCall: case ICommit:
+    case IPartialCommit: case IBackCommit:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+
+static void codegen (CompileState *cs, TTree *tree);
+
+
+/* p1 / p2 ==> choice L1; p1; commit L2; L1: p2; L2: */
+static void codechoice (CompileState *cs, TTree *p1, TTree *p2) {
+  int pchoice = addoffsetinst(cs, IChoice);
+  int pcommit;
+  codegen(cs, p1);
+  pcommit = addoffsetinst(cs, ICommit);
+  jumptohere(cs, pchoice);
+  codegen(cs, p2);
+  jumptohere(cs, pcommit);
+}
+
+
+/*
+** p* ==> span set (if p is a set), or
+** choice L2; L1: p; partialcommit L1; L2:
+*/
+static void coderep (CompileState *cs, TTree *tree) {
+  if (tree->tag == TSet)
+    addcharset(cs, ISpan, treebuffer(tree));
+  else {
+    int pchoice = addoffsetinst(cs, IChoice);
+    int l1 = cs->ncode;
+    int pcommit;
+    codegen(cs, tree);
+    pcommit = addoffsetinst(cs, IPartialCommit);
+    jumptothere(cs, pcommit, l1);
+    jumptohere(cs, pchoice);
+  }
+}
+
+
+/* !p ==> choice L1; p; failtwice; L1: */
+static void codenot (CompileState *cs, TTree *tree) {
+  int pchoice = addoffsetinst(cs, IChoice);
+  codegen(cs, tree);
+  addinstruction(cs, IFailTwice, 0);
+  jumptohere(cs, pchoice);
+}
+
+
+/* &p ==> choice L1; p; backcommit L2; L1: fail; L2: */
+static void codeand (CompileState *cs, TTree *tree) {
+  int pchoice = addoffsetinst(cs, IChoice);
+  int pcommit;
+  codegen(cs, tree);
+  pcommit = addoffsetinst(cs, IBackCommit);
+  jumptohere(cs, pchoice);
+  addinstruction(cs, IFail, 0);
+  jumptohere(cs, pcommit);
+}
+
+
+static void codecapture (CompileState *cs, TTree *tree) {
+  int i = addinstruction(cs, IOpenCapture, tree->cap);
+  getinstr(cs, i).i.key = tree->key;
+  codegen(cs, sib1(tree));
+  addinstruction(cs, ICloseCapture, 0);
+}
+
+
+/* calls are emitted with the rule index and fixed by 'codegrammar' */
+static void codecall (CompileState *cs, TTree *call) {
+  TTree *rule = sib2(call);
+  int i, n;
+  for (n = 0; n < cs->nrules && cs->rules[n] != rule; n++) ;
+  lua_assert(n < cs->nrules);
+  i = addoffsetinst(cs, IOpenCall);
+  getinstr(cs, i + 1).offset = n;
+}
+
+
+/*
+** call R1; jmp L; R1: rule1; ret; R2: rule2; ret; ...; L:
+** Open calls in the code of the rules are then corrected to calls to
+** the positions of their rules.
+*/
+static void codegrammar (CompileState *cs, TTree *grammar) {
+  TTree *rules[LUAI_MAXRULES];
+  int positions[LUAI_MAXRULES];
+  TTree **oldrules = cs->rules;
+  int oldnrules = cs->nrules;
+  int n = 0;
+  int firstcall = addoffsetinst(cs, ICall);  /* call initial rule */
+  int jumptoend = addoffsetinst(cs, IJmp);  /* jump to the end */
+  int start = cs->ncode;
+  int i;
+  TTree *rule;
+  for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule))
+    rules[n++] = rule;
+  cs->rules = rules;
+  cs->nrules = n;
+  jumptohere(cs, firstcall);
+  for (i = 0; i < n; i++) {
+    positions[i] = cs->ncode;
+    codegen(cs, sib1(rules[i]));
+    addinstruction(cs, IRet, 0);
+  }
+  jumptohere(cs, jumptoend);
+  for (i = start; i < cs->ncode; i += sizei(&getinstr(cs, i))) {
+    if (getinstr(cs, i).i.code == IOpenCall) {
+      getinstr(cs, i).i.code = ICall;
+      jumptothere(cs, i, positions[getinstr(cs, i + 1).offset]);
+    }
+  }
+  cs->rules = oldrules;
+  cs->nrules = oldnrules;
+}
+
+
+static void codegen (CompileState *cs, TTree *tree) {
+ tailcall:
+  switch (tree->tag) {
+    case TChar: addinstruction(cs, IChar, tree->u.n); break;
+    case TAny: addinstruction(cs, IAny, 0); break;
+    case TSet: addcharset(cs, ISet, treebuffer(tree)); break;
+    case TTrue: break;
+    case TFalse: addinstruction(cs, IFail, 0); break;
+    case TChoice: codechoice(cs, sib1(tree), sib2(tree)); break;
+    case TRep: coderep(cs, sib1(tree)); break;
+    case TNot: codenot(cs, sib1(tree)); break;
+    case TAnd: codeand(cs, sib1(tree)); break;
+    case TCapture: codecapture(cs, tree); break;
+    case TGrammar: codegrammar(cs, tree); break;
+    case TCall: codecall(cs, tree); break;
+    case TSeq: {
+      codegen(cs, sib1(tree));
+      tree = sib2(tree); goto tailcall;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+/* name of the first open call in 't' (to report errors) */
+static int firstopencall (TTree *t) {
+ tailcall:
+  switch (t->tag) {
+    case TOpenCall: return t->key;
+    case TRep: case TNot: case TAnd: case TCapture:
+      t = sib1(t); goto tailcall;
+    case TSeq: case TChoice: {
+      int k = firstopencall(sib1(t));
+      if (k != 0) return k;
+      t = sib2(t); goto tailcall;
+    }
+    default: return 0;
+  }
+}
+
+
+/* compile the pattern at index 'idx' */
+static void compile (lua_State *L, Pattern *p, int idx) {
+  CompileState cs;
+  if (hasopencalls(p->tree)) {
+    lua_getuservalue(L, idx);
+    lua_rawgeti(L, -1, firstopencall(p->tree));
+    luaL_error(L, "rule '%s' used outside a grammar", val2str(L, -1));
+  }
+  cs.L = L;
+  cs.p = p;
+  cs.ncode = 0;
+  cs.rules = NULL;
+  cs.nrules = 0;
+  codegen(&cs, p->tree);
+  addinstruction(&cs, IEnd, 0);
+  realloccode(L, p, cs.ncode);  /* set final size */
+  p->ncode = cs.ncode;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Matching machine
+** =======================================================
+*/
+
+typedef struct Stack {
+  const char *s;  /* saved position (or NULL for calls) */
+  const Instruction *p;  /* next instruction */
+  int caplevel;
+} Stack;
+
+
+typedef struct Capture {
+  const char *s;  /* subject position */
+  unsigned short idx;  /* extra info (ktable index) */
+  byte kind;  /* kind of capture */
+} Capture;
+
+
+typedef struct MatchState {
+  lua_State *L;
+  Capture *capture;  /* capture list */
+  int capsize;  /* size of 'capture' */
+  int ncap;  /* number of entries in 'capture' */
+  int ptop;  /* index of last argument to 'match' */
+} MatchState;
+
+
+/* stack slots (above 'ptop') that keep the grown lists */
+#define stackidx(ptop)		((ptop) + 1)
+#define capidx(ptop)		((ptop) + 2)
+#define ktableidx(ptop)		((ptop) + 3)
+
+
+/* called when the stack is full; returns the new top */
+static Stack *doublestack (MatchState *ms, Stack **stackbase,
+                           Stack **stacklimit) {
+  lua_State *L = ms->L;
+  int n = (int)(*stacklimit - *stackbase);
+  Stack *newstack;
+  if (n >= LUAI_MAXBACK)
+    luaL_error(L, "backtrack stack overflow (current limit is %d)",
+                  LUAI_MAXBACK);
+  newstack = (Stack *)lua_newuserdata(L, 2 * n * sizeof(Stack));
+  memcpy(newstack, *stackbase, n * sizeof(Stack));
+  lua_replace(L, stackidx(ms->ptop));
+  *stackbase = newstack;
+  *stacklimit = newstack + 2 * n;
+  return newstack + n;
+}
+
+
+static void growcap (MatchState *ms) {
+  lua_State *L = ms->L;
+  Capture *newc;
+  if (ms->capsize >= INT_MAX / 2)
+    luaL_error(L, "too many captures");
+  newc = (Capture *)lua_newuserdata(L, 2 * ms->capsize * sizeof(Capture));
+  memcpy(newc, ms->capture, ms->ncap * sizeof(Capture));
+  lua_replace(L, capidx(ms->ptop));
+  ms->capture = newc;
+  ms->capsize *= 2;
+}
+
+
+/*
+** Run the machine over subject [o, e), starting at 's'. Returns the end
+** of the match, or NULL if it fails.
+*/
+static const char *run (MatchState *ms, const char *s, const char *e,
+                        const Instruction *op) {
+  static const Instruction giveup = {{IGiveup, 0, 0}};
+  Stack stackinit[INITBACK];
+  Stack *stackbase = stackinit;
+  Stack *stacklimit = stackinit + INITBACK;
+  Stack *stack = stackinit;
+  int captop = 0;
+  const Instruction *p = op;
+  stack->s = s;
+  stack->p = &giveup;
+  stack->caplevel = 0;
+  stack++;
+  for (;;) {
+    switch ((Opcode)p->i.code) {
+      case IEnd: {
+        ms->ncap = captop;
+        return s;
+      }
+      case IGiveup: {
+        return NULL;
+      }
+      case IRet: {
+        p = (--stack)->p;
+        continue;
+      }
+      case IAny: {
+        if (s < e) { p++; s++; }
+        else goto fail;
+        continue;
+      }
+      case IChar: {
+        if (s < e && uchar(*s) == p->i.aux) { p++; s++; }
+        else goto fail;
+        continue;
+      }
+      case ISet: {
+        if (s < e && testchar((p + 1)->buff, uchar(*s)))
+          { p += CHARSETINSTSIZE; s++; }
+        else goto fail;
+        continue;
+      }
+      case ISpan: {
+        while (s < e && testchar((p + 1)->buff, uchar(*s)))
+          s++;
+        p += CHARSETINSTSIZE;
+        continue;
+      }
+      case IJmp: {
+        p += (p + 1)->offset;
+        continue;
+      }
+      case IChoice: {
+        if (stack == stacklimit)
+          stack = doublestack(ms, &stackbase, &stacklimit);
+        stack->p = p + (p + 1)->offset;
+        stack->s = s;
+        stack->caplevel = captop;
+        stack++;
+        p += 2;
+        continue;
+      }
+      case ICall: {
+        if (stack == stacklimit)
+          stack = doublestack(ms, &stackbase, &stacklimit);
+        stack->s = NULL;
+        stack->p = p + 2;  /* save return address */
+        stack++;
+        p += (p + 1)->offset;
+        continue;
+      }
+      case ICommit: {
+        stack--;
+        p += (p + 1)->offset;
+        continue;
+      }
+      case IPartialCommit: {
+        (stack - 1)->s = s;
+        (stack - 1)->caplevel = captop;
+        p += (p + 1)->offset;
+        continue;
+      }
+      case IBackCommit: {
+        s = (--stack)->s;
+        captop = stack->caplevel;
+        p += (p + 1)->offset;
+        continue;
+      }
+      case IFailTwice:
+        stack--;
+        /* FALLTHROUGH */
+      case IFail:
+      fail: {  /* pattern failed: try to backtrack */
+        do {  /* remove pending calls */
+          s = (--stack)->s;
+        } while (s == NULL);
+        captop = stack->caplevel;
+        p = stack->p;
+        continue;
+      }
+      case IOpenCapture: case ICloseCapture: {
+        Capture *c;
+        if (captop >= ms->capsize) {
+          ms->ncap = captop;
+          growcap(ms);
+        }
+        c = &ms->capture[captop++];
+        c->s = s;
+        c->idx = p->i.key;
+        c->kind = (p->i.code == IOpenCapture) ? p->i.aux : Cclose;
+        p++;
+        continue;
+      }
+      default: lua_assert(0); return NULL;
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Capture evaluation
+** =======================================================
+*/
+
+typedef struct CapState {
+  lua_State *L;
+  Capture *cap;  /* current capture */
+  const char *s;  /* original subject */
+  int ktable;  /* index of the pattern's ktable */
+} CapState;
+
+
+static int pushcapture (CapState *cs);
+
+
+/* skip capture 'cs->cap' and all captures nested in it */
+static void skipcap (CapState *cs) {
+  int n = 0;
+  do {
+    if (cs->cap->kind == Cclose) n--;
+    else n++;
+    cs->cap++;
+  } while (n > 0);
+}
+
+
+/*
+** Push the values of all captures nested in 'cs->cap', plus the whole
+** match if 'addextra' or there are no nested values. Returns the number
+** of values pushed.
+*/
+static int pushnestedvalues (CapState *cs, int addextra) {
+  const char *s = cs->cap->s;
+  int n = 0;
+  cs->cap++;  /* skip open */
+  while (cs->cap->kind != Cclose)
+    n += pushcapture(cs);
+  if (addextra || n == 0) {
+    lua_pushlstring(cs->L, s, cs->cap->s - s);
+    n++;
+  }
+  cs->cap++;  /* skip close */
+  return n;
+}
+
+
+/* push only the first nested value of 'cs->cap' */
+static void pushonenestedvalue (CapState *cs) {
+  int n = pushnestedvalues(cs, 0);
+  if (n > 1)
+    lua_pop(cs->L, n - 1);
+}
+
+
+static int tablecap (CapState *cs) {
+  lua_State *L = cs->L;
+  int n = 0;
+  lua_newtable(L);
+  cs->cap++;  /* skip open */
+  while (cs->cap->kind != Cclose) {
+    if (cs->cap->kind == Cgroup && cs->cap->idx != 0) {  /* named group? */
+      lua_rawgeti(L, cs->ktable, cs->cap->idx);  /* group name */
+      pushonenestedvalue(cs);
+      lua_settable(L, -3);
+    }
+    else {
+      int i;
+      int k = pushcapture(cs);
+      for (i = k; i > 0; i--)  /* store all values into table */
+        lua_rawseti(L, -(i + 1), n + i);
+      n += k;
+    }
+  }
+  cs->cap++;  /* skip close */
+  return 1;
+}
+
+
+/* string capture: 'fmt' with "%n" replaced by the n-th value */
+static int stringcap (CapState *cs) {
+  lua_State *L = cs->L;
+  int top = lua_gettop(L);
+  const char *s = cs->cap->s;
+  const char *e;
+  const char *fmt;
+  size_t len, i;
+  int n;
+  luaL_Buffer b;
+  lua_rawgeti(L, cs->ktable, cs->cap->idx);
+  fmt = lua_tolstring(L, top + 1, &len);
+  n = pushnestedvalues(cs, 0);
+  e = (cs->cap - 1)->s;  /* end of the whole match */
+  luaL_buffinit(L, &b);
+  for (i = 0; i < len; i++) {
+    if (fmt[i] != L_ESC || i + 1 == len)
+      luaL_addchar(&b, fmt[i]);
+    else if (!isdigit(uchar(fmt[++i])))
+      luaL_addchar(&b, fmt[i]);
+    else {
+      int l = fmt[i] - '0';
+      if (l == 0)
+        luaL_addlstring(&b, s, e - s);
+      else if (l > n)
+        luaL_error(L, "invalid capture index %%%d", l);
+      else {
+        lua_pushvalue(L, top + 1 + l);
+        if (!lua_isstring(L, -1))
+          luaL_error(L, "invalid capture value (a %s)", luaL_typename(L, -1));
+        luaL_addvalue(&b);
+      }
+    }
+  }
+  luaL_pushresult(&b);
+  lua_replace(L, top + 1);
+  lua_settop(L, top + 1);
+  return 1;
+}
+
+
+/* p / n: the n-th value of 'p' (or no value for n == 0) */
+static int numcap (CapState *cs) {
+  lua_State *L = cs->L;
+  int idx = cs->cap->idx;
+  int n;
+  if (idx == 0) {
+    skipcap(cs);
+    return 0;
+  }
+  n = pushnestedvalues(cs, 0);
+  if (n < idx)
+    return luaL_error(L, "no capture '%d'", idx);
+  lua_pushvalue(L, -(n - idx + 1));
+  lua_replace(L, -(n + 1));
+  lua_pop(L, n - 1);
+  return 1;
+}
+
+
+/* push the values of capture 'cs->cap', returning how many */
+static int pushcapture (CapState *cs) {
+  lua_State *L = cs->L;
+  luaL_checkstack(L, 4, "too many captures");
+  switch (cs->cap->kind) {
+    case Cposition: {
+      lua_pushinteger(L, cs->cap->s - cs->s + 1);
+      skipcap(cs);
+      return 1;
+    }
+    case Cconst: {
+      lua_rawgeti(L, cs->ktable, cs->cap->idx);
+      skipcap(cs);
+      return 1;
+    }
+    case Csimple: {  /* whole match first, then nested values */
+      int k = pushnestedvalues(cs, 1);
+      lua_insert(L, -k);
+      return k;
+    }
+    case Cgroup: {
+      if (cs->cap->idx == 0)  /* anonymous group? */
+        return pushnestedvalues(cs, 0);
+      else {  /* named group: only values for a table capture */
+        skipcap(cs);
+        return 0;
+      }
+    }
+    case Ctable: return tablecap(cs);
+    case Cstring: return stringcap(cs);
+    case Cnum: return numcap(cs);
+    case Cquery: {
+      lua_rawgeti(L, cs->ktable, cs->cap->idx);
+      pushonenestedvalue(cs);
+      lua_gettable(L, -2);
+      lua_remove(L, -2);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+      }
+      return 1;
+    }
+    case Cfunction: {
+      int top = lua_gettop(L);
+      int n;
+      lua_rawgeti(L, cs->ktable, cs->cap->idx);
+      n = pushnestedvalues(cs, 0);
+      lua_call(L, n, LUA_MULTRET);
+      return lua_gettop(L) - top;
+    }
+    default: lua_assert(0); return 0;
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Library functions
+** =======================================================
+*/
+
+/* translate a relative initial string position (from strlib) */
+static size_t posrelat (lua_Integer pos, size_t len) {
+  if (pos >= 0) return (size_t)pos;
+  else if (0u - (size_t)pos > len) return 0;
+  else return len + (size_t)pos + 1;
+}
+
+
+/*
+** match(p, s [, init]): returns the values captured by 'p', or the
+** position after the match if there are none, or nil if 'p' fails.
+*/
+static int lp_match (lua_State *L) {
+  Capture capinit[INITCAPSIZE];
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  size_t init = posrelat(luaL_optinteger(L, 3, 1), l);
+  const char *r;
+  Pattern *p;
+  MatchState ms;
+  getpatt(L, 1, NULL);
+  p = (Pattern *)lua_touserdata(L, 1);
+  if (p->ncode == 0)  /* not compiled yet? */
+    compile(L, p, 1);
+  if (init < 1) init = 1;
+  else if (init > l + 1) {  /* start after string's end? */
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_settop(L, 3);
+  ms.L = L;
+  ms.capture = capinit;
+  ms.capsize = INITCAPSIZE;
+  ms.ncap = 0;
+  ms.ptop = 3;
+  lua_pushnil(L);  /* stackidx: place for a grown stack */
+  lua_pushnil(L);  /* capidx: place for a grown capture list */
+  lua_getuservalue(L, 1);  /* ktableidx */
+  r = run(&ms, s + init - 1, s + l, p->code);
+  if (r == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  else {
+    int n = 0;
+    if (ms.ncap > 0) {
+      CapState cs;
+      cs.L = L;
+      cs.cap = ms.capture;
+      cs.s = s;
+      cs.ktable = ktableidx(ms.ptop);
+      while (cs.cap < ms.capture + ms.ncap)
+        n += pushcapture(&cs);
+    }
+    if (n == 0) {  /* no values? return the final position */
+      lua_pushinteger(L, r - s + 1);
+      n = 1;
+    }
+    return n;
+  }
+}
+
+
+static int lp_type (lua_State *L) {
+  if (luaL_testudata(L, 1, PATTERN) != NULL)
+    lua_pushliteral(L, "pattern");
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+static int lp_gc (lua_State *L) {
+  Pattern *p = (Pattern *)luaL_checkudata(L, 1, PATTERN);
+  realloccode(L, p, 0);  /* free code */
+  p->ncode = 0;
+  return 0;
+}
+
+
+static int lp_tostring (lua_State *L) {
+  Pattern *p = (Pattern *)luaL_checkudata(L, 1, PATTERN);
+  lua_pushfstring(L, "pattern (%p)", p);
+  return 1;
+}
+
+
+static const luaL_Reg peglib[] = {
+  {"C", lp_C},
+  {"Cc", lp_Cc},
+  {"Cg", lp_Cg},
+  {"Cp", lp_Cp},
+  {"Ct", lp_Ct},
+  {"P", lp_P},
+  {"R", lp_R},
+  {"S", lp_S},
+  {"V", lp_V},
+  {"class", lp_class},
+  {"match", lp_match},
+  {"type", lp_type},
+  {NULL, NULL}
+};
+
+
+/*
+** methods for patterns
+*/
+static const luaL_Reg meth[] = {
+  {"match", lp_match},
+  {NULL, NULL}
+};
+
+
+/*
+** metamethods for patterns
+*/
+static const luaL_Reg metameth[] = {
+  {"__add", lp_choice},
+  {"__div", lp_divcapture},
+  {"__gc", lp_gc},
+  {"__len", lp_and},
+  {"__mul", lp_seq},
+  {"__pow", lp_star},
+  {"__sub", lp_sub},
+  {"__tostring", lp_tostring},
+  {"__unm", lp_not},
+  {"__index", NULL},  /* place holder */
+  {NULL, NULL}
+};
+
+
+static void createmeta (lua_State *L) {
+  luaL_newmetatable(L, PATTERN);  /* create metatable for patterns */
+  luaL_setfuncs(L, metameth, 0);  /* add metamethods to new metatable */
+  luaL_newlibtable(L, meth);  /* create method table */
+  luaL_setfuncs(L, meth, 0);  /* add pattern methods to method table */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+  lua_pop(L, 1);  /* pop new metatable */
+}
+
+
+LUAMOD_API int luaopen_peg (lua_State *L) {
+  luaL_newlib(L, peglib);
+  createmeta(L);
+  return 1;
+}
+
+/* }====================================================== */
+
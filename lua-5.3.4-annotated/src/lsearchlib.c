@@ -0,0 +1,579 @@
+/*
+** $Id: lsearchlib.c $
+** Library for multi-string search (Aho-Corasick automata)
+** See Copyright Notice in lua.h
+*/
+
+#define lsearchlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A matcher is an Aho-Corasick automaton built from a set of needles.
+** Bytes are first mapped to classes: each byte that occurs in some
+** needle gets its own class, and all other bytes share class 0 (which
+** always goes back to the root). While building, the trie keeps, for
+** each state, its label, first child, and next sibling; the root has a
+** dense table of children. When the automaton is small enough it is
+** then converted to a dense DFA ('delta'), so that each input byte
+** costs one table access. Otherwise the edges of each state are packed
+** together in 'edges' and the search follows failure links. Finally,
+** the arrays used by searches move into one userdata, kept as the user
+** value of the matcher, so that the collector sees their size.
+*/
+
+
+#define MATCHER		"search.Matcher"
+
+
+/*
+** Maximum number of entries in a dense transition table; larger
+** automata keep using the trie plus failure links.
+*/
+#if !defined(LUAI_MAXDENSE)
+#define LUAI_MAXDENSE	(1 << 22)
+#endif
+
+
+/* macro to 'unsign' a character */
+#define uchar(c)	((unsigned char)(c))
+
+
+typedef struct Edge {
+  int target;
+  int label;
+} Edge;
+
+
+typedef struct Matcher {
+  int nstates;  /* number of states (state 0 is the root) */
+  int sizestates;  /* size of the per-state arrays */
+  int nneedles;
+  int nclasses;  /* number of byte classes */
+  unsigned short classes[UCHAR_MAX + 1];  /* byte -> class */
+  int root[UCHAR_MAX + 2];  /* children of the root, by class (or 0) */
+  unsigned short *label;  /* class of the edge into each state */
+  int *child;  /* first child of each state (or -1) */
+  int *sibling;  /* next sibling of each state (or -1) */
+  int *fail;  /* failure link of each state */
+  int *match;  /* needle ending at each state (or -1) */
+  int *dict;  /* next state in failure chain with a match (or -1) */
+  size_t *lens;  /* length of each needle */
+  int *delta;  /* dense DFA, 'nstates' x 'nclasses' (or NULL) */
+  int *first;  /* edges of state 's' are 'edges[first[s]..first[s+1])' */
+  Edge *edges;
+  int packed;  /* true if the arrays are in the user value */
+} Matcher;
+
+
+/*
+** {======================================================
+** Building the automaton
+** =======================================================
+*/
+
+static void *resizemem (lua_State *L, void *block, size_t osize,
+                        size_t nsize) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  void *newblock = allocf(ud, block, osize, nsize);
+  if (newblock == NULL && nsize > 0) {
+    luaL_error(L, "not enough memory");
+    return NULL;  /* to avoid warnings */
+  }
+  return newblock;
+}
+
+
+#define resizearray(L,a,on,n)  \
+  ((a) = resizemem(L, (a), (on) * sizeof(*(a)), (n) * sizeof(*(a))))
+
+#define freearray(L,a,n)  \
+  { if ((a) != NULL) resizearray(L, a, n, 0); }
+
+
+/* free the arrays needed only while building the trie */
+static void freetrie (lua_State *L, Matcher *m) {
+  int n = m->sizestates;
+  freearray(L, m->label, n);
+  freearray(L, m->child, n);
+  freearray(L, m->sibling, n);
+}
+
+
+static void freematcher (lua_State *L, Matcher *m) {
+  int n = m->sizestates;
+  if (m->packed) {  /* arrays belong to the user value? */
+    m->sizestates = m->nneedles = 0;
+    return;
+  }
+  freetrie(L, m);
+  freearray(L, m->fail, n);
+  freearray(L, m->match, n);
+  freearray(L, m->dict, n);
+  freearray(L, m->lens, m->nneedles);
+  freearray(L, m->delta, (size_t)n * m->nclasses);
+  if (m->first != NULL) {
+    freearray(L, m->edges, (size_t)m->first[n]);
+    resizearray(L, m->first, (size_t)n + 1, 0);
+  }
+  m->sizestates = m->nneedles = 0;
+}
+
+
+static void shrinkstates (lua_State *L, Matcher *m) {
+  int n = m->sizestates;
+  int nn = m->nstates;
+  resizearray(L, m->label, n, nn);
+  resizearray(L, m->child, n, nn);
+  resizearray(L, m->sibling, n, nn);
+  resizearray(L, m->fail, n, nn);
+  resizearray(L, m->match, n, nn);
+  resizearray(L, m->dict, n, nn);
+  m->sizestates = nn;
+}
+
+
+static int newstate (lua_State *L, Matcher *m, int c) {
+  int s;
+  if (m->nstates == m->sizestates) {  /* must grow arrays? */
+    int n = m->sizestates;
+    int nn = (n == 0) ? 16 : n * 2;
+    if (n >= INT_MAX / 2)
+      luaL_error(L, "too many states in automaton");
+    resizearray(L, m->label, n, nn);
+    resizearray(L, m->child, n, nn);
+    resizearray(L, m->sibling, n, nn);
+    resizearray(L, m->fail, n, nn);
+    resizearray(L, m->match, n, nn);
+    resizearray(L, m->dict, n, nn);
+    m->sizestates = nn;
+  }
+  s = m->nstates++;
+  m->label[s] = (unsigned short)c;
+  m->child[s] = m->sibling[s] = -1;
+  m->fail[s] = 0;
+  m->match[s] = m->dict[s] = -1;
+  return s;
+}
+
+
+/* child of (non-root) state 's' through class 'c', or -1 if none */
+static int getchild (const Matcher *m, int s, int c) {
+  int t;
+  for (t = m->child[s]; t >= 0; t = m->sibling[t]) {
+    if (m->label[t] == c)
+      break;
+  }
+  return t;
+}
+
+
+/*
+** Transition from state 's' through class 'c' in the trie, or -1 if
+** none. The root has a transition for every class (to itself, if it
+** has no such child).
+*/
+static int trychild (const Matcher *m, int s, int c) {
+  return (s == 0) ? m->root[c] : getchild(m, s, c);
+}
+
+
+static void addneedle (lua_State *L, Matcher *m, int idx,
+                       const char *p, size_t l) {
+  int s = 0;
+  size_t i;
+  for (i = 0; i < l; i++) {
+    int c = m->classes[uchar(p[i])];
+    int t = trychild(m, s, c);
+    if (t <= 0) {  /* new edge? */
+      t = newstate(L, m, c);
+      if (s == 0)
+        m->root[c] = t;
+      else {
+        m->sibling[t] = m->child[s];
+        m->child[s] = t;
+      }
+    }
+    s = t;
+  }
+  if (m->match[s] < 0)  /* keep first index of repeated needles */
+    m->match[s] = idx;
+}
+
+
+/*
+** Compute failure and dictionary links in breadth-first order, so that
+** the links of a state are ready before those of its children. Also
+** fills the dense DFA, if there is one.
+*/
+static void buildlinks (lua_State *L, Matcher *m) {
+  int *queue;
+  int head = 0, tail = 0;
+  int c;
+  queue = NULL;
+  resizearray(L, queue, 0, (size_t)m->nstates);
+  for (c = 0; c < m->nclasses; c++) {
+    int t = m->root[c];
+    if (t > 0) {
+      m->fail[t] = 0;
+      queue[tail++] = t;
+    }
+    if (m->delta) m->delta[c] = t;
+  }
+  while (head < tail) {
+    int s = queue[head++];
+    int t;
+    int f = m->fail[s];
+    m->dict[s] = (m->match[f] >= 0) ? f : m->dict[f];
+    for (t = m->child[s]; t >= 0; t = m->sibling[t]) {
+      int ft = f;
+      int next;
+      while ((next = trychild(m, ft, m->label[t])) < 0)
+        ft = m->fail[ft];  /* stops at the root */
+      m->fail[t] = next;
+      queue[tail++] = t;
+    }
+    if (m->delta) {  /* fill this state's row of the DFA */
+      int *row = m->delta + (size_t)s * m->nclasses;
+      const int *frow = m->delta + (size_t)f * m->nclasses;
+      for (c = 0; c < m->nclasses; c++) row[c] = frow[c];
+      for (t = m->child[s]; t >= 0; t = m->sibling[t])
+        row[m->label[t]] = t;
+    }
+  }
+  resizearray(L, queue, (size_t)m->nstates, 0);
+}
+
+
+/*
+** Copy the edges of each state to contiguous positions in 'edges'.
+** ('sizestates' is made equal to 'nstates', as 'first[sizestates]'
+** gives the size of 'edges'.)
+*/
+static void packedges (lua_State *L, Matcher *m) {
+  int n = m->nstates;
+  int s, e = 0;
+  shrinkstates(L, m);
+  resizearray(L, m->first, 0, (size_t)n + 1);
+  resizearray(L, m->edges, 0, (size_t)n - 1);  /* all states but root */
+  for (s = 0; s < n; s++) {
+    int t;
+    m->first[s] = e;
+    if (s == 0) {
+      int c;
+      for (c = 0; c < m->nclasses; c++) {
+        if (m->root[c] > 0) {
+          m->edges[e].target = m->root[c];
+          m->edges[e++].label = c;
+        }
+      }
+    }
+    else {
+      for (t = m->child[s]; t >= 0; t = m->sibling[t]) {
+        m->edges[e].target = t;
+        m->edges[e++].label = m->label[t];
+      }
+    }
+  }
+  m->first[n] = e;
+  lua_assert(e == n - 1);
+}
+
+
+/* copy 'n' elements of array 'a' to 'b', make 'a' point there */
+#define movearray(b,a,n)  \
+  { size_t sz_ = (size_t)(n) * sizeof(*(a));  \
+    if (sz_ > 0) memcpy(b, a, sz_);  \
+    (a) = (void *)(b); (b) += sz_; }
+
+
+/*
+** Move the arrays that searches use into a userdata, which is set as
+** the user value of the matcher (at the top of the stack), and free
+** their original blocks.
+*/
+static void packmatcher (lua_State *L, Matcher *m) {
+  size_t n = (size_t)m->nstates;
+  size_t nd = (m->delta != NULL) ? n * (size_t)m->nclasses : 0;
+  size_t nf = (m->delta != NULL) ? 0 : n + 1;
+  size_t ne = (m->delta != NULL) ? 0 : (size_t)m->first[n];
+  Matcher old = *m;
+  char *b;
+  lua_assert(m->sizestates == m->nstates);
+  b = (char *)lua_newuserdata(L, (size_t)m->nneedles * sizeof(size_t) +
+                                 (3 * n + nd + nf) * sizeof(int) +
+                                 ne * sizeof(Edge));
+  movearray(b, m->lens, m->nneedles);  /* first, as it is the widest */
+  movearray(b, m->fail, n);
+  movearray(b, m->match, n);
+  movearray(b, m->dict, n);
+  if (m->delta != NULL)
+    movearray(b, m->delta, nd)
+  else {
+    movearray(b, m->first, nf);
+    movearray(b, m->edges, ne);
+  }
+  lua_setuservalue(L, -2);
+  freematcher(L, &old);
+  m->packed = 1;
+}
+
+
+static int compile (lua_State *L) {
+  Matcher *m;
+  lua_Integer n, i;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = luaL_len(L, 1);
+  luaL_argcheck(L, n < INT_MAX, 1, "too many needles");
+  m = (Matcher *)lua_newuserdata(L, sizeof(Matcher));
+  memset(m, 0, sizeof(Matcher));  /* all arrays are NULL */
+  luaL_setmetatable(L, MATCHER);
+  resizearray(L, m->lens, 0, (size_t)n);
+  m->nneedles = (int)n;
+  m->nclasses = 1;  /* class 0 is for bytes not in any needle */
+  for (i = 1; i <= n; i++) {  /* compute byte classes */
+    size_t l, j;
+    const char *p;
+    lua_geti(L, 1, i);
+    p = lua_tolstring(L, -1, &l);
+    if (p == NULL || l == 0)
+      return luaL_error(L, "invalid needle at index %d (%s)", (int)i,
+                        (p == NULL) ? "not a string" : "empty");
+    m->lens[i - 1] = l;
+    for (j = 0; j < l; j++) {
+      if (m->classes[uchar(p[j])] == 0)
+        m->classes[uchar(p[j])] = (unsigned short)m->nclasses++;
+    }
+    lua_pop(L, 1);
+  }
+  newstate(L, m, 0);  /* root */
+  for (i = 1; i <= n; i++) {  /* build trie */
+    size_t l;
+    const char *p;
+    lua_geti(L, 1, i);
+    p = lua_tolstring(L, -1, &l);
+    addneedle(L, m, (int)i - 1, p, l);
+    lua_pop(L, 1);
+  }
+  if ((size_t)m->nstates <= LUAI_MAXDENSE / (size_t)m->nclasses) {
+    shrinkstates(L, m);  /* 'sizestates' gives the size of 'delta' */
+    resizearray(L, m->delta, 0, (size_t)m->nstates * m->nclasses);
+  }
+  buildlinks(L, m);
+  if (m->delta == NULL)
+    packedges(L, m);
+  freetrie(L, m);
+  packmatcher(L, m);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Searching
+** =======================================================
+*/
+
+/* next state from state 's' reading byte 'b' */
+static int step (const Matcher *m, int s, int b) {
+  int c = m->classes[b];
+  if (m->delta)
+    return m->delta[(size_t)s * m->nclasses + c];
+  else if (c == 0)
+    return 0;
+  else {
+    for (;;) {
+      if (s == 0)
+        return m->root[c];
+      else {
+        const Edge *e = m->edges + m->first[s];
+        const Edge *lim = m->edges + m->first[s + 1];
+        for (; e < lim; e++) {
+          if (e->label == c)
+            return e->target;
+        }
+        s = m->fail[s];
+      }
+    }
+  }
+}
+
+
+/* first state with a match reachable from 's' (or -1) */
+#define firstmatch(m,s)	(((m)->match[s] >= 0) ? (s) : (m)->dict[s])
+
+
+/* translate a relative string position: negative means back from end */
+static lua_Integer posrelat (lua_Integer pos, size_t len) {
+  if (pos >= 0) return pos;
+  else if (0u - (size_t)pos > len) return 0;
+  else return (lua_Integer)len + pos + 1;
+}
+
+
+static Matcher *checkmatcher (lua_State *L, const char **s, size_t *l,
+                              size_t *init) {
+  Matcher *m = (Matcher *)luaL_checkudata(L, 1, MATCHER);
+  lua_Integer i;
+  *s = luaL_checklstring(L, 2, l);
+  i = posrelat(luaL_optinteger(L, 3, 1), *l);
+  if (i < 1) i = 1;
+  *init = (i > (lua_Integer)*l) ? *l : (size_t)i - 1;
+  luaL_argcheck(L, m->sizestates > 0, 1, "matcher has been freed");
+  return m;
+}
+
+
+/*
+** Returns start, end, and index of the match that ends first in the
+** subject (the longest one, if several end at the same position).
+*/
+static int find_any (lua_State *L) {
+  size_t l, i;
+  const char *s;
+  Matcher *m = checkmatcher(L, &s, &l, &i);
+  int st = 0;
+  for (; i < l; i++) {
+    int t;
+    st = step(m, st, uchar(s[i]));
+    if ((t = firstmatch(m, st)) >= 0) {
+      int k = m->match[t];
+      lua_pushinteger(L, (lua_Integer)(i + 2 - m->lens[k]));
+      lua_pushinteger(L, (lua_Integer)i + 1);
+      lua_pushinteger(L, k + 1);
+      return 3;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+
+/*
+** Returns a sequence with all matches (including overlapping ones),
+** as triples start, end, index, ordered by their end positions.
+*/
+static int find_all (lua_State *L) {
+  size_t l, i;
+  const char *s;
+  Matcher *m = checkmatcher(L, &s, &l, &i);
+  int st = 0;
+  lua_Integer n = 0;
+  lua_newtable(L);
+  for (; i < l; i++) {
+    int t;
+    st = step(m, st, uchar(s[i]));
+    for (t = firstmatch(m, st); t >= 0; t = m->dict[t]) {
+      int k = m->match[t];
+      lua_pushinteger(L, (lua_Integer)(i + 2 - m->lens[k]));
+      lua_rawseti(L, -2, ++n);
+      lua_pushinteger(L, (lua_Integer)i + 1);
+      lua_rawseti(L, -2, ++n);
+      lua_pushinteger(L, k + 1);
+      lua_rawseti(L, -2, ++n);
+    }
+  }
+  return 1;
+}
+
+
+/* Returns the number of matches (including overlapping ones). */
+static int count (lua_State *L) {
+  size_t l, i;
+  const char *s;
+  Matcher *m = checkmatcher(L, &s, &l, &i);
+  int st = 0;
+  lua_Integer n = 0;
+  for (; i < l; i++) {
+    int t;
+    st = step(m, st, uchar(s[i]));
+    for (t = firstmatch(m, st); t >= 0; t = m->dict[t])
+      n++;
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+static int m_gc (lua_State *L) {
+  Matcher *m = (Matcher *)luaL_checkudata(L, 1, MATCHER);
+  freematcher(L, m);
+  return 0;
+}
+
+
+static int m_len (lua_State *L) {
+  Matcher *m = (Matcher *)luaL_checkudata(L, 1, MATCHER);
+  lua_pushinteger(L, m->nneedles);
+  return 1;
+}
+
+
+static int m_tostring (lua_State *L) {
+  Matcher *m = (Matcher *)luaL_checkudata(L, 1, MATCHER);
+  lua_pushfstring(L, "matcher (%p)", (void *)m);
+  return 1;
+}
+
+
+/*
+** methods for matchers
+*/
+static const luaL_Reg methods[] = {
+  {"find_any", find_any},
+  {"find_all", find_all},
+  {"count", count},
+  {NULL, NULL}
+};
+
+
+/*
+** metamethods for matchers
+*/
+static const luaL_Reg metameth[] = {
+  {"__index", NULL},  /* place holder */
+  {"__gc", m_gc},
+  {"__len", m_len},
+  {"__tostring", m_tostring},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg funcs[] = {
+  {"compile", compile},
+  {NULL, NULL}
+};
+
+
+static void createmeta (lua_State *L) {
+  luaL_newmetatable(L, MATCHER);  /* create metatable for matchers */
+  luaL_setfuncs(L, metameth, 0);  /* add metamethods to new metatable */
+  luaL_newlibtable(L, methods);  /* create method table */
+  luaL_setfuncs(L, methods, 0);  /* add matcher methods to method table */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+
+LUAMOD_API int luaopen_search (lua_State *L) {
+  luaL_newlib(L, funcs);
+  createmeta(L);
+  return 1;
+}
+
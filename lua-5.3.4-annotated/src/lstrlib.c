@@ -23,6 +23,7 @@
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "lstrlib.h"
 
 
 /*
@@ -51,6 +52,101 @@
 
 
 
+/*
+** {======================================================
+** Word-at-a-time kernels for case mapping and reversal
+** =======================================================
+*/
+
+/*
+** Strings shorter than this are handled byte by byte; it is not worth
+** checking the locale for them.
+*/
+#if !defined(LUAI_MINWORDLEN)
+#define LUAI_MINWORDLEN		32
+#endif
+
+
+/* a machine word, processed as a vector of bytes */
+typedef size_t lword;
+
+#define WORDSIZE	sizeof(lword)
+
+/* word with all its bytes equal to 'b' */
+#define bytes(b)	((~(lword)0 / 0xff) * (lword)(b))
+
+
+/*
+** Check whether the C library maps case as in the "C" locale, that is,
+** only 'A'-'Z' and 'a'-'z' change (and the character set is ASCII).
+*/
+static int asciicase (void) {
+#if 'A' == 65 && 'a' == 97
+  const char *loc = setlocale(LC_CTYPE, NULL);
+  return (loc != NULL &&
+          (strcmp(loc, "C") == 0 || strcmp(loc, "POSIX") == 0));
+#else
+  return 0;
+#endif
+}
+
+
+/*
+** Flip the case of all bytes of 'w' in the range ['first', 'last']
+** (both ASCII letters of the same case). Each byte is computed
+** independently: with the high bit cleared, adding (0x80 - 'first')
+** sets it iff the byte is >= 'first', and adding (0x7f - 'last')
+** sets it iff the byte is > 'last'. Non-ASCII bytes are left alone.
+*/
+static lword flipcase (lword w, int first, int last) {
+  lword low = w & bytes(0x7f);
+  lword ge = low + bytes(0x80 - first);
+  lword gt = low + bytes(0x7f - last);
+  lword inrange = (ge ^ gt) & ~w & bytes(0x80);
+  return w ^ (inrange >> 2);  /* 0x80 >> 2 == 'A' ^ 'a' */
+}
+
+
+/*
+** Copy 's' into 'p' mapping letters in ['first', 'last'] to the other
+** case, a word at a time.
+*/
+static void asciimapcase (char *p, const char *s, size_t l,
+                          int first, int last) {
+  size_t i = 0;
+  for (; i + WORDSIZE <= l; i += WORDSIZE) {
+    lword w;
+    memcpy(&w, s + i, WORDSIZE);
+    w = flipcase(w, first, last);
+    memcpy(p + i, &w, WORDSIZE);
+  }
+  for (; i < l; i++) {
+    int c = uchar(s[i]);
+    p[i] = (first <= c && c <= last) ? (char)(c ^ ('A' ^ 'a')) : (char)c;
+  }
+}
+
+
+/* reverse the bytes of a word */
+#if defined(__GNUC__) && ((__GNUC__*100 + __GNUC_MINOR__) >= 403)
+#define wordswap(w)  \
+  (WORDSIZE == 8 ? (lword)__builtin_bswap64((w)) : \
+                   (lword)__builtin_bswap32((unsigned int)(w)))
+#else
+static lword wordswap (lword w) {
+  lword r = 0;
+  size_t i;
+  for (i = 0; i < WORDSIZE; i++) {
+    r = (r << CHAR_BIT) | (w & 0xff);
+    w >>= CHAR_BIT;
+  }
+  return r;
+}
+#endif
+
+/* }====================================================== */
+
+
 static int str_len (lua_State *L) {
   size_t l;
   luaL_checklstring(L, 1, &l);
@@ -86,7 +182,13 @@ static int str_reverse (lua_State *L) {
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i = 0; i < l; i++)
+  for (i = 0; i + WORDSIZE <= l; i += WORDSIZE) {  /* whole words */
+    lword w;
+    memcpy(&w, s + l - i - WORDSIZE, WORDSIZE);
+    w = wordswap(w);
+    memcpy(p + i, &w, WORDSIZE);
+  }
+  for (; i < l; i++)
     p[i] = s[l - i - 1];
   luaL_pushresultsize(&b, l);
   return 1;
@@ -99,8 +201,12 @@ static int str_lower (lua_State *L) {
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = tolower(uchar(s[i]));
+  if (l >= LUAI_MINWORDLEN && asciicase())
+    asciimapcase(p, s, l, 'A', 'Z');
+  else {
+    for (i=0; i<l; i++)
+      p[i] = tolower(uchar(s[i]));
+  }
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -112,13 +218,22 @@ static int str_upper (lua_State *L) {
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = toupper(uchar(s[i]));
+  if (l >= LUAI_MINWORDLEN && asciicase())
+    asciimapcase(p, s, l, 'a', 'z');
+  else {
+    for (i=0; i<l; i++)
+      p[i] = toupper(uchar(s[i]));
+  }
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
 
+/*
+** The result of 'rep' is periodic, so after writing its first period
+** ('s' plus 'sep') each copy duplicates everything written so far,
+** needing only O(log n) calls to 'memcpy'.
+*/
 static int str_rep (lua_State *L) {
   size_t l, lsep;
   const char *s = luaL_checklstring(L, 1, &l);
@@ -129,16 +244,20 @@ static int str_rep (lua_State *L) {
     return luaL_error(L, "resulting string too large");
   else {
     size_t totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
+    size_t done;
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
-        memcpy(p, sep, lsep * sizeof(char));
-        p += lsep;
-      }
+    memcpy(p, s, l * sizeof(char));
+    done = l;
+    if (n > 1 && lsep > 0) {  /* empty 'memcpy' is not that cheap */
+      memcpy(p + l, sep, lsep * sizeof(char));
+      done += lsep;
+    }
+    while (done < totallen) {  /* double what is done */
+      size_t chunk = (done <= totallen - done) ? done : totallen - done;
+      memcpy(p + done, p, chunk * sizeof(char));
+      done += chunk;
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -235,7 +354,6 @@ static const char *match (MatchState *ms, const char *s, const char *p);
 #endif
 
 
-#define L_ESC		'%'
 #define SPECIALS	"^$*+?.([%-"
 
 
@@ -279,7 +397,7 @@ static const char *classend (MatchState *ms, const char *p) {
 }
 
 
-static int match_class (int c, int cl) {
+int luaI_matchclass (int c, int cl) {
   int res;
   switch (tolower(cl)) {
     case 'a' : res = isalpha(c); break;
@@ -299,7 +417,7 @@ static int match_class (int c, int cl) {
 }
 
 
-static int matchbracketclass (int c, const char *p, const char *ec) {
+int luaI_matchbracketclass (int c, const char *p, const char *ec) {
   int sig = 1;
   if (*(p+1) == '^') {
     sig = 0;
@@ -308,7 +426,7 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
   while (++p < ec) {
     if (*p == L_ESC) {
       p++;
-      if (match_class(c, uchar(*p)))
+      if (luaI_matchclass(c, uchar(*p)))
         return sig;
     }
     else if ((*(p+1) == '-') && (p+2 < ec)) {
@@ -330,8 +448,8 @@ static int singlematch (MatchState *ms, const char *s, const char *p,
     int c = uchar(*s);
     switch (*p) {
       case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
+      case L_ESC: return luaI_matchclass(c, uchar(*(p+1)));
+      case '[': return luaI_matchbracketclass(c, p, ep-1);
       default:  return (uchar(*p) == c);
     }
   }
@@ -461,8 +579,8 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
               luaL_error(ms->L, "missing '[' after '%%f' in pattern");
             ep = classend(ms, p);  /* points to what is next */
             previous = (s == ms->src_init) ? '\0' : *(s - 1);
-            if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-               matchbracketclass(uchar(*s), p, ep - 1)) {
+            if (!luaI_matchbracketclass(uchar(previous), p, ep - 1) &&
+               luaI_matchbracketclass(uchar(*s), p, ep - 1)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
             }
             s = NULL;  /* match failed */
@@ -800,6 +918,165 @@ static int str_gsub (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** SPLIT AND JOIN
+** =======================================================
+*/
+
+/* state for 'split' */
+typedef struct SplitState {
+  const char *sep;  /* separator (plain string or pattern) */
+  size_t lsep;
+  int plain;  /* true if 'sep' is a plain string */
+  MatchState ms;  /* match state (for patterns) */
+} SplitState;
+
+
+static void prepsplit (lua_State *L, SplitState *ss, const char *s,
+                       size_t ls, int arg) {
+  ss->sep = luaL_checklstring(L, arg, &ss->lsep);
+  ss->plain = lua_toboolean(L, arg + 1) || nospecials(ss->sep, ss->lsep);
+  luaL_argcheck(L, !ss->plain || ss->lsep > 0, arg, "empty separator");
+  prepstate(&ss->ms, L, s, ls, ss->sep, ss->lsep);
+}
+
+
+/*
+** Find the next separator in 's'. Returns its start (setting '*e' to
+** its end) or NULL if there are no more separators. Patterns matching
+** the empty string do not split.
+*/
+static const char *nextsep (SplitState *ss, const char *s, const char **e) {
+  const char *end = ss->ms.src_end;
+  if (ss->plain) {
+    const char *p;
+    if (ss->lsep == 1)
+      p = (const char *)memchr(s, *ss->sep, end - s);
+    else
+      p = lmemfind(s, end - s, ss->sep, ss->lsep);
+    if (p != NULL) *e = p + ss->lsep;
+    return p;
+  }
+  for (; s < end; s++) {
+    reprepstate(&ss->ms);
+    if ((*e = match(&ss->ms, s, ss->sep)) != NULL && *e != s)
+      return s;
+  }
+  return NULL;
+}
+
+
+/*
+** Split the string in 'ss' into at most 'limit' fields, storing them
+** in the table at index 't' starting at 1. If 't' is 0, only counts
+** the fields. Returns the number of fields.
+*/
+static lua_Integer splitaux (lua_State *L, SplitState *ss, int t,
+                             lua_Integer limit) {
+  const char *s = ss->ms.src_init;
+  const char *e;
+  const char *p;
+  lua_Integer n = 0;
+  while (n + 1 < limit && (p = nextsep(ss, s, &e)) != NULL) {
+    if (t) {
+      lua_pushlstring(L, s, p - s);
+      lua_rawseti(L, t, n + 1);
+    }
+    n++;
+    s = e;
+  }
+  if (t) {  /* last field goes up to the end of the string */
+    lua_pushlstring(L, s, ss->ms.src_end - s);
+    lua_rawseti(L, t, n + 1);
+  }
+  return n + 1;
+}
+
+
+static lua_Integer getlimit (lua_State *L, int arg) {
+  lua_Integer limit = luaL_optinteger(L, arg, LUA_MAXINTEGER);
+  luaL_argcheck(L, limit > 0, arg, "limit must be positive");
+  return limit;
+}
+
+
+static int str_split (lua_State *L) {
+  size_t ls;
+  const char *s = luaL_checklstring(L, 1, &ls);
+  SplitState ss;
+  lua_Integer limit = getlimit(L, 4);
+  lua_Integer n = 0;
+  prepsplit(L, &ss, s, ls, 2);
+  if (ss.plain)  /* counting fields is cheap? */
+    n = splitaux(L, &ss, 0, limit);
+  lua_createtable(L, (n > INT_MAX) ? INT_MAX : (int)n, 0);
+  splitaux(L, &ss, lua_gettop(L), limit);
+  return 1;
+}
+
+
+/*
+** 'splitinto' stores the fields into the table given as its first
+** argument, erasing any previous entries after the last field. So,
+** a single table can be reused to split many strings.
+*/
+static int str_splitinto (lua_State *L) {
+  size_t ls;
+  const char *s;
+  SplitState ss;
+  lua_Integer limit, n, i;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  s = luaL_checklstring(L, 2, &ls);
+  limit = getlimit(L, 5);
+  prepsplit(L, &ss, s, ls, 3);
+  n = splitaux(L, &ss, 1, limit);
+  for (i = n + 1; lua_rawgeti(L, 1, i) != LUA_TNIL; i++) {
+    lua_pushnil(L);
+    lua_rawseti(L, 1, i);  /* erase old entry */
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+
+/*
+** 'join' concatenates its arguments (strings or numbers) separated by
+** 'sep'. The result size is computed first, so it is built with one
+** allocation.
+*/
+static int str_join (lua_State *L) {
+  int top = lua_gettop(L);
+  int i;
+  size_t lsep, l;
+  const char *sep = luaL_checklstring(L, 1, &lsep);
+  size_t total = 0;
+  luaL_Buffer b;
+  char *p;
+  for (i = 2; i <= top; i++) {  /* compute size of the result */
+    luaL_checklstring(L, i, &l);  /* (converts numbers in place) */
+    if (l >= MAXSIZE - total || lsep >= MAXSIZE - total - l)
+      return luaL_error(L, "resulting string too large");
+    total += l + (i > 2 ? lsep : 0);
+  }
+  p = luaL_buffinitsize(L, &b, total);
+  for (i = 2; i <= top; i++) {
+    const char *s = lua_tolstring(L, i, &l);
+    if (i > 2 && lsep > 0) {
+      memcpy(p, sep, lsep * sizeof(char));
+      p += lsep;
+    }
+    memcpy(p, s, l * sizeof(char));
+    p += l;
+  }
+  luaL_pushresultsize(&b, total);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 
 /*
 ** {======================================================
@@ -978,11 +1255,20 @@ static void addliteral (lua_State *L, luaL_Buffer *b, int arg) {
 }
 
 
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+/*
+** Check a format specification (without its initial '%') and copy it
+** to 'form', prefixed with '%'. Returns a pointer to the conversion
+** character, or NULL with an error message in '*msg' if the
+** specification is invalid.
+*/
+static const char *checkformat (const char *strfrmt, char *form,
+                                const char **msg) {
   const char *p = strfrmt;
   while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
-  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
-    luaL_error(L, "invalid format (repeated flags)");
+  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char)) {
+    *msg = "invalid format (repeated flags)";
+    return NULL;
+  }
   if (isdigit(uchar(*p))) p++;  /* skip width */
   if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   if (*p == '.') {
@@ -990,8 +1276,10 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
     if (isdigit(uchar(*p))) p++;  /* skip precision */
     if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   }
-  if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
+  if (isdigit(uchar(*p))) {
+    *msg = "invalid format (width or precision too long)";
+    return NULL;
+  }
   *(form++) = '%';
   memcpy(form, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
   form += (p - strfrmt) + 1;
@@ -1000,6 +1288,15 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
 }
 
 
+static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+  const char *msg;
+  const char *p = checkformat(strfrmt, form, &msg);
+  if (p == NULL)
+    luaL_error(L, "%s", msg);
+  return p;
+}
+
+
 /*
 ** add length modifier into formats
 */
@@ -1013,14 +1310,349 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
+/*
+** Add to buffer 'b' the argument 'arg' formatted according to the
+** format specification 'form' (which ends with conversion 'conv').
+** 'form' is changed to receive the length modifier, if any.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg,
+                       char *form, int conv) {
+  char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
+  int nb = 0;  /* number of bytes in added item */
+  switch (conv) {
+    case 'c': {
+      nb = l_sprintf(buff, MAX_ITEM, form, (int)luaL_checkinteger(L, arg));
+      break;
+    }
+    case 'd': case 'i':
+    case 'o': case 'u': case 'x': case 'X': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      addlenmod(form, LUA_INTEGER_FRMLEN);
+      nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACINT)n);
+      break;
+    }
+    case 'a': case 'A':
+      addlenmod(form, LUA_NUMBER_FRMLEN);
+      nb = lua_number2strx(L, buff, MAX_ITEM, form,
+                              luaL_checknumber(L, arg));
+      break;
+    case 'e': case 'E': case 'f':
+    case 'g': case 'G': {
+      lua_Number n = luaL_checknumber(L, arg);
+      addlenmod(form, LUA_NUMBER_FRMLEN);
+      nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACNUMBER)n);
+      break;
+    }
+    case 'q': {
+      addliteral(L, b, arg);
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_tolstring(L, arg, &l);
+      if (form[2] == '\0')  /* no modifiers? */
+        luaL_addvalue(b);  /* keep entire string */
+      else {
+        luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
+        if (!strchr(form, '.') && l >= 100) {
+          /* no precision and string is too long to be formatted */
+          luaL_addvalue(b);  /* keep entire string */
+        }
+        else {  /* format the string into 'buff' */
+          nb = l_sprintf(buff, MAX_ITEM, form, s);
+          lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+        }
+      }
+      break;
+    }
+    default: {  /* also treat cases 'pnLlh' */
+      luaL_error(L, "invalid option '%%%c' to 'format'", conv);
+    }
+  }
+  lua_assert(nb < MAX_ITEM);
+  luaL_addsize(b, nb);
+}
+
+
+/*
+** {------------------------------------------------------
+** Compiled formats
+**
+** Each format string is parsed only once into a list of items, which
+** is kept in a cache (a table stored as an upvalue of 'str_format')
+** indexed by the format string itself. The cache holds its entries
+** strongly, so they survive collections; it also keeps its format
+** strings in a sequence, so that, when it has LUA_MAXFMTCACHE entries,
+** a new format can replace one chosen at random (see 'cacheslot').
+** Plain '%s', '%d', '%i', '%x', and '%X' items are written directly
+** into the buffer; all other items go through 'addformat' with their
+** already checked specification, copied from the format string.
+** -------------------------------------------------------
+*/
+
+/*
+** maximum number of formats kept compiled (each one takes a userdata
+** with 24 bytes per item, on 64-bit machines). A value near 3/4 of a power of 2
+** leaves free slots in the hash part of the cache, so that replacing
+** entries does not rehash the table each time.
+*/
+#if !defined(LUA_MAXFMTCACHE)
+#define LUA_MAXFMTCACHE		1536
+#endif
+
+/*
+** When the cache is full, only about one in FMTADMIT new formats gets
+** compiled and cached; the others are interpreted directly
+*/
+#define FMTADMIT	32
+
+/* kinds of format items */
+#define FI_LITERAL	0	/* literal text from the format string */
+#define FI_GENERIC	1	/* any item handled by 'addformat' */
+#define FI_STRING	2	/* plain '%s' */
+#define FI_DEC		3	/* plain '%d' or '%i' */
+#define FI_HEX		4	/* plain '%x' */
+#define FI_HEXUP	5	/* plain '%X' */
+
+
+typedef struct FormatItem {
+  unsigned char kind;
+  char conv;  /* conversion character (for FI_GENERIC) */
+  size_t init, len;  /* text (or specification without its '%') is
+                        'strfrmt[init..init+len)' */
+} FormatItem;
+
+
+typedef struct CompiledFormat {
+  int nitems;
+  FormatItem items[1];  /* actual size is 'nitems' */
+} CompiledFormat;
+
+
+/* maximum number of characters needed for a lua_Integer in base 8 */
+#define MAXINTDIGITS	(((int)sizeof(lua_Integer) * CHAR_BIT + 2) / 3 + 2)
+
+
+/* conversions accepted by 'addformat' */
+#define VALIDCONV	"cdioxXaAefgGqs"
+
+
+/*
+** Parse format 'strfrmt' into a new compiled format, left on the top
+** of the stack. Returns NULL (and pushes nothing) if the format is
+** invalid, so that the interpreter in 'str_format' can raise the error
+** at the proper moment.
+*/
+static CompiledFormat *compileformat (lua_State *L, const char *strfrmt,
+                                      size_t sfl) {
+  const char *init = strfrmt;
+  const char *strfrmt_end = strfrmt + sfl;
+  const char *p;
+  CompiledFormat *cf;
+  FormatItem *item;
+  int maxitems = 1;
+  for (p = strfrmt; (p = (const char *)memchr(p, L_ESC, strfrmt_end - p))
+                    != NULL; p++)
+    maxitems += 2;  /* each '%' adds at most one item plus a literal */
+  cf = (CompiledFormat *)lua_newuserdata(L, sizeof(CompiledFormat) +
+                                         (maxitems - 1) * sizeof(FormatItem));
+  cf->nitems = 0;
+  item = NULL;
+  while (strfrmt < strfrmt_end) {
+    if (*strfrmt != L_ESC || *(strfrmt + 1) == L_ESC) {  /* literal text? */
+      size_t n = (*strfrmt == L_ESC) ? 1 : 0;  /* '%%' adds only a '%' */
+      p = (const char *)memchr(strfrmt + 1 + n, L_ESC,
+                               strfrmt_end - (strfrmt + 1 + n));
+      if (p == NULL) p = strfrmt_end;
+      if (item == NULL || item->kind != FI_LITERAL ||
+          item->init + item->len != (size_t)(strfrmt + n - init)) {
+        item = &cf->items[cf->nitems++];
+        item->kind = FI_LITERAL;
+        item->init = strfrmt + n - init;
+        item->len = 0;
+      }
+      item->len += p - (strfrmt + n);
+      strfrmt = p;
+    }
+    else {  /* format item */
+      char form[MAX_FORMAT];
+      const char *msg;
+      item = &cf->items[cf->nitems++];
+      item->init = strfrmt + 1 - init;
+      strfrmt = checkformat(strfrmt + 1, form, &msg);
+      if (strfrmt == NULL || *strfrmt == '\0' ||
+          strchr(VALIDCONV, *strfrmt) == NULL) {
+        lua_pop(L, 1);  /* remove compiled format */
+        return NULL;
+      }
+      item->conv = *strfrmt++;
+      item->len = (strfrmt - init) - item->init;
+      item->kind = FI_GENERIC;
+      if (form[2] == '\0') {  /* no modifiers? */
+        switch (item->conv) {
+          case 's': item->kind = FI_STRING; break;
+          case 'd': case 'i': item->kind = FI_DEC; break;
+          case 'x': item->kind = FI_HEX; break;
+          case 'X': item->kind = FI_HEXUP; break;
+        }
+      }
+    }
+  }
+  lua_assert(cf->nitems <= maxitems);
+  return cf;
+}
+
+
+/*
+** Add integer 'n' in base 10 or 16 (as an unsigned value, like
+** '%x' does) to buffer 'b'.
+*/
+static void addint (luaL_Buffer *b, lua_Integer n, int kind) {
+  static const char lowdigits[] = "0123456789abcdef";
+  static const char updigits[] = "0123456789ABCDEF";
+  char temp[MAXINTDIGITS];
+  char *p = temp + MAXINTDIGITS;
+  lua_Unsigned u = (lua_Unsigned)n;
+  if (kind == FI_DEC) {
+    if (n < 0) u = 0u - u;
+    do { *--p = (char)('0' + (u % 10)); u /= 10; } while (u != 0);
+    if (n < 0) *--p = '-';
+  }
+  else {
+    const char *digits = (kind == FI_HEX) ? lowdigits : updigits;
+    do { *--p = digits[u & 0xf]; u >>= 4; } while (u != 0);
+  }
+  luaL_addlstring(b, p, (temp + MAXINTDIGITS) - p);
+}
+
+
+/*
+** Check whether strings have a '__tostring' metamethod (which
+** 'luaL_tolstring' would have to call).
+*/
+static int strhastostring (lua_State *L) {
+  int res;
+  if (!lua_getmetatable(L, 1))  /* format string's metatable */
+    return 0;
+  res = (lua_getfield(L, -1, "__tostring") != LUA_TNIL);
+  lua_pop(L, 2);
+  return res;
+}
+
+
+static void runformat (lua_State *L, luaL_Buffer *b, const CompiledFormat *cf,
+                       const char *strfrmt, int top) {
+  int arg = 1;
+  int strtostring = -1;  /* unknown yet */
+  int i;
+  for (i = 0; i < cf->nitems; i++) {
+    const FormatItem *item = &cf->items[i];
+    if (item->kind == FI_LITERAL) {
+      luaL_addlstring(b, strfrmt + item->init, item->len);
+      continue;
+    }
+    if (++arg > top)
+      luaL_argerror(L, arg, "no value");
+    switch (item->kind) {
+      case FI_STRING: {
+        if (lua_type(L, arg) == LUA_TSTRING) {
+          if (strtostring < 0) strtostring = strhastostring(L);
+          if (!strtostring) {
+            size_t l;
+            const char *s = lua_tolstring(L, arg, &l);
+            luaL_addlstring(b, s, l);
+            break;
+          }
+        }
+        goto generic;
+      }
+      case FI_DEC: case FI_HEX: case FI_HEXUP: {
+        int isnum;
+        lua_Integer n = lua_tointegerx(L, arg, &isnum);
+        if (!isnum) goto generic;  /* let 'addformat' raise the error */
+        addint(b, n, item->kind);
+        break;
+      }
+      default: generic: {
+        char form[MAX_FORMAT];  /* '%', specification, and room for
+                                   a length modifier */
+        form[0] = L_ESC;
+        memcpy(form + 1, strfrmt + item->init, item->len);
+        form[item->len + 1] = '\0';
+        addformat(L, b, arg, form, uchar(item->conv));
+        break;
+      }
+    }
+  }
+}
+
+/* }------------------------------------------------------ */
+
+
+/*
+** Choose the cache slot for a new format: the next free one or, when
+** the cache is full, a random one for about one in FMTADMIT formats (0
+** for the others). Random replacement keeps most of the cache useful
+** when a program cycles through more formats than it holds, where
+** replacing the least recently used entry would miss at every call;
+** admitting only some formats keeps each miss almost as cheap as
+** interpreting the format.
+*/
+static lua_Integer cacheslot (lua_State *L) {
+  lua_Integer n = lua_tointeger(L, lua_upvalueindex(2));
+  unsigned int x;
+  if (n < LUA_MAXFMTCACHE)
+    return n + 1;
+  x = (unsigned int)lua_tointeger(L, lua_upvalueindex(3));
+  x = x * 1103515245u + 12345u;  /* linear congruential step */
+  lua_pushinteger(L, (lua_Integer)x);
+  lua_replace(L, lua_upvalueindex(3));
+  x >>= 8;  /* low bits have short periods */
+  if (x % FMTADMIT != 0)
+    return 0;
+  return (lua_Integer)((x / FMTADMIT) % LUA_MAXFMTCACHE) + 1;
+}
+
+
 static int str_format (lua_State *L) {
   int top = lua_gettop(L);
   int arg = 1;
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
+  const CompiledFormat *cf;
   luaL_Buffer b;
+  lua_pushvalue(L, 1);
+  if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TUSERDATA)  /* cached? */
+    cf = (const CompiledFormat *)lua_touserdata(L, -1);
+  else {
+    lua_Integer slot;
+    lua_pop(L, 1);
+    slot = cacheslot(L);
+    cf = (slot > 0) ? compileformat(L, strfrmt, sfl) : NULL;
+    if (cf != NULL) {  /* valid format to be cached? */
+      if (slot <= lua_tointeger(L, lua_upvalueindex(2))) {  /* in use? */
+        lua_rawgeti(L, lua_upvalueindex(1), slot);
+        lua_pushnil(L);
+        lua_rawset(L, lua_upvalueindex(1));  /* cache[cache[slot]] = nil */
+      }
+      else {
+        lua_pushinteger(L, slot);
+        lua_replace(L, lua_upvalueindex(2));  /* count new entry */
+      }
+      lua_pushvalue(L, 1);
+      lua_rawseti(L, lua_upvalueindex(1), slot);  /* cache[slot] = strfrmt */
+      lua_pushvalue(L, 1);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, lua_upvalueindex(1));  /* cache[strfrmt] = cf */
+    }
+  }
   luaL_buffinit(L, &b);
+  if (cf != NULL) {
+    runformat(L, &b, cf, strfrmt, top);
+    luaL_pushresult(&b);
+    return 1;
+  }
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
       luaL_addchar(&b, *strfrmt++);
@@ -1028,64 +1660,10 @@ static int str_format (lua_State *L) {
       luaL_addchar(&b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format ('%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
-      int nb = 0;  /* number of bytes in added item */
       if (++arg > top)
         luaL_argerror(L, arg, "no value");
       strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          nb = l_sprintf(buff, MAX_ITEM, form, (int)luaL_checkinteger(L, arg));
-          break;
-        }
-        case 'd': case 'i':
-        case 'o': case 'u': case 'x': case 'X': {
-          lua_Integer n = luaL_checkinteger(L, arg);
-          addlenmod(form, LUA_INTEGER_FRMLEN);
-          nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACINT)n);
-          break;
-        }
-        case 'a': case 'A':
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = lua_number2strx(L, buff, MAX_ITEM, form,
-                                  luaL_checknumber(L, arg));
-          break;
-        case 'e': case 'E': case 'f':
-        case 'g': case 'G': {
-          lua_Number n = luaL_checknumber(L, arg);
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACNUMBER)n);
-          break;
-        }
-        case 'q': {
-          addliteral(L, &b, arg);
-          break;
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_tolstring(L, arg, &l);
-          if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
-          else {
-            luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
-            if (!strchr(form, '.') && l >= 100) {
-              /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
-            }
-            else {  /* format the string into 'buff' */
-              nb = l_sprintf(buff, MAX_ITEM, form, s);
-              lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
-            }
-          }
-          break;
-        }
-        default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid option '%%%c' to 'format'",
-                               *(strfrmt - 1));
-        }
-      }
-      lua_assert(nb < MAX_ITEM);
-      luaL_addsize(&b, nb);
+      addformat(L, &b, arg, form, uchar(*strfrmt++));
     }
   }
   luaL_pushresult(&b);
@@ -1544,14 +2122,17 @@ static const luaL_Reg strlib[] = {
   {"char", str_char},
   {"dump", str_dump},
   {"find", str_find},
-  {"format", str_format},
+  {"format", NULL},  /* placeholder */
   {"gmatch", gmatch},
   {"gsub", str_gsub},
+  {"join", str_join},
   {"len", str_len},
   {"lower", str_lower},
   {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
+  {"split", str_split},
+  {"splitinto", str_splitinto},
   {"sub", str_sub},
   {"upper", str_upper},
   {"pack", str_pack},
@@ -1578,6 +2159,11 @@ static void createmetatable (lua_State *L) {
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, strlib);
+  lua_newtable(L);  /* cache of compiled formats */
+  lua_pushinteger(L, 0);  /* number of entries in the cache */
+  lua_pushinteger(L, 0);  /* state for choosing entries to replace */
+  lua_pushcclosure(L, str_format, 3);
+  lua_setfield(L, -2, "format");
   createmetatable(L);
   return 1;
 }
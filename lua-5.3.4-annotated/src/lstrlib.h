@@ -0,0 +1,23 @@
+/*
+** $Id: lstrlib.h $
+** Character classes of the string library
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lstrlib_h
+#define lstrlib_h
+
+#include "lua.h"
+
+
+#define L_ESC		'%'
+
+
+/*
+** Functions of 'lstrlib.c' shared with other libraries (such as
+** 'lpeglib.c') that accept the character classes of Lua patterns.
+*/
+LUAI_FUNC int luaI_matchclass (int c, int cl);
+LUAI_FUNC int luaI_matchbracketclass (int c, const char *p, const char *ec);
+
+#endif
@@ -21,15 +21,34 @@
 ** in its main position (i.e. the 'original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+**
+** With LUAI_COMPACTHASH, the hash part is instead an array of entries,
+** filled in insertion order and sized to fit the keys, followed by an
+** index with 2^lsizenode slots. Each slot holds 1 plus the position of
+** the first entry whose key hashes to it (0 if none), in as few bytes
+** as the number of entries allows; entries with the same slot are
+** chained through their 'next' fields. Removed entries stay in place
+** (and in their chains) until the next rehash, which drops them.
 */
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
+
+#if !defined(LUA_USE_SORTTHREADS) && \
+    (defined(LUA_USE_LINUX) || defined(LUA_USE_MACOSX))
+#define LUA_USE_SORTTHREADS
+#endif
+
+#if defined(LUA_USE_SORTTHREADS)
+#include <pthread.h>
+#endif
 
 #include "lua.h"
 
 #include "ldebug.h"
 #include "ldo.h"
+#include "lfunc.h"
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
@@ -55,10 +74,23 @@
 #define MAXHBITS	(MAXABITS - 1)
 
 
-#define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
+/*
+** Hashes select a slot: a node of the power-of-2 node array or, in the
+** compact layout, a slot of the index, whose chain starts at the node
+** given by 'slotnode'.
+*/
+#if defined(LUAI_COMPACTHASH)
+#define sizeslots(t)		twoto((t)->lsizenode)
+#define slotnode(t,s)		headnode(t, s)
+#else
+#define sizeslots(t)		sizenode(t)
+#define slotnode(t,s)		gnode(t, s)
+#endif
+
+#define slotpow2(t,n)		lmod((n), sizeslots(t))
+#define hashpow2(t,n)		slotnode(t, slotpow2(t, n))
 
 #define hashstr(t,str)		hashpow2(t, (str)->hash)
-#define hashboolean(t,p)	hashpow2(t, p)
 #define hashint(t,i)		hashpow2(t, i)
 
 
@@ -66,10 +98,10 @@
 ** for some types, it is better to avoid modulus by power of 2, as
 ** they tend to have many 2 factors.
 */
-#define hashmod(t,n)	(gnode(t, ((n) % ((sizenode(t)-1)|1))))
+#define slotmod(t,n)	((n) % ((sizeslots(t)-1)|1))
 
 
-#define hashpointer(t,p)	hashmod(t, point2uint(p))
+#define slotpointer(t,p)	slotmod(t, point2uint(p))
 
 
 #define dummynode		(&dummynode_)
@@ -80,6 +112,44 @@ static const Node dummynode_ = {
 };
 
 
+#if defined(LUAI_COMPACTHASH)
+
+/* address of the index, after the entries */
+#define gindex(t)	cast(void *, (t)->node + (t)->sizenodes)
+
+
+/*
+** returns the first entry in the chain of slot 's', or 'dummynode'
+** (whose key matches nothing and which ends the chain) if there is none
+*/
+static Node *headnode (const Table *t, int s) {
+  unsigned int size = t->sizenodes;
+  unsigned int e;  /* 1 + position of the entry */
+  if (size <= UCHAR_MAX)
+    e = (size == 0) ? 0 : cast(const lu_byte *, gindex(t))[s];
+  else if (size <= USHRT_MAX)
+    e = cast(const unsigned short *, gindex(t))[s];
+  else
+    e = cast(const unsigned int *, gindex(t))[s];
+  return (e == 0) ? cast(Node *, dummynode) : gnode(t, e - 1);
+}
+
+
+/* makes node 'n' the first entry in the chain of slot 's' */
+static void sethead (Table *t, int s, const Node *n) {
+  unsigned int size = t->sizenodes;
+  unsigned int e = cast(unsigned int, n - gnode(t, 0)) + 1;
+  if (size <= UCHAR_MAX)
+    cast(lu_byte *, gindex(t))[s] = cast_byte(e);
+  else if (size <= USHRT_MAX)
+    cast(unsigned short *, gindex(t))[s] = cast(unsigned short, e);
+  else
+    cast(unsigned int *, gindex(t))[s] = e;
+}
+
+#endif
+
+
 /*
 ** Hash for floating-point numbers.
 ** The main computation should be just
@@ -111,32 +181,38 @@ static int l_hashfloat (lua_Number n) {
 
 
 /*
-** returns the 'main' position of an element in a table (that is, the index
-** of its hash value)
+** returns the slot of the hash value of an element in a table
 */
-static Node *mainposition (const Table *t, const TValue *key) {
+static int mainslot (const Table *t, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TNUMINT:
-      return hashint(t, ivalue(key));
+      return slotpow2(t, ivalue(key));
     case LUA_TNUMFLT:
-      return hashmod(t, l_hashfloat(fltvalue(key)));
+      return slotmod(t, l_hashfloat(fltvalue(key)));
     case LUA_TSHRSTR:
-      return hashstr(t, tsvalue(key));
+      return slotpow2(t, tsvalue(key)->hash);
     case LUA_TLNGSTR:
-      return hashpow2(t, luaS_hashlongstr(tsvalue(key)));
+      return slotpow2(t, luaS_hashlongstr(tsvalue(key)));
     case LUA_TBOOLEAN:
-      return hashboolean(t, bvalue(key));
+      return slotpow2(t, bvalue(key));
     case LUA_TLIGHTUSERDATA:
-      return hashpointer(t, pvalue(key));
+      return slotpointer(t, pvalue(key));
     case LUA_TLCF:
-      return hashpointer(t, fvalue(key));
+      return slotpointer(t, fvalue(key));
     default:
       lua_assert(!ttisdeadkey(key));
-      return hashpointer(t, gcvalue(key));
+      return slotpointer(t, gcvalue(key));
   }
 }
 
 
+/*
+** returns the 'main' position of an element in a table (that is, the index
+** of its hash value; in the compact layout, the start of its chain)
+*/
+#define mainposition(t,key)	slotnode(t, mainslot(t, key))
+
+
 /*
 ** returns the index for 'key' if 'key' is an appropriate key to live in
 ** the array part of the table, 0 otherwise.
@@ -151,6 +227,17 @@ static unsigned int arrayindex (const TValue *key) {
 }
 
 
+/*
+** check whether key 'k' of a node is the key 'key' of a traversal
+*/
+static int istraversalkey (const TValue *k, const TValue *key) {
+  /* key may be dead already, but it is ok to use it in 'next' */
+  return (luaV_rawequalobj(k, key) ||
+          (ttisdeadkey(k) && iscollectable(key) &&
+           deadvalue(k) == gcvalue(key)));
+}
+
+
 /*
 ** returns the index of a 'key' for table traversals. First goes all
 ** elements in the array part, then elements in the hash part. The
@@ -166,10 +253,7 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
     int nx;
     Node *n = mainposition(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
-      /* key may be dead already, but it is ok to use it in 'next' */
-      if (luaV_rawequalobj(gkey(n), key) ||
-            (ttisdeadkey(gkey(n)) && iscollectable(key) &&
-             deadvalue(gkey(n)) == gcvalue(key))) {
+      if (istraversalkey(gkey(n), key)) {
         i = cast_int(n - gnode(t, 0));  /* key index in hash table */
         /* hash elements are numbered after array ones */
         return (i + 1) + t->sizearray;
@@ -183,26 +267,71 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
 }
 
 
-int luaH_next (lua_State *L, Table *t, StkId key) {
-  unsigned int i = findindex(L, t, key);  /* find original element */
+/*
+** check whether 'i' is still the index (as given by 'findindex') of
+** 'key', so that a traversal can resume there without searching for it
+*/
+static int isindexof (const Table *t, lua_Integer i, const TValue *key) {
+  if (i <= 0)
+    return (i == 0 && ttisnil(key));
+  else if (l_castS2U(i) <= t->sizearray)
+    return (ttisinteger(key) && ivalue(key) == i);
+  else if (l_castS2U(i) - t->sizearray <= cast(lua_Unsigned, sizenode(t)))
+    return (!ttisnil(key) &&
+            istraversalkey(gkey(gnode(t, i - t->sizearray - 1)), key));
+  else
+    return 0;
+}
+
+
+/*
+** puts into 'key' and 'key+1' the first element with index 'i' or
+** after it (counting as in 'findindex') and returns the index of that
+** element; returns 0 if there are no more elements
+*/
+static unsigned int nextfrom (lua_State *L, Table *t, unsigned int i,
+                              StkId key) {
   for (; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
       setivalue(key, i + 1);
       setobj2s(L, key+1, &t->array[i]);
-      return 1;
+      return i + 1;
     }
   }
   for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
       setobj2s(L, key, gkey(gnode(t, i)));
       setobj2s(L, key+1, gval(gnode(t, i)));
-      return 1;
+      return (i + 1) + t->sizearray;
     }
   }
   return 0;  /* no more elements */
 }
 
 
+int luaH_next (lua_State *L, Table *t, StkId key) {
+  return (nextfrom(L, t, findindex(L, t, key), key) != 0);
+}
+
+
+/*
+** 'luaH_next' for a traversal that keeps in 'cursor' the index of its
+** current key (as an integer). While the cursor is still valid, the
+** traversal resumes there instead of looking up 'key' again, so each
+** step costs O(1) for hash keys too.
+*/
+int luaH_nextcursor (lua_State *L, Table *t, StkId key, TValue *cursor) {
+  unsigned int i;
+  if (ttisinteger(cursor) && isindexof(t, ivalue(cursor), key))
+    i = cast(unsigned int, ivalue(cursor));
+  else
+    i = findindex(L, t, key);
+  i = nextfrom(L, t, i, key);
+  setivalue(cursor, i);
+  return (i != 0);
+}
+
+
 /*
 ** {=============================================================
 ** Rehash
@@ -305,6 +434,49 @@ static void setarrayvector (lua_State *L, Table *t, unsigned int size) {
 }
 
 
+#if defined(LUAI_COMPACTHASH)
+
+/* empties all entries of the hash part of 't' and its index */
+static void clearnodes (Table *t) {
+  int i;
+  for (i = 0; i < sizenode(t); i++) {
+    Node *n = gnode(t, i);
+    gnext(n) = 0;
+    setnilvalue(wgkey(n));
+    setnilvalue(gval(n));
+  }
+  memset(gindex(t), 0, twoto(t->lsizenode) * indexwidth(t->sizenodes));
+  t->firstfree = 0;  /* all entries are free */
+}
+
+
+/*
+** The compact layout keeps exactly 'size' entries, in one block with
+** an index of at least as many slots.
+*/
+static void setnodevector (lua_State *L, Table *t, unsigned int size) {
+  if (size == 0) {  /* no elements to hash part? */
+    t->node = cast(Node *, dummynode);  /* use common 'dummynode' */
+    t->lsizenode = 0;
+    t->sizenodes = 0;  /* signal that it is using dummy node */
+    t->firstfree = 0;
+  }
+  else {
+    int lsize = luaO_ceillog2(size);
+    if (lsize > MAXHBITS)
+      luaG_runerror(L, "table overflow");
+    if (size > (MAX_SIZET - twoto(lsize) * sizeof(unsigned int)) /
+               sizeof(Node))
+      luaM_toobig(L);
+    t->node = cast(Node *, luaM_malloc(L, sizenodebytes(size, lsize)));
+    t->lsizenode = cast_byte(lsize);
+    t->sizenodes = size;
+    clearnodes(t);
+  }
+}
+
+#else
+
 static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   if (size == 0) {  /* no elements to hash part? */
     t->node = cast(Node *, dummynode);  /* use common 'dummynode' */
@@ -329,6 +501,8 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   }
 }
 
+#endif
+
 
 void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                           unsigned int nhsize) {
@@ -336,6 +510,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
   int j;
   unsigned int oldasize = t->sizearray;
   int oldhsize = allocsizenode(t);
+  size_t oldbytes = allocnodebytes(t);
   Node *nold = t->node;  /* save old hash ... */
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
@@ -352,7 +527,11 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     luaM_reallocvector(L, t->array, oldasize, nasize, TValue);
   }
   /* re-insert elements from hash part */
+#if defined(LUAI_COMPACTHASH)
+  for (j = 0; j < oldhsize; j++) {  /* in order, to keep insertion order */
+#else
   for (j = oldhsize - 1; j >= 0; j--) {
+#endif
     Node *old = nold + j;
     if (!ttisnil(gval(old))) {
       /* doesn't need barrier/invalidate cache, as entry was
@@ -361,7 +540,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     }
   }
   if (oldhsize > 0)  /* not the dummy node? */
-    luaM_freearray(L, nold, cast(size_t, oldhsize)); /* free old hash */
+    luaM_freemem(L, nold, oldbytes); /* free old hash */
 }
 
 
@@ -370,6 +549,17 @@ void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
   luaH_resize(L, t, nasize, nsize);
 }
 
+/*
+** size for a hash part that must hold 'n' keys and grow; the compact
+** layout leaves room to grow by a half, as it does no power-of-2
+** rounding
+*/
+#if defined(LUAI_COMPACTHASH)
+#define growsize(n)	((n) + (n) / 2)
+#else
+#define growsize(n)	(n)
+#endif
+
 /*
 ** nums[i] = number of keys 'k' where 2^(i - 1) < k <= 2^i
 */
@@ -389,7 +579,12 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   /* compute new size for array part */
   asize = computesizes(nums, &na);
   /* resize the table to new computed sizes */
-  luaH_resize(L, t, asize, totaluse - na);
+  luaH_resize(L, t, asize, growsize(totaluse - na));
+  if (t->hint != NULL) {  /* let its allocation site know how it grows */
+    SizeHint *h = t->hint;
+    if (h->narray < asize) h->narray = asize;
+    if (h->nhash < totaluse - na) h->nhash = totaluse - na;
+  }
 }
 
 
@@ -406,19 +601,58 @@ Table *luaH_new (lua_State *L) {
   t->flags = cast_byte(~0);
   t->array = NULL;
   t->sizearray = 0;
+  t->hint = NULL;
   setnodevector(L, t, 0);
   return t;
 }
 
 
+/*
+** Feedback for the allocation site of a table: 'rehash' raises the
+** sizes in its hint to the sizes the table grows to, while the
+** collector, when it traverses or frees the table, lowers them to the
+** sizes the table uses (its last non-nil array index, found from the
+** end of the array, and its 'nhash' entries in the hash part). So, a
+** few large tables cannot make a site presize all its tables too much
+** for more than a collection cycle.
+*/
+void luaH_usedsizes (Table *t, unsigned int nhash) {
+  SizeHint *h = t->hint;
+  unsigned int na = (t->sizearray < h->narray) ? t->sizearray : h->narray;
+  while (na > 0 && ttisnil(&t->array[na - 1]))
+    na--;
+  h->narray = na;
+  if (nhash < h->nhash) h->nhash = nhash;
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
+  if (t->hint != NULL) {
+    unsigned int nh = 0;
+    int i;
+    for (i = 0; i < allocsizenode(t); i++)
+      if (!ttisnil(gval(gnode(t, i)))) nh++;
+    luaH_usedsizes(t, nh);
+    luaF_freehint(L, t->hint);
+  }
   if (!isdummy(t))
-    luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
+    luaM_freemem(L, t->node, allocnodebytes(t));
   luaM_freearray(L, t->array, t->sizearray);
   luaM_free(L, t);
 }
 
 
+#if defined(LUAI_COMPACTHASH)
+
+/* new keys go to the first entry never used */
+static Node *getfreepos (Table *t) {
+  if (t->firstfree < t->sizenodes)
+    return gnode(t, t->firstfree++);
+  return NULL;  /* could not find a free place */
+}
+
+#else
+
 static Node *getfreepos (Table *t) {
   if (!isdummy(t)) {
     while (t->lastfree > t->node) {
@@ -430,6 +664,8 @@ static Node *getfreepos (Table *t) {
   return NULL;  /* could not find a free place */
 }
 
+#endif
+
 
 
 /*
@@ -452,6 +688,23 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
     else if (luai_numisnan(fltvalue(key)))
       luaG_runerror(L, "table index is NaN");
   }
+#if defined(LUAI_COMPACTHASH)
+  {  /* append the key and make it the first in its chain */
+    int s;
+    Node *f = getfreepos(t);
+    if (f == NULL) {  /* no more entries? */
+      rehash(L, t, key);  /* grow table */
+      /* whatever called 'newkey' takes care of TM cache */
+      return luaH_set(L, t, key);  /* insert key into grown table */
+    }
+    s = mainslot(t, key);
+    mp = headnode(t, s);
+    if (mp != dummynode)  /* slot already has a chain? */
+      gnext(f) = cast_int(mp - f);
+    sethead(t, s, f);
+    mp = f;
+  }
+#else
   mp = mainposition(t, key);
   if (!ttisnil(gval(mp)) || isdummy(t)) {  /* main position is taken? */
     Node *othern;
@@ -484,6 +737,7 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       mp = f;
     }
   }
+#endif
   setnodekey(L, &mp->i_key, key);
   luaC_barrierback(L, t, key);
   lua_assert(ttisnil(gval(mp)));
@@ -657,6 +911,373 @@ int luaH_getn (Table *t) {
 }
 
 
+/*
+** Removes all entries of a table but keeps its array and hash parts, so
+** that filling it again up to the same sizes allocates nothing. (As
+** with any insertion, a traversal of the table cannot go on after it.)
+*/
+void luaH_clear (Table *t) {
+  unsigned int i;
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  if (!isdummy(t)) {
+#if defined(LUAI_COMPACTHASH)
+    clearnodes(t);
+#else
+    int size = sizenode(t);
+    int j;
+    for (j = 0; j < size; j++) {
+      Node *n = gnode(t, j);
+      gnext(n) = 0;
+      setnilvalue(wgkey(n));
+      setnilvalue(gval(n));
+    }
+    t->lastfree = gnode(t, size);  /* all positions are free again */
+#endif
+  }
+  invalidateTMcache(t);  /* it may have lost metamethods */
+}
+
+
+/*
+** Makes the new table 't' a copy of 'src', with the same sizes and the
+** same layout, so that it also has the same traversal order. As 't' is
+** new (white), copying values into it needs no barrier. 'src' may have
+** metamethod names among its keys.
+*/
+void luaH_copy (lua_State *L, Table *t, const Table *src) {
+  luaH_resize(L, t, src->sizearray, allocsizenode(src));
+  if (src->sizearray > 0)
+    memcpy(t->array, src->array, src->sizearray * sizeof(TValue));
+  if (!isdummy(src)) {
+    memcpy(t->node, src->node, allocnodebytes(src));
+#if defined(LUAI_COMPACTHASH)
+    t->firstfree = src->firstfree;
+#else
+    t->lastfree = t->node + (src->lastfree - src->node);
+#endif
+  }
+  invalidateTMcache(t);
+}
+
+
+/*
+** Copies 'src[f..e]' into 'dst[t..]' (the tables may be the same and
+** the ranges may overlap), with the result of the corresponding raw
+** assignments, if both ranges are in the array parts of the tables.
+** Returns 0, without touching the tables, otherwise.
+*/
+int luaH_move (lua_State *L, Table *src, lua_Integer f, lua_Integer e,
+                             lua_Integer t, Table *dst) {
+  lua_Unsigned n;  /* number of elements minus 1 */
+  if (e < f) return 1;  /* nothing to move */
+  n = l_castS2U(e) - l_castS2U(f);
+  if (f < 1 || l_castS2U(e) > src->sizearray ||
+      t < 1 || n >= dst->sizearray ||
+      l_castS2U(t - 1) >= dst->sizearray - n)
+    return 0;
+  memmove(dst->array + (t - 1), src->array + (f - 1),
+          cast(size_t, n + 1) * sizeof(TValue));
+  if (src != dst && isblack(dst))  /* may have new white values? */
+    luaC_barrierback_(L, dst);
+  return 1;
+}
+
+
+static void joinrange (const TValue *v, const TValue *last,
+                       const char *sep, size_t lsep, char *p) {
+  char buff[MAXNUMBER2STR];
+  for (;; v++) {
+    if (ttisstring(v)) {
+      memcpy(p, svalue(v), vslen(v));
+      p += vslen(v);
+    }
+    else {
+      size_t l = luaO_tostringbuff(v, buff);
+      memcpy(p, buff, l);
+      p += l;
+    }
+    if (v == last) return;
+    memcpy(p, sep, lsep);
+    p += lsep;
+  }
+}
+
+
+/*
+** Joins 't[i..j]', separated by 'sep', into a new string, if these
+** elements are all strings or numbers in the array part. A first pass
+** computes the exact length of the result (formatting numbers into a
+** scratch buffer), so the result is allocated once and filled in by a
+** second pass. Returns NULL, without allocating anything, otherwise.
+*/
+TString *luaH_concat (lua_State *L, Table *t, lua_Integer i, lua_Integer j,
+                                    const char *sep, size_t lsep) {
+  char buff[MAXNUMBER2STR];
+  const TValue *v, *first, *last;
+  size_t len = 0;
+  TString *ts;
+  if (i > j) return luaS_newliteral(L, "");
+  if (i < 1 || l_castS2U(j) > t->sizearray) return NULL;
+  first = &t->array[i - 1];
+  last = &t->array[j - 1];
+  for (v = first; v <= last; v++) {
+    size_t l;
+    if (ttisstring(v)) l = vslen(v);
+    else if (ttisnumber(v)) l = luaO_tostringbuff(v, buff);
+    else return NULL;  /* caller must raise the error */
+    if (l >= MAX_SIZE - len) return NULL;  /* result too long */
+    len += l;
+    if (v < last) {
+      if (lsep >= MAX_SIZE - len) return NULL;
+      len += lsep;
+    }
+  }
+  if (len <= LUAI_MAXSHORTLEN) {  /* short string? */
+    char sbuff[LUAI_MAXSHORTLEN];
+    joinrange(first, last, sep, lsep, sbuff);
+    return luaS_newlstr(L, sbuff, len);  /* must be internalized */
+  }
+  ts = luaS_createlngstrobj(L, len);
+  joinrange(first, last, sep, lsep, getstr(ts));
+  return ts;
+}
+
+
+/*
+** {======================================================
+** Sorting the array part
+** =======================================================
+*/
+
+/* kinds of arrays that can be sorted directly */
+#define SORTINT		0	/* all integers */
+#define SORTFLT		1	/* all floats */
+#define SORTANY		2	/* mixed numbers or all strings */
+
+/* ranges not larger than this are sorted by insertion */
+#define SORTSMALL	16
+
+/* ranges smaller than this are not split among threads */
+#if !defined(LUAI_MINPARSORT)
+#define LUAI_MINPARSORT	(1 << 16)
+#endif
+
+/* maximum number of threads used by a sort */
+#if !defined(LUAI_MAXSORTTHREADS)
+#define LUAI_MAXSORTTHREADS	64
+#endif
+
+
+static int sortlt (lua_State *L, int kind, const TValue *a,
+                                            const TValue *b) {
+  switch (kind) {
+    case SORTINT: return ivalue(a) < ivalue(b);
+    case SORTFLT: return luai_numlt(fltvalue(a), fltvalue(b));
+    default: return luaV_lessthan(L, a, b);  /* cannot raise errors */
+  }
+}
+
+
+#define swapTV(L,a,b) \
+  { TValue t_; setobj(L, &t_, a); setobj2t(L, a, b); setobj2t(L, b, &t_); }
+
+
+static void insertionsort (lua_State *L, int kind, TValue *lo, TValue *hi) {
+  TValue *p;
+  for (p = lo + 1; p < hi; p++) {
+    TValue v;
+    TValue *q = p;
+    setobj(L, &v, p);
+    for (; q > lo && sortlt(L, kind, &v, q - 1); q--)
+      setobj2t(L, q, q - 1);
+    setobj2t(L, q, &v);
+  }
+}
+
+
+static void siftdown (lua_State *L, int kind, TValue *a, size_t i,
+                                                         size_t n) {
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && sortlt(L, kind, &a[c], &a[c + 1])) c++;
+    if (!sortlt(L, kind, &a[i], &a[c])) break;
+    swapTV(L, &a[i], &a[c]);
+    i = c;
+  }
+}
+
+
+/* fallback for ranges where quicksort goes quadratic */
+static void heapsort (lua_State *L, int kind, TValue *a, size_t n) {
+  size_t i;
+  for (i = n / 2; i > 0; i--)
+    siftdown(L, kind, a, i - 1, n);
+  for (i = n - 1; i > 0; i--) {
+    swapTV(L, &a[0], &a[i]);
+    siftdown(L, kind, a, 0, i);
+  }
+}
+
+
+/*
+** Hoare partition of [lo, hi) around the median of its first, middle,
+** and last elements, which also act as sentinels for the inner loops.
+** Returns 'p' such that [lo, p) <= pivot <= [p, hi), with both parts
+** non empty.
+*/
+static TValue *partition (lua_State *L, int kind, TValue *lo, TValue *hi) {
+  TValue *mid = lo + (hi - lo) / 2;
+  TValue *i = lo;
+  TValue *j = hi - 1;
+  TValue pivot;
+  if (sortlt(L, kind, mid, lo)) swapTV(L, mid, lo);
+  if (sortlt(L, kind, j, mid)) {
+    swapTV(L, j, mid);
+    if (sortlt(L, kind, mid, lo)) swapTV(L, mid, lo);
+  }
+  setobj(L, &pivot, mid);
+  for (;;) {
+    while (sortlt(L, kind, ++i, &pivot)) ;
+    while (sortlt(L, kind, &pivot, --j)) ;
+    if (i >= j) return j + 1;
+    swapTV(L, i, j);
+  }
+}
+
+
+/*
+** Introsort: quicksort on the larger part in a loop, recursion on the
+** smaller one, heapsort when 'depth' runs out.
+*/
+static void sortrange (lua_State *L, int kind, TValue *lo, TValue *hi,
+                                               int depth) {
+  while (hi - lo > SORTSMALL) {
+    TValue *p;
+    if (depth-- == 0) {
+      heapsort(L, kind, lo, hi - lo);
+      return;
+    }
+    p = partition(L, kind, lo, hi);
+    if (p - lo < hi - p) {
+      sortrange(L, kind, lo, p, depth);
+      lo = p;
+    }
+    else {
+      sortrange(L, kind, p, hi, depth);
+      hi = p;
+    }
+  }
+  insertionsort(L, kind, lo, hi);
+}
+
+
+/* a range to be sorted by up to 'nthreads' threads */
+typedef struct SortJob {
+  lua_State *L;
+  int kind;
+  int depth;
+  int nthreads;
+  TValue *lo, *hi;
+} SortJob;
+
+
+#if defined(LUA_USE_SORTTHREADS)
+
+static void sortpar (SortJob *j);
+
+static void *sortworker (void *ud) {
+  sortpar((SortJob *)ud);
+  return NULL;
+}
+
+#endif
+
+
+/*
+** Does the first steps of 'sortrange' on a range, but sorts the two
+** parts of each partition in parallel, giving each part a share of the
+** threads proportional to its size, until a part gets a single thread
+** or is too small. As the parts are disjoint and sorted by the same
+** steps, the result is exactly the one of 'sortrange'. Workers only
+** read and move values of the array: they neither allocate memory nor
+** touch the Lua state, and the caller waits for all of them. If it
+** cannot create a thread, it sorts that part itself.
+*/
+static void sortpar (SortJob *j) {
+#if defined(LUA_USE_SORTTHREADS)
+  if (j->nthreads > 1 && j->hi - j->lo >= LUAI_MINPARSORT && j->depth > 0) {
+    ptrdiff_t n = j->hi - j->lo;
+    SortJob right = *j;
+    pthread_t th;
+    int nl;
+    TValue *p = partition(j->L, j->kind, j->lo, j->hi);
+    right.depth = --j->depth;
+    /* share of the left part (a 'double' avoids overflows in the product) */
+    nl = (int)((double)(p - j->lo) / (double)n * j->nthreads + 0.5);
+    if (nl < 1) nl = 1;
+    else if (nl > j->nthreads - 1) nl = j->nthreads - 1;
+    right.lo = j->hi = p;
+    right.nthreads = j->nthreads - nl;
+    j->nthreads = nl;
+    if (pthread_create(&th, NULL, sortworker, &right) != 0) {
+      sortpar(j);
+      sortpar(&right);
+    }
+    else {
+      sortpar(j);
+      pthread_join(th, NULL);
+    }
+    return;
+  }
+#endif
+  sortrange(j->L, j->kind, j->lo, j->hi, j->depth);
+}
+
+
+/*
+** Sorts 't[1..n]' in place with the order of '<', if all these elements
+** are in the array part and are all numbers (none a NaN) or all
+** strings; then, comparisons cannot call metamethods or raise errors,
+** and the sort neither allocates memory nor changes the set of values
+** in the table (so it needs no barrier). Returns 0, without touching
+** the table, otherwise. Large arrays are sorted by up to 'nthreads'
+** threads, with the same result.
+*/
+int luaH_sort (lua_State *L, Table *t, lua_Integer n, int nthreads) {
+  TValue *a = t->array;
+  SortJob j;
+  int kind;
+  int depth = 0;
+  lua_Integer i;
+  if (n < 2) return 1;
+  if (l_castS2U(n) > t->sizearray) return 0;
+  if (ttisstring(&a[0])) {
+    for (i = 1; i < n; i++)
+      if (!ttisstring(&a[i])) return 0;
+    kind = SORTANY;
+  }
+  else {
+    lua_Integer nint = 0;
+    for (i = 0; i < n; i++) {
+      if (ttisinteger(&a[i])) nint++;
+      else if (!ttisfloat(&a[i]) || luai_numisnan(fltvalue(&a[i])))
+        return 0;
+    }
+    kind = (nint == n) ? SORTINT : (nint == 0) ? SORTFLT : SORTANY;
+  }
+  for (i = n; i > 1; i >>= 1) depth += 2;  /* 2 * log2(n) */
+  if (nthreads > LUAI_MAXSORTTHREADS)
+    nthreads = LUAI_MAXSORTTHREADS;
+  j.L = L; j.kind = kind; j.depth = depth; j.nthreads = nthreads;
+  j.lo = a; j.hi = a + n;
+  sortpar(&j);
+  return 1;
+}
+
+/* }====================================================== */
+
 
 #if defined(LUA_DEBUG)
 
@@ -28,13 +28,38 @@
 
 
 /* true when 't' is using 'dummynode' as its hash part */
+#if defined(LUAI_COMPACTHASH)
+#define isdummy(t)		((t)->sizenodes == 0)
+#else
 #define isdummy(t)		((t)->lastfree == NULL)
+#endif
 
 
 /* allocated size for hash nodes */
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
 
+#if defined(LUAI_COMPACTHASH)
+
+/* size in bytes of each entry number in the index of 'size' entries */
+#define indexwidth(size)  \
+	((size) <= UCHAR_MAX ? 1 : (size) <= USHRT_MAX ? 2 : 4)
+
+/* size in bytes of a hash part with 'size' entries and 2^lsize slots */
+#define sizenodebytes(size,lsize)  (cast(size_t, size) * sizeof(Node) +  \
+	cast(size_t, twoto(lsize)) * indexwidth(size))
+
+/* allocated size in bytes for the hash part (entries plus index) */
+#define allocnodebytes(t)  \
+	(isdummy(t) ? 0 : sizenodebytes((t)->sizenodes, (t)->lsizenode))
+
+#else
+
+#define allocnodebytes(t)	(cast(size_t, allocsizenode(t)) * sizeof(Node))
+
+#endif
+
+
 /* returns the key, given the value of a table entry */
 #define keyfromval(v) \
   (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
@@ -53,8 +78,19 @@ LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_usedsizes (Table *t, unsigned int nhash);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
+LUAI_FUNC int luaH_nextcursor (lua_State *L, Table *t, StkId key,
+                               TValue *cursor);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC void luaH_clear (Table *t);
+LUAI_FUNC void luaH_copy (lua_State *L, Table *t, const Table *src);
+LUAI_FUNC TString *luaH_concat (lua_State *L, Table *t, lua_Integer i,
+                               lua_Integer j, const char *sep, size_t lsep);
+LUAI_FUNC int luaH_move (lua_State *L, Table *src, lua_Integer f,
+                                     lua_Integer e, lua_Integer t, Table *dst);
+LUAI_FUNC int luaH_sort (lua_State *L, Table *t, lua_Integer n,
+                                             int nthreads);
 
 
 #if defined(LUA_DEBUG)
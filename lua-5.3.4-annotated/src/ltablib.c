@@ -58,6 +58,25 @@ static void checktab (lua_State *L, int arg, int what) {
 }
 
 
+/*
+** Check whether 'arg' is a table without the metamethods for the
+** operations in 'what', so that raw accesses to it are equivalent to
+** regular ones (and elements can be moved in blocks)
+*/
+static int israw (lua_State *L, int arg, int what) {
+  int n = 1;  /* number of elements to pop */
+  int raw;
+  if (lua_type(L, arg) != LUA_TTABLE)
+    return 0;
+  if (!lua_getmetatable(L, arg))
+    return 1;  /* no metatable, no metamethods */
+  raw = (!(what & TAB_R) || !checkfield(L, "__index", ++n)) &&
+        (!(what & TAB_W) || !checkfield(L, "__newindex", ++n));
+  lua_pop(L, n);  /* pop metatable and tested metamethods */
+  return raw;
+}
+
+
 #if defined(LUA_COMPAT_MAXN)
 static int maxn (lua_State *L) {
   lua_Number max = 0;
@@ -85,10 +104,18 @@ static int tinsert (lua_State *L) {
       break;
     }
     case 3: {
-      lua_Integer i;
+      lua_Integer i = e;
       pos = luaL_checkinteger(L, 2);  /* 2nd argument is the position */
       luaL_argcheck(L, 1 <= pos && pos <= e, 2, "position out of bounds");
-      for (i = e; i > pos; i--) {  /* move up elements */
+      if (pos < e && israw(L, 1, TAB_RW)) {
+        /* first move the last element, which may grow the array part... */
+        lua_geti(L, 1, e - 1);
+        lua_seti(L, 1, e);  /* t[e] = t[e - 1] */
+        i = e - 1;
+        if (lua_rawmove(L, 1, pos, e - 2, pos + 1, 1))
+          break;  /* ...then move up the other elements in a block */
+      }
+      for (; i > pos; i--) {  /* move up elements */
         lua_geti(L, 1, i - 1);
         lua_seti(L, 1, i);  /* t[i] = t[i - 1] */
       }
@@ -109,6 +136,9 @@ static int tremove (lua_State *L) {
   if (pos != size)  /* validate 'pos' if given */
     luaL_argcheck(L, 1 <= pos && pos <= size + 1, 1, "position out of bounds");
   lua_geti(L, 1, pos);  /* result = t[pos] */
+  if (pos < size && israw(L, 1, TAB_RW) &&
+      lua_rawmove(L, 1, pos + 1, size, pos, 1))
+    pos = size;  /* moved down elements in a block */
   for ( ; pos < size; pos++) {
     lua_geti(L, 1, pos + 1);
     lua_seti(L, 1, pos);  /* t[pos] = t[pos + 1] */
@@ -139,7 +169,11 @@ static int tmove (lua_State *L) {
     n = e - f + 1;  /* number of elements to move */
     luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
                   "destination wrap around");
-    if (t > e || t <= f || (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
+    if (israw(L, 1, TAB_R) && israw(L, tt, TAB_W) &&
+        lua_rawmove(L, 1, f, e, t, tt)) {
+      /* moved all elements in a block */
+    }
+    else if (t > e || t <= f || (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
       for (i = 0; i < n; i++) {
         lua_geti(L, 1, f + i);
         lua_seti(L, tt, t + i);
@@ -157,6 +191,23 @@ static int tmove (lua_State *L) {
 }
 
 
+static int tnew (lua_State *L) {
+  lua_Integer narr = luaL_optinteger(L, 1, 0);
+  lua_Integer nrec = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, 0 <= narr && narr <= INT_MAX, 1, "out of range");
+  luaL_argcheck(L, 0 <= nrec && nrec <= INT_MAX, 2, "out of range");
+  lua_createtable(L, (int)narr, (int)nrec);
+  return 1;
+}
+
+
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+
 static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i) {
   lua_geti(L, 1, i);
   if (!lua_isstring(L, -1))
@@ -173,6 +224,8 @@ static int tconcat (lua_State *L) {
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_optinteger(L, 4, last);
+  if (israw(L, 1, TAB_R) && lua_rawconcat(L, 1, i, last, sep, lsep))
+    return 1;  /* strings and numbers in the array part, joined in place */
   luaL_buffinit(L, &b);
   for (; i < last; i++) {
     addfield(L, &b, i);
@@ -212,6 +265,8 @@ static int unpack (lua_State *L) {
   n = (lua_Unsigned)e - i;  /* number of elements minus 1 (avoid overflows) */
   if (n >= (unsigned int)INT_MAX  || !lua_checkstack(L, (int)(++n)))
     return luaL_error(L, "too many results to unpack");
+  if (israw(L, 1, TAB_R) && lua_rawunpack(L, 1, i, e))
+    return (int)n;  /* copied all elements at once */
   for (; i < e; i++) {  /* push arg[i..e - 1] (to avoid overflows) */
     lua_geti(L, 1, i);
   }
@@ -411,10 +466,16 @@ static void auxsort (lua_State *L, IdxT lo, IdxT up,
 static int sort (lua_State *L) {
   lua_Integer n = aux_getn(L, 1, TAB_RW);
   if (n > 1) {  /* non-trivial interval? */
+    lua_Integer nt;  /* number of threads */
     luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    nt = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, 1 <= nt && nt <= INT_MAX, 3, "out of range");
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
     lua_settop(L, 2);  /* make sure there are two arguments */
+    if (lua_isnil(L, 2) && lua_type(L, 1) == LUA_TTABLE &&
+        lua_rawsort(L, 1, n, (int)nt))  /* numbers or strings in array? */
+      return 0;  /* sorted directly */
     auxsort(L, 1, (IdxT)n, 0);
   }
   return 0;
@@ -434,6 +495,8 @@ static const luaL_Reg tab_funcs[] = {
   {"remove", tremove},
   {"move", tmove},
   {"sort", sort},
+  {"new", tnew},
+  {"clear", tclear},
   {NULL, NULL}
 };
 
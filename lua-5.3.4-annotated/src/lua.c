@@ -129,7 +129,7 @@ static void laction (int i) {
 
 static void print_usage (const char *badoption) {
   lua_writestringerror("%s: ", progname);
-  if (badoption[1] == 'e' || badoption[1] == 'l')
+  if (badoption[1] == 'e' || badoption[1] == 'l' || badoption[1] == 'I')
     lua_writestringerror("'%s' needs argument\n", badoption);
   else
     lua_writestringerror("unrecognized option '%s'\n", badoption);
@@ -141,6 +141,7 @@ static void print_usage (const char *badoption) {
   "  -l name  require library 'name'\n"
   "  -v       show version information\n"
   "  -E       ignore environment variables\n"
+  "  -I file  restore heap image 'file' before anything else\n"
   "  --       stop handling options\n"
   "  -        stop handling options and execute stdin\n"
   ,
@@ -491,7 +492,8 @@ static int collectargs (char **argv, int *first) {
         break;
       case 'e':
         args |= has_e;  /* FALLTHROUGH */
-      case 'l':  /* both options need an argument */
+      case 'l':  /* these options need an argument */
+      case 'I':
         if (argv[i][2] == '\0') {  /* no concatenated argument? */
           i++;  /* try next 'argv' */
           if (argv[i] == NULL || argv[i][0] == '-')
@@ -507,6 +509,27 @@ static int collectargs (char **argv, int *first) {
 }
 
 
+/*
+** Processes option 'I', which must come before anything else changes
+** the fresh state. Only the first image is loaded. Returns 0 if the
+** image cannot be restored.
+*/
+static int handle_image (lua_State *L, char **argv, int n) {
+  int i;
+  for (i = 1; i < n; i++) {
+    int option = argv[i][1];
+    if (option == 'I') {
+      const char *fname = argv[i] + 2;
+      if (*fname == '\0') fname = argv[++i];
+      return (report(L, luaL_loadimage(L, fname)) == LUA_OK);
+    }
+    else if ((option == 'e' || option == 'l') && argv[i][2] == '\0')
+      i++;  /* skip argument */
+  }
+  return 1;
+}
+
+
 /*
 ** Processes options 'e' and 'l', which involve running Lua code.
 ** Returns 0 if some code raises an error.
@@ -516,7 +539,9 @@ static int runargs (lua_State *L, char **argv, int n) {
   for (i = 1; i < n; i++) {
     int option = argv[i][1];
     lua_assert(argv[i][0] == '-');  /* already checked */
-    if (option == 'e' || option == 'l') {
+    if (option == 'I' && argv[i][2] == '\0')
+      i++;  /* skip its argument; image was already loaded */
+    else if (option == 'e' || option == 'l') {
       int status;
       const char *extra = argv[i] + 2;  /* both options need an argument */
       if (*extra == '\0') extra = argv[++i];
@@ -569,6 +594,8 @@ static int pmain (lua_State *L) {
     lua_setfield(L, LUA_REGISTRYINDEX, "LUA_NOENV");
   }
   luaL_openlibs(L);  /* open standard libraries */
+  if (!handle_image(L, argv, script))  /* restore heap image */
+    return 0;
   createargtable(L, argv, argc, script);  /* create table 'arg' */
   if (!(args & has_E)) {  /* no option '-E'? */
     if (handle_luainit(L) != LUA_OK)  /* run LUA_INIT */
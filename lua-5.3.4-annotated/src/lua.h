@@ -326,6 +326,8 @@ LUA_API int (lua_geti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawget) (lua_State *L, int idx);
 LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
+LUA_API int (lua_rawunpack) (lua_State *L, int idx, lua_Integer i,
+                                                    lua_Integer j);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
@@ -343,6 +345,9 @@ LUA_API void  (lua_seti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawset) (lua_State *L, int idx);
 LUA_API void  (lua_rawseti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
+LUA_API int   (lua_rawmove) (lua_State *L, int src, lua_Integer f,
+                             lua_Integer e, lua_Integer t, int dst);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
 
@@ -404,9 +409,20 @@ LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 LUA_API int   (lua_error) (lua_State *L);
 
+// Library iterators that generic 'for' loops can run inline, once registered
+// with lua_setiterator().
+#define LUA_ITERNEXT	0
+#define LUA_ITERIPAIRS	1
+#define LUA_NUMITERS	2
+
 LUA_API int   (lua_next) (lua_State *L, int idx);
+LUA_API void  (lua_setiterator) (lua_State *L, int what, lua_CFunction f);
+LUA_API int   (lua_rawsort) (lua_State *L, int idx, lua_Integer n,
+                             int nthreads);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
+LUA_API int   (lua_rawconcat) (lua_State *L, int idx, lua_Integer i,
+                               lua_Integer j, const char *sep, size_t lsep);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
@@ -17,6 +17,7 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
 
 #include "lobject.h"
 #include "lstate.h"
@@ -31,6 +32,7 @@ static void PrintFunction(const Proto* f, int full);
 static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
+static int bundling=0;			/* write a bundle of modules? */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -56,6 +58,7 @@ static void usage(const char* message)
  fprintf(stderr,
   "usage: %s [options] [filenames]\n"
   "Available options are:\n"
+  "  -b       bundle: compile each file as a separate module\n"
   "  -l       list (use -l -l for full listing)\n"
   "  -o name  output to file 'name' (default is \"%s\")\n"
   "  -p       parse only\n"
@@ -86,6 +89,8 @@ static int doargs(int argc, char* argv[])
   }
   else if (IS("-"))			/* end of options; use stdin */
    break;
+  else if (IS("-b"))			/* bundle */
+   bundling=1;
   else if (IS("-l"))			/* list */
    ++listing;
   else if (IS("-o"))			/* output file */
@@ -162,13 +167,130 @@ static int writer(lua_State* L, const void* p, size_t size, void* u)
  return (fwrite(p,size,1,(FILE*)u)!=1) && (size!=0);
 }
 
+/*
+** bundles: modules are given as 'name=file' or as 'file', in which case
+** the module name comes from the file name ("a/b.lua" gives "a.b" and
+** "a/init.lua" gives "a"). See 'LUA_BUNDLESIG' in lualib.h for the format.
+*/
+
+typedef struct Module {
+ const char* name;
+ size_t namesize;
+ char* chunk;
+ size_t size;
+ size_t capacity;
+} Module;
+
+static int bufwriter(lua_State* L, const void* p, size_t size, void* u)
+{
+ Module* m=(Module*)u;
+ UNUSED(L);
+ if (m->size+size>m->capacity)
+ {
+  size_t n=2*m->capacity+size;
+  char* c=(char*)realloc(m->chunk,n);
+  if (c==NULL) return 1;
+  m->chunk=c; m->capacity=n;
+ }
+ memcpy(m->chunk+m->size,p,size);
+ m->size+=size;
+ return 0;
+}
+
+static const char* modname(lua_State* L, const char* arg, const char** filename)
+{
+ const char* eq=strchr(arg,'=');
+ const char* name;
+ size_t l;
+ if (eq!=NULL)
+ {
+  *filename=eq+1;
+  return lua_pushlstring(L,arg,eq-arg);
+ }
+ *filename=arg;
+ while (arg[0]=='.' && arg[1]==*LUA_DIRSEP) arg+=2;
+ l=strlen(arg);
+ if (l>4 && strcmp(arg+l-4,".lua")==0) l-=4;
+ if (l>5 && strncmp(arg+l-5,LUA_DIRSEP "init",5)==0) l-=5;
+ lua_pushlstring(L,arg,l);
+ name=luaL_gsub(L,lua_tostring(L,-1),LUA_DIRSEP,".");
+ lua_remove(L,-2);
+ return name;
+}
+
+static int modcmp(const void* a, const void* b)
+{
+ const Module* x=(const Module*)a;
+ const Module* y=(const Module*)b;
+ size_t l=(x->namesize<y->namesize) ? x->namesize : y->namesize;
+ int r=memcmp(x->name,y->name,l);
+ return (r!=0) ? r : (x->namesize>y->namesize)-(x->namesize<y->namesize);
+}
+
+static void putu32(FILE* D, size_t n)
+{
+ unsigned char b[4];
+ if (n>0xFFFFFFFFu) fatal("bundle too large");
+ b[0]=(unsigned char)n; b[1]=(unsigned char)(n>>8);
+ b[2]=(unsigned char)(n>>16); b[3]=(unsigned char)(n>>24);
+ fwrite(b,4,1,D);
+}
+
+static void bundle(lua_State* L, int argc, char* argv[])
+{
+ Module* m=(Module*)lua_newuserdata(L,argc*sizeof(Module));
+ size_t nameoffset,chunkoffset;
+ int i;
+ memset(m,0,argc*sizeof(Module));
+ for (i=0; i<argc; i++)
+ {
+  const char* filename;
+  m[i].name=modname(L,argv[i],&filename);	/* kept in the stack */
+  m[i].namesize=strlen(m[i].name);
+  if (luaL_loadfile(L,filename)!=LUA_OK) fatal(lua_tostring(L,-1));
+  if (listing) luaU_print(toproto(L,-1),listing>1);
+  if (lua_dump(L,bufwriter,&m[i],stripping)!=0) fatal("not enough memory");
+  lua_pop(L,1);
+ }
+ qsort(m,argc,sizeof(Module),modcmp);
+ for (i=1; i<argc; i++)
+  if (modcmp(&m[i-1],&m[i])==0)
+   fatal(lua_pushfstring(L,"duplicate module '%s'",m[i].name));
+ if (dumping)
+ {
+  FILE* D= (output==NULL) ? stdout : fopen(output,"wb");
+  if (D==NULL) cannot("open");
+  fwrite(LUA_BUNDLESIG,sizeof(LUA_BUNDLESIG)-1,1,D);
+  putu32(D,argc);
+  nameoffset=sizeof(LUA_BUNDLESIG)-1+4+16*(size_t)argc;
+  chunkoffset=nameoffset;
+  for (i=0; i<argc; i++) chunkoffset+=m[i].namesize;
+  for (i=0; i<argc; i++)		/* index */
+  {
+   putu32(D,nameoffset); putu32(D,m[i].namesize);
+   putu32(D,chunkoffset); putu32(D,m[i].size);
+   nameoffset+=m[i].namesize; chunkoffset+=m[i].size;
+  }
+  for (i=0; i<argc; i++) fwrite(m[i].name,m[i].namesize,1,D);
+  for (i=0; i<argc; i++) fwrite(m[i].chunk,m[i].size,1,D);
+  if (ferror(D)) cannot("write");
+  if (fclose(D)) cannot("close");
+ }
+ for (i=0; i<argc; i++) free(m[i].chunk);
+}
+
 static int pmain(lua_State* L)
 {
  int argc=(int)lua_tointeger(L,1);
  char** argv=(char**)lua_touserdata(L,2);
  const Proto* f;
  int i;
- if (!lua_checkstack(L,argc)) fatal("too many input files");
+ if (!lua_checkstack(L,argc+LUA_MINSTACK)) fatal("too many input files");
+ if (bundling)
+ {
+  bundle(L,argc,argv);
+  return 0;
+ }
  for (i=0; i<argc; i++)
  {
   const char* filename=IS("-") ? NULL : argv[i];
@@ -220,6 +342,7 @@ int main(int argc, char* argv[])
 #include "ldebug.h"
 #include "lobject.h"
 #include "lopcodes.h"
+#include "ltable.h"
 
 #define VOID(p)		((const void*)(p))
 
@@ -251,9 +374,8 @@ static void PrintString(const TString* ts)
  printf("%c",'"');
 }
 
-static void PrintConstant(const Proto* f, int i)
+static void PrintValue(const TValue* o)
 {
- const TValue* o=&f->k[i];
  switch (ttype(o))
  {
   case LUA_TNIL:
@@ -276,12 +398,37 @@ static void PrintConstant(const Proto* f, int i)
   case LUA_TSHRSTR: case LUA_TLNGSTR:
 	PrintString(tsvalue(o));
 	break;
+  case LUA_TTABLE:			/* template for OP_DUPTABLE */
+	{
+	const Table* t=hvalue(o);
+	const char* sep="";
+	int i,n=sizenode(t);
+	printf("{");
+	for (i=0; i<(int)t->sizearray; i++)
+	{
+	 printf("%s",sep); PrintValue(&t->array[i]); sep=",";
+	}
+	for (i=0; i<n; i++)
+	{
+	 const Node* node=gnode(t,i);
+	 if (ttisnil(gval(node))) continue;
+	 printf("%s[",sep); PrintValue(gkey(node)); printf("]=");
+	 PrintValue(gval(node)); sep=",";
+	}
+	printf("}");
+	break;
+	}
   default:				/* cannot happen */
 	printf("? type=%d",ttype(o));
 	break;
  }
 }
 
+static void PrintConstant(const Proto* f, int i)
+{
+ PrintValue(&f->k[i]);
+}
+
 #define UPVALNAME(x) ((f->upvalues[x].name) ? getstr(f->upvalues[x].name) : "-")
 #define MYK(x)		(-1-(x))
 
@@ -325,6 +472,7 @@ static void PrintCode(const Proto* f)
   switch (o)
   {
    case OP_LOADK:
+   case OP_DUPTABLE:
     printf("\t; "); PrintConstant(f,bx);
     break;
    case OP_GETUPVAL:
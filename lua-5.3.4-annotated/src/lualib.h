@@ -35,6 +35,18 @@ LUAMOD_API int (luaopen_string) (lua_State *L);
 #define LUA_UTF8LIBNAME	"utf8"
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_SEARCHLIBNAME	"search"
+LUAMOD_API int (luaopen_search) (lua_State *L);
+
+#define LUA_PEGLIBNAME	"peg"
+LUAMOD_API int (luaopen_peg) (lua_State *L);
+
+#define LUA_AIOLIBNAME	"aio"
+LUAMOD_API int (luaopen_aio) (lua_State *L);
+
+#define LUA_IMAGELIBNAME	"image"
+LUAMOD_API int (luaopen_image) (lua_State *L);
+
 #define LUA_BITLIBNAME	"bit32"
 LUAMOD_API int (luaopen_bit32) (lua_State *L);
 
@@ -47,10 +59,18 @@ LUAMOD_API int (luaopen_debug) (lua_State *L);
 #define LUA_LOADLIBNAME	"package"
 LUAMOD_API int (luaopen_package) (lua_State *L);
 
+/* mark for bundles of precompiled modules (see 'luac -b') */
+#define LUA_BUNDLESIG	"\x1bLuaBndl"
+
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
 
+/* save a state into a heap image and restore it into a fresh state */
+LUALIB_API int (luaL_saveimage) (lua_State *L, const char *filename,
+                                 int strip);
+LUALIB_API int (luaL_loadimage) (lua_State *L, const char *filename);
+
 
 
 #if !defined(lua_assert)
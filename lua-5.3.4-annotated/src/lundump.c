@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <limits.h>
 #include <string.h>
 
 #include "lua.h"
@@ -20,6 +21,7 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
 #include "lzio.h"
 
@@ -115,6 +117,95 @@ static void LoadCode (LoadState *S, Proto *f) {
 static void LoadFunction(LoadState *S, Proto *f, TString *psource);
 
 
+static void LoadTable (LoadState *S, TValue *o);
+
+
+/*
+** Loads a constant into 'o', which must be anchored (a table template
+** only if 'templ' is true; templates cannot nest)
+*/
+static void LoadValue (LoadState *S, TValue *o, int templ) {
+  int t = LoadByte(S);
+  switch (t) {
+  case LUA_TNIL:
+    setnilvalue(o);
+    break;
+  case LUA_TBOOLEAN:
+    setbvalue(o, LoadByte(S));
+    break;
+  case LUA_TNUMFLT:
+    setfltvalue(o, LoadNumber(S));
+    break;
+  case LUA_TNUMINT:
+    setivalue(o, LoadInteger(S));
+    break;
+  case LUA_TSHRSTR:
+  case LUA_TLNGSTR:
+    setsvalue2n(S->L, o, LoadString(S));
+    break;
+  case LUA_TTABLE:
+    if (!templ) error(S, "bad constant in");
+    LoadTable(S, o);
+    break;
+  default:
+    error(S, "bad constant in");
+  }
+}
+
+
+/*
+** Loads 'n' values into the array part of table 'a', growing it as the
+** values are read, so that a bad size in a malformed chunk fails as a
+** truncated chunk instead of allocating memory for values not there.
+*/
+static void LoadArray (LoadState *S, Table *a, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i == cast_int(a->sizearray)) {  /* array part is full? */
+      int size = (i < n / 2) ? 2 * i + 1 : n;
+      luaH_resizearray(S->L, a, cast(unsigned int, size));
+    }
+    LoadValue(S, &a->array[i], 0);
+  }
+}
+
+
+/*
+** Loads a table template (see OP_DUPTABLE). The keys and values of its
+** hash part go first into an auxiliary table 'e' (anchored in the
+** stack); then the template gets the sizes it was dumped with, and the
+** entries are inserted in their dumped order, with no rehash. (A hash
+** part larger than twice the number of entries, which the input cannot
+** vouch for, is made just large enough for them.)
+*/
+static void LoadTable (LoadState *S, TValue *o) {
+  lua_State *L = S->L;
+  Table *t = luaH_new(L);
+  Table *e;
+  int na, nh, n, i;
+  sethvalue(L, o, t);
+  na = LoadInt(S);
+  nh = LoadInt(S);
+  n = LoadInt(S);
+  if (na < 0 || nh < 0 || n < 0 || n > nh || n > INT_MAX / 2)
+    error(S, "bad table in");
+  LoadArray(S, t, na);
+  e = luaH_new(L);
+  sethvalue(L, L->top, e);
+  luaD_inctop(L);
+  LoadArray(S, e, 2 * n);
+  luaH_resize(L, t, cast(unsigned int, na),
+                    cast(unsigned int, (nh <= 2 * n) ? nh : n));
+  for (i = 0; i < 2 * n; i += 2) {
+    const TValue *k = &e->array[i];
+    if (ttisnil(k) || (ttisfloat(k) && luai_numisnan(fltvalue(k))))
+      error(S, "bad table in");
+    setobj2t(L, luaH_set(L, t, k), &e->array[i + 1]);
+  }
+  L->top--;  /* remove 'e' */
+}
+
+
 static void LoadConstants (LoadState *S, Proto *f) {
   int i;
   int n = LoadInt(S);
@@ -122,30 +213,8 @@ static void LoadConstants (LoadState *S, Proto *f) {
   f->sizek = n;
   for (i = 0; i < n; i++)
     setnilvalue(&f->k[i]);
-  for (i = 0; i < n; i++) {
-    TValue *o = &f->k[i];
-    int t = LoadByte(S);
-    switch (t) {
-    case LUA_TNIL:
-      setnilvalue(o);
-      break;
-    case LUA_TBOOLEAN:
-      setbvalue(o, LoadByte(S));
-      break;
-    case LUA_TNUMFLT:
-      setfltvalue(o, LoadNumber(S));
-      break;
-    case LUA_TNUMINT:
-      setivalue(o, LoadInteger(S));
-      break;
-    case LUA_TSHRSTR:
-    case LUA_TLNGSTR:
-      setsvalue2n(S->L, o, LoadString(S));
-      break;
-    default:
-      lua_assert(0);
-    }
-  }
+  for (i = 0; i < n; i++)
+    LoadValue(S, &f->k[i], 1);
 }
 
 
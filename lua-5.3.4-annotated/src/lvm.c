@@ -865,12 +865,19 @@ void luaV_execute (lua_State *L) {
         vmbreak;
       }
       vmcase(OP_NEWTABLE) {
-        int b = GETARG_B(i);
-        int c = GETARG_C(i);
+        /* presize it for the contents of the constructor or, if larger,
+           the sizes that tables created here reached before */
+        SizeHint *h = luaF_sitehint(L, cl->p, pcRel(ci->u.l.savedpc, cl->p));
+        unsigned int na = luaO_fb2int(GETARG_B(i));
+        unsigned int nh = luaO_fb2int(GETARG_C(i));
         Table *t = luaH_new(L);
         sethvalue(L, ra, t);
-        if (b != 0 || c != 0)
-          luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
+        t->hint = h;
+        h->nrefs++;
+        if (na < h->narray) na = h->narray;
+        if (nh < h->nhash) nh = h->nhash;
+        if (na != 0 || nh != 0)
+          luaH_resize(L, t, na, nh);
         checkGC(L, ra + 1);
         vmbreak;
       }
@@ -1240,7 +1247,37 @@ void luaV_execute (lua_State *L) {
         vmbreak;
       }
       vmcase(OP_TFORCALL) {
-        StkId cb = ra + 3;  /* call base */
+        StkId cb = ra + 4;  /* call base */
+        if (ttislcf(ra) && ttistable(ra + 1) &&
+            !(L->hookmask & (LUA_MASKCALL | LUA_MASKRET))) {
+          /* library iterator over a table: do its step here, with no call */
+          Table *h = hvalue(ra + 1);
+          int n = -1;  /* number of results (-1 if the call is needed) */
+          if (fvalue(ra) == G(L)->iterf[LUA_ITERNEXT]) {
+            setobjs2s(L, cb, ra + 2);
+            n = luaH_nextcursor(L, h, cb, ra + 3) ? 2 : 0;  /* see cursor */
+          }
+          else if (fvalue(ra) == G(L)->iterf[LUA_ITERIPAIRS] &&
+                   ttisinteger(ra + 2)) {
+            lua_Integer k = intop(+, ivalue(ra + 2), 1);
+            const TValue *v = luaH_getint(h, k);
+            if (!ttisnil(v)) {
+              setivalue(cb, k);
+              setobj2s(L, cb + 1, v);
+              n = 2;
+            }
+            else if (fasttm(L, h->metatable, TM_INDEX) == NULL)
+              n = 0;  /* end of the loop (else '__index' may go on) */
+          }
+          if (n >= 0) {
+            for (; n < GETARG_C(i); n++)
+              setnilvalue(cb + n);
+            i = *(ci->u.l.savedpc++);  /* go to next instruction */
+            ra = RA(i);
+            lua_assert(GET_OPCODE(i) == OP_TFORLOOP);
+            goto l_tforloop;
+          }
+        }
         setobjs2s(L, cb+2, ra+2);
         setobjs2s(L, cb+1, ra+1);
         setobjs2s(L, cb, ra);
@@ -1254,8 +1291,8 @@ void luaV_execute (lua_State *L) {
       }
       vmcase(OP_TFORLOOP) {
         l_tforloop:
-        if (!ttisnil(ra + 1)) {  /* continue loop? */
-          setobjs2s(L, ra, ra + 1);  /* save control variable */
+        if (!ttisnil(ra + 2)) {  /* continue loop? */
+          setobjs2s(L, ra, ra + 2);  /* save control variable */
            ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
         }
         vmbreak;
@@ -1314,6 +1351,13 @@ void luaV_execute (lua_State *L) {
         lua_assert(0);
         vmbreak;
       }
+      vmcase(OP_DUPTABLE) {
+        Table *t = luaH_new(L);
+        sethvalue(L, ra, t);
+        luaH_copy(L, t, hvalue(k + GETARG_Bx(i)));
+        checkGC(L, ra + 1);
+        vmbreak;
+      }
     }
   }
 }